@@ -4,25 +4,123 @@
 #include <unistd.h>
 #include <math.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdexcept>
 #include <iostream>
 
 #include <ugpio/ugpio.h>
 #include <cmath>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /////////////////////////////////////////////////////
 // Type Declarations:
 
-struct PolynomialComponent;
-
 struct StatisticalData;
 
 struct Point;
 
 struct ArrayOfPoints;
 
-struct PolynomialFunction;
+struct PolynomialCoefficients;
+
+struct ExpressionToken;
+
+struct ExpressionNode;
+
+struct ExpressionParser;
+
+struct ExpressionInstruction;
+
+struct CompiledExpression;
+
+struct StepperAxis;
+
+struct LimitEdgeSource;
+
+struct PwmBackend;
+
+struct StepTick;
+
+struct PlannedMove;
+
+struct MotionPlan;
+
+struct CurvePrimitive;
+
+struct CurveTracer;
+
+struct CurveFitter;
+
+struct PathSegment;
+
+struct TravelReport;
+
+struct SimplificationReport;
+
+struct StepTimingStatistics;
+struct LatencyHistogram;
+
+struct MotionPlanner;
+
+struct StepCommand;
+
+struct StepQueue;
+
+struct HardwareBackend;
+
+struct SimulatedStep;
+
+struct PlotBenchmarkCase;
+
+struct StepStreamHeader;
+
+struct StepStreamRecord;
+
+struct PlotEstimate;
+
+struct PlotterState;
+
+struct PointSource;
+
+struct ArrayPointCursor;
+
+struct UniformPointStream;
+
+struct VisibleInterval;
+
+struct LogLine;
+
+struct LogEntry;
+
+struct GcodeReader;
+
+struct GcodeLine;
+
+struct GcodeJob;
 
 //For the step motor function. This just makes it so that in the step motor
 //function, you can specify if you want to x axis to move, or the y axis to move.
@@ -35,19 +133,183 @@ enum Direction {
     CW, CCW
 };
 
+//What an expression does. The parser builds a tree out of these, and then they're what the compiled expression runs,
+//one after the other on a stack (so OP_ADD adds the top two things on the stack).
+//OP_POLYNOMIAL is a whole polynomial in x, so anything that's just a polynomial ends up being one instruction.
+enum ExpressionOp {
+    OP_CONSTANT, OP_X, OP_POLYNOMIAL, OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_POWER, OP_NEGATE, OP_SIN, OP_COS,
+    OP_EXP, OP_SQRT
+};
+
+enum ExpressionTokenType {
+    TOKEN_NUMBER, TOKEN_X, TOKEN_FUNCTION, TOKEN_PLUS, TOKEN_MINUS, TOKEN_TIMES, TOKEN_DIVIDE, TOKEN_POWER,
+    TOKEN_LEFT_PARENTHESIS, TOKEN_RIGHT_PARENTHESIS, TOKEN_END, TOKEN_INVALID
+};
+
+//What shape a move is. Everything but CURVE_LINE gets traced a step at a time by a CurveTracer.
+enum CurveShape {
+    CURVE_LINE, CURVE_ARC, CURVE_QUADRATIC, CURVE_CUBIC
+};
+
+//How important a console message is. Only messages at consoleLogLevel or above get printed.
+enum LogLevel {
+    LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR
+};
+
 /////////////////////////////////////////////////////
 // Function Declarations:
 
+//numPoints evenly spaced points from xMin to xMax, already in steps, with a NaN y-value for the ones outside the
+//window. It's just a UniformPointStream written into an array, which the caller has to delete[].
+ArrayOfPoints
+createArrayOfPolynomialPoints(const CompiledExpression &expression, const float xMax, const float yMin,
+                              const float yMax, const float xMin, const int numPoints);
+
+//The same points, one at a time, without ever having all of them at once: each point gets worked out, clipped to the
+//window and turned into steps in one go, so a curve with millions of points only needs a few kilobytes.
+//Polynomials get worked out with forward differencing (a handful of additions a point), and anything else gets worked
+//out UNIFORM_STREAM_CHUNK points at a time with evaluateExpressionBatch.
+//Returns false if the window is empty or there aren't at least two points.
+bool startUniformPointStream(UniformPointStream &stream, const CompiledExpression &expression, const float xMax,
+                             const float yMin, const float yMax, const float xMin, long numPoints);
+
+//Sets the forward differences up for point index from scratch, so the rounding errors from adding can't build up.
+void resetForwardDifferences(UniformPointStream &stream, long index);
+
+//These are for a PointSource. They both return false when there aren't any points left.
+//For a polynomial, nextUniformPoint only gives out the points inside the visible intervals, with a point exactly on
+//the edge of the window at each end of them and a NaN point in between them.
+bool nextUniformPoint(void *context, Point *point);
+
+bool nextArrayPoint(void *context, Point *point);
+
+//Same thing, but instead of numPoints evenly spaced points, it puts points wherever they're needed so that the lines
+//between them are never more than tolerance steps away from the real curve.
 ArrayOfPoints
-createArrayOfPolynomialPoints(const PolynomialFunction polynomial, int numPolynomialComponents, const float xMax,
-                              const float yMin, const float yMax, const float xMin, const int numPoints);
+createArrayOfAdaptivePolynomialPoints(const CompiledExpression &expression, const float xMax, const float yMin,
+                                      const float yMax, const float xMin, const float tolerance);
+
+void sampleAdaptively(const CompiledExpression &expression, const float xMax, const float yMin, const float yMax,
+                      const float xMin, const float tolerance, float a, float b, int depth,
+                      std::vector<Point> &points);
+
+void freeCoefficients(PolynomialCoefficients coefficients);
+
+//Works out the polynomial at x with Horner's method (no pow calls).
+double evaluateCoefficients(const PolynomialCoefficients &coefficients, double x);
+
+//Works out the polynomial at count x-values at once, using SIMD instructions if the CPU has them.
+void evaluateCoefficientsBatch(const PolynomialCoefficients &coefficients, const double *x, double *y, int count);
+
+int benchmarkPolynomialEvaluation(const char input[]);
+
+Point polynomialPointInSteps(const CompiledExpression &expression, const float xMax, const float yMin,
+                             const float yMax, const float xMin, float x);
+
+float distanceFromChord(Point point, Point lineStart, Point lineEnd);
+
+//y in steps, if it's inside the window (or within CLIP_SLACK steps of it, in which case it goes right on the edge).
+//Otherwise it's NaN.
+float windowYInSteps(double y, const float yMin, const float yMax);
+
+//Exact clipping. The polynomial can only go in or out of the window where it crosses yMin or yMax, so those crossings
+//get found with Sturm sequences, and the pieces between them that are inside the window are the visible intervals.
+//Returns how many visible intervals there are (never more than the degree + 1), in order from left to right.
+int findVisibleIntervals(const PolynomialCoefficients &coefficients, double xMin, double xMax, double yMin,
+                         double yMax, VisibleInterval *intervals);
+
+//Adds every x in (xMin, xMax) where the polynomial crosses value (goes from one side to the other, not just touches
+//it) to crossings.
+void findPolynomialCrossings(const PolynomialCoefficients &coefficients, double value, double xMin, double xMax,
+                             std::vector<double> &crossings);
+
+//The Sturm sequence of the polynomial: the polynomial, its derivative, and then the negative of the remainder of
+//dividing the last two, over and over. How many times the signs change along the sequence at a, minus how many at b,
+//is how many different roots there are in (a, b].
+std::vector<std::vector<double> > sturmSequence(const std::vector<double> &polynomial);
+
+int sturmSignChanges(const std::vector<std::vector<double> > &sequence, double x);
 
-PolynomialFunction stringToPolynomialFunction(const char input[]);
+//Splits (a, b] in half until every piece has at most one root, then finds the ones the polynomial crosses at with
+//bisection.
+void isolateCrossings(const std::vector<std::vector<double> > &sequence, double a, double b, int changesA,
+                      int changesB, int depth, std::vector<double> &crossings);
+
+double evaluatePolynomial(const std::vector<double> &polynomial, double x);
+
+//The expression compiler. It reads the expression once, left to right, and builds a tree out of it. Anything that
+//works out to a polynomial (like 2x(x - 1) + 3/4x^2 - 5) gets folded into one coefficient per power of x as the tree
+//is built, and anything that's just numbers (like sqrt(2) or 2^-1) gets worked out right away. Then the tree gets
+//turned into a short program for a stack machine, which is what actually gets run for every point.
+//It knows about + - * / ^, parentheses, x, pi, sin, cos, exp and sqrt, and 2x means 2 * x.
+//Returns false (and says why in error) if the expression is bad.
+bool compileExpression(const char input[], CompiledExpression *expression, std::string *error);
+
+void freeCompiledExpression(CompiledExpression &expression);
+
+void nextExpressionToken(ExpressionParser &parser);
+
+//The grammar, from the bottom up:
+//  primary    = number | x | function ( sum ) | ( sum )
+//  power      = primary [^ unary]
+//  unary      = - unary | + unary | power
+//  product    = unary {* unary | / unary | unary that doesn't start with a number}
+//  sum        = product {+ product | - product}
+//They all return the node they made, or -1 if the expression is bad.
+int parseExpressionSum(ExpressionParser &parser);
+
+int parseExpressionProduct(ExpressionParser &parser);
+
+int parseExpressionUnary(ExpressionParser &parser);
+
+int parseExpressionPower(ExpressionParser &parser);
+
+int parseExpressionPrimary(ExpressionParser &parser);
+
+void expressionError(ExpressionParser &parser, const std::string &message);
+
+//Makes a node, but works it out right away instead if it's a polynomial or a number.
+int addExpressionNode(ExpressionParser &parser, ExpressionOp op, int left, int right);
+
+int addPolynomialNode(ExpressionParser &parser, const std::vector<double> &polynomial);
+
+std::vector<double> addPolynomials(const std::vector<double> &a, const std::vector<double> &b, double bSign);
+
+std::vector<double> multiplyPolynomials(const std::vector<double> &a, const std::vector<double> &b);
+
+void emitExpressionNode(const ExpressionParser &parser, int node, CompiledExpression &expression);
+
+//Works out the expression at x. Polynomials are just Horner's method, everything else runs the program.
+double evaluateExpression(const CompiledExpression &expression, double x);
+
+//Works out the expression at count x-values. The program gets run on EXPRESSION_BATCH_SIZE x-values at a time, one
+//instruction at a time for all of them, so it only has to work out what each instruction is once per batch.
+void evaluateExpressionBatch(const CompiledExpression &expression, const double *x, double *y, int count);
+
+//Times how fast every expression in the parse benchmark corpus (or the ones it's given) compiles.
+int benchmarkExpressionParsing(int numExpressions, const char *const expressions[]);
+
+StepperAxis createStepperAxis(int stepGPIO, int directionGPIO, int minimumLimitGPIO, int maximumLimitGPIO);
+
+StepperAxis &stepperAxisFor(AXIS axis);
+
+bool setStepperAxisDirection(StepperAxis &stepperAxis, Direction direction);
+
+void setStepperAxisStepLevel(StepperAxis &stepperAxis, int level);
 
 bool stepMotor(AXIS axis, Direction direction);
 
 bool stepMotor(AXIS axis, Direction direction, const int stepTime);
 
+//Steps both motors in the same tick. stepX and stepY are -1, 0 or 1 (1 is CW, -1 is CCW, 0 is don't move).
+bool stepMotors(int stepX, int stepY);
+
+bool stepMotors(int stepX, int stepY, const int stepTime);
+
+bool limitSwitchPressed(AXIS axis, Direction direction);
+
+void writeStepTrace();
+
 void requestGPIOAndSetDirectionOutput(int gpio);
 
 void requestGPIOAndSetDirectionInput(int gpio);
@@ -61,902 +323,7242 @@ void startPWM(int gpio, int frequency, int dutyCycle);
 
 void stopPWM(int gpio);
 
+//Picks how PWM gets done: the sysfs PWM channel if it's there, and fast-gpio if it isn't.
+void openPWM(int gpio);
+
+void closePWM(int gpio);
+
+//Which pwmchip channel a pin is on, or -1 if it isn't a PWM pin.
+int sysfsPWMChannel(int gpio);
+
+bool openSysfsPWM(int gpio);
+
+bool setSysfsPWM(int gpio, int frequency, int dutyCycle);
+
+bool writeSysfsPWMValue(int file, long value);
+
+void stopSysfsPWM(int gpio);
+
+void closeSysfsPWM(int gpio);
+
+bool openFastGpioPWM(int gpio);
+
+bool setFastGpioPWM(int gpio, int frequency, int dutyCycle);
+
+void stopFastGpioPWM(int gpio);
+
+void closeFastGpioPWM(int gpio);
+
+bool openMockPWM(int gpio);
+
+bool setMockPWM(int gpio, int frequency, int dutyCycle);
+
+void stopMockPWM(int gpio);
+
+void closeMockPWM(int gpio);
+
 void freeGPIO(int gpio);
 
 bool readGPIO(int gpio);
 
-//Returns the distance it took to go to the point specified.
-float gotoPoint(int x, int y);
+//The real hardware: libugpio for the GPIOs, and CLOCK_MONOTONIC for time.
+int isOmegaGPIORequested(int gpio);
 
-//Returns the distance it took to go to the point specified.
-float gotoPoint(Point point);
+int requestOmegaGPIO(int gpio);
 
-bool gotoPointHelper(const int x, const int y);
+int setOmegaGPIODirectionOutput(int gpio, int value);
 
-StatisticalData drawPolynomial(ArrayOfPoints points);
+int setOmegaGPIODirectionInput(int gpio);
 
-bool gotoZero();
+int freeOmegaGPIO(int gpio);
 
-bool openLogFile(const char filename[]);
+int setOmegaGPIOValue(int gpio, int value);
 
-bool closeLogFile();
+int getOmegaGPIOValue(int gpio);
 
-/////////////////////////////////////////////////////
-// Global Variables:
+void getOmegaTime(struct timespec *now);
 
-const int X_AXIS_DIRECTION_GPIO = 0;
-const int X_AXIS_STEP_GPIO = 1;
-const int Y_AXIS_DIRECTION_GPIO = 5; //SDA I2C GROUP ONION OMEGA
-const int Y_AXIS_STEP_GPIO = 4; //SCL I2C GROUP ONION OMEGA
+void sleepUntilOmegaTime(const struct timespec *deadline);
 
-const int SERVO_PIN = 18; //PWM0 GROUP ON ONION OMEGA
-const int SERVO_FREQUENCY = 50; //50Hz
-const int SERVO_UP_DUTY_CYCLE = 50; //50% duty cycle for up
-const int SERVO_DOWN_DUTY_CYCLE = 0; //0% duty cycle for down
-const int SERVO_CHANGE_TIME = 100 * 1000; //Time required for the servo to change its position
+void sleepOmega(int microseconds);
 
-const int X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO = 45; //TX1 UART1 GROUP ONION OMEGA
-const int X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO = 46; //RX1 UART1 GROUP ONION OMEGA
-const int Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO = 2;
-const int Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO = 3;
+//The simulated hardware: a model of the plotter that moves when its step pins get pulsed, presses its limit switches
+//at 0 and X_MAX/Y_MAX, and has a virtual clock that sleeping just moves forwards.
+void useSimulatedHardware(int startX, int startY);
 
+int isSimulatedGPIORequested(int gpio);
 
-const int STEP_TIME = 2 * 1000; //time it takes to step a stepper motor in microseconds.
-const float X_MAX = 1650; //The x-limit of the plotter.
-const float Y_MAX = 2100; //The y-limit of the plotter.
+int requestSimulatedGPIO(int gpio);
 
-int currentX = 0; // Assuming the plotter starts at x-origin
-int currentY = 0; // Assuming the plotter starts at y-origin
+int setSimulatedGPIODirectionOutput(int gpio, int value);
 
-std::ofstream logFile;
-const char LOG_FILE_NAME[] = "log_file.txt";
+int setSimulatedGPIODirectionInput(int gpio);
 
-const float SLOPE_PRECISION = 1;
+int freeSimulatedGPIO(int gpio);
 
-/////////////////////////////////////////////////////
-// Function Definitions:
+int setSimulatedGPIOValue(int gpio, int value);
 
-//This is a "polynomial component", if the polynomial function is 2x^2 + 3x + 4, then it contains three "components:"
-//2x^2, 3x, and 4. For the 2x^2 thing, the constant is 2, and the exponent is 2. For the 3x, the constant is 3, and the
-//exponent is 1. You can guess what 4 is.
-struct PolynomialComponent {
-    int constant;
-    int exponent;
-};
+int getSimulatedGPIOValue(int gpio);
 
-//This is going to be used in an array of points that will be used to store all of the points on the polynomial.
-struct Point {
-    float x;
-    float y;
-};
+void getSimulatedTime(struct timespec *now);
 
-struct ArrayOfPoints {
-    Point *points;
-    int numPoints;
-};
+void sleepUntilSimulatedTime(const struct timespec *deadline);
 
-struct StatisticalData {
-    float lengthOfTime;
-    float lengthOfFunction;
-};
+void sleepSimulated(int microseconds);
 
-struct PolynomialFunction {
-    PolynomialComponent *components;
-    int numComponents;
-};
+void simulateStepPulse(AXIS axis);
 
-ArrayOfPoints
-createArrayOfPolynomialPoints(const PolynomialFunction polynomial, int numPolynomialComponents, const float xMax,
-                              const float yMin, const float yMax, const float xMin, const int numPoints) {
+//Writes every step the simulated plotter took as CSV: time (ns), x, y, and whether the pen was down.
+bool writeSimulatedStepTrace(const char filename[]);
 
-    //Close inputs:
-    if (xMax <= xMin || yMax <= yMin) {
-        ArrayOfPoints failure;
-        failure.points = nullptr;
-        failure.numPoints = 0;
-        return failure;
-    }
+//The time on the hardware's clock, in seconds.
+double hardwareSeconds();
 
-    ArrayOfPoints points;
-    points.numPoints = numPoints;
-    points.points = new Point[numPoints];
+//Watches the limit switches in a background thread, so that stepping doesn't have to read them every step.
+bool startLimitSwitchMonitor(LimitEdgeSource source);
 
-    //For each point, lets determine an x-value based on windowSize.
-    //So, there are numPoints number of points, and we have to have them all equally distributed between xMin and xMax.
-    //What is the difference between xMax and xMin?
-    float xWindowSize = xMax - xMin;
+void stopLimitSwitchMonitor();
 
-    //Now find the distance between each of the domain points.
-    float deltaX = xWindowSize / numPoints;
+void limitSwitchMonitorLoop();
 
-    //Now let's set a currentDomainX, and we'll add deltaX to it and set all the points x-values to it.
-    //It equals to xMin by default because that's the minimum value we want.
-    float currentDomainX = xMin;
+int limitSwitchIndex(AXIS axis, Direction direction);
 
-    for (int i = 0; i < numPoints; i++) {
-        points.points[i].x = currentDomainX;
-        //Setting all the y-values to 0 is very important. It allows us to add to y later.
-        points.points[i].y = 0;
-        currentDomainX += deltaX;
-    }
+//Remembers that this switch got hit, unless another one already has been since the last clearLimitSwitchTrip.
+void tripLimitSwitch(int index);
 
-    //Now, for every polynomial component, we shall ADD (not set!) a y-value to every x-value.
-    for (int currentPolynomialComponent = 0;
-         currentPolynomialComponent < numPolynomialComponents; currentPolynomialComponent++) {
-        //For each x-value in the array:
-        for (int i = 0; i < numPoints; i++) {
-            //We make a yValue that is the pow(points->points[i].x, polynomial[currentPolynomialComponent].exponent)
-            float yValue = (float) pow(points.points[i].x,
-                                       (double) polynomial.components[currentPolynomialComponent].exponent);
-            //Now we scale yValue using the constant.
-            yValue *= (float) polynomial.components[currentPolynomialComponent].constant;
+bool getLimitSwitchTrip(AXIS *axis, Direction *direction);
 
-            //Then we add our current y value to the point's y value, so that we can add all the polynomial function
-            //together.
-            points.points[i].y += yValue;
-        }
-    }
+void clearLimitSwitchTrip();
 
-    //Now that we have all the points, we must ensure that they are all valid.
-    for (int i = 0; i < numPoints; i++) {
-        //Let's see if the y-value fits inside of our window.
-        if (points.points[i].y > yMax || points.points[i].y < yMin) {
-            points.points[i].y = NAN;
-        }
-    }
+bool openSysfsLimitEdges();
 
-    std::cout << "Before translation:" << std::endl << std::endl;
+int waitForSysfsLimitEdge(int timeout, int *index, bool *pressed);
 
+void closeSysfsLimitEdges();
 
-    for (int i = 0; i < numPoints; i++) {
-        std::cout << "Point " << i + 1 << ": (" << points.points[i].x << ", " << points.points[i].y << ")" << std::endl;
-    }
+bool openSimulatedLimitEdges();
 
-    //Now, let's translate all these points so that the first x-value is 0, and the lowest y-value is 0.
-    //To get where the lowest x-value is, just look at the first item of the array, and then take 0-it and
-    //see by how much we need to add to every point to translate the points.
-    float translateX = -points.points[0].x;
+int waitForSimulatedLimitEdge(int timeout, int *index, bool *pressed);
 
-    //Now, lets find the minimum value of y:
-    float translateY = -yMin;
+void closeSimulatedLimitEdges();
 
-    //Now Lets actually translate them:
-    for (int i = 0; i < numPoints; i++) {
-        points.points[i].x += translateX;
-        if (!std::isnan(points.points[i].y)) {
-            points.points[i].y += translateY;
-        }
-    }
+bool simulateLimitSwitchEdge(int index, bool pressed);
 
-    std::cout << "After translation:" << std::endl << std::endl;
-    for (int i = 0; i < numPoints; i++) {
-        std::cout << "Point " << i + 1 << ": (" << points.points[i].x << ", " << points.points[i].y << ")" << std::endl;
-    }
+//Returns the distance it took to go to the point specified.
+float gotoPoint(int x, int y);
 
-    //Now let's scale them!
-    //All x-values must be scaled from the range of xMin to xMax to the range of 0-X_MAX
-    for (int i = 0; i < numPoints; i++) {
-        //Let's first do that by normalizing the data, which is getting it from its range to 0-1.
-        //Then afterward, we'll multiply that by X_MAX.
-        points.points[i].x = (points.points[i].x - 0) / (xMax - xMin);
-        points.points[i].x *= X_MAX;
-        if (!std::isnan(points.points[i].y)) {
-            points.points[i].y = (points.points[i].y - 0) / (yMax - yMin);
-            points.points[i].y *= Y_MAX;
-        }
-    }
+//Returns the distance it took to go to the point specified.
+float gotoPoint(Point point);
 
-    std::cout << "After normalization and then scaling:" << std::endl << std::endl;
-    for (int i = 0; i < numPoints; i++) {
-        std::cout << "Point " << i + 1 << ": (" << points.points[i].x << ", " << points.points[i].y << ")" << std::endl;
-    }
+//Returns the distance it took to do the move, speeding up and slowing down like the planner said to.
+float gotoPoint(const PlannedMove &move);
 
-    std::cout << "End of whatsit function:" << std::endl << std::endl;
-    return points;
-}
+//Goes along a curved move, a tick at a time. Returns how far along the curve it went.
+float traceCurve(const PlannedMove &move);
 
-PolynomialFunction stringToPolynomialFunction(const char input[]) {
-    PolynomialFunction function;
-    function.components = new PolynomialComponent[50];
-    function.numComponents = 0;
-    PolynomialFunction rejected;
-    rejected.components = NULL;
-    rejected.numComponents = 0;
+//Turns the points into moves (straight lines, or curves if fitCurves is on), and figures out how fast each one can go.
+MotionPlan planMotion(ArrayOfPoints points);
 
-    int SizeofString = 1;
-    int m = 0;
-    while (input[m] != 0) {
-        SizeofString++;
-        m++;
-    }
+//The motion planner works one point at a time, and sends each move to output as soon as its speeds can't change
+//anymore, so it never needs the whole plan in memory.
+void startMotionPlanner(MotionPlanner &planner, int startX, int startY,
+                        void (*output)(const PlannedMove &move, void *context), void *context);
 
-    bool Done = false;
-    int iterator = 0;
-    int i = 0;
-    int size = 0;
-    int calculatedvalue = 0;
-    bool notNumber = false;
-    int k = (size - 1);
-    int sum = 0;
-    char temp[SizeofString];
-    while (!Done) {
-
-        bool negativeSign = false;
-        PolynomialComponent Section;
-
-        if ((input[iterator] == '+') || input[iterator] == '-') {
-            if (input[iterator] == '-') {
-                negativeSign = true;
-            }
-            iterator++;
-        }
-        if (input[iterator] == 'x' || input[iterator] == 'X') {
-            if (negativeSign) {
-                Section.constant = -1;
-            } else {
-                Section.constant = 1;
-            }
-        }
-        if (input[iterator] == '0') {
-            while ((input[iterator] != '+') || (input[iterator] != '-')) {
-                iterator++;
-            }
-        } else {
-            if ((input[iterator] >= '1') && (input[iterator] <= '9')) {
-                /// Initialize to all nulls for the meme ///
-                for (int i = 0; i < SizeofString; i++) {
-                    temp[i] = 0;
-                }
+void addPointToMotionPlanner(MotionPlanner &planner, Point point);
 
-                /// Inputing the values into a temp array so we may turn them into ints///
-                notNumber = false;
-                for (int i = 0; !notNumber; i++) {
-                    temp[i] = input[iterator];
-                    iterator++;
+void addMoveToMotionPlanner(MotionPlanner &planner, const PlannedMove &move);
 
-                    /// If the next value of of iterator is an X, then the for loop will end ///
-                    /// If the value after the numbers are not X's then we know that it is an incorrect input to what we have ///
-                    if ((input[iterator] == 'x') || (input[iterator] == 'X')) {
-                        notNumber = true;
-                    }
-                    if (input[iterator] == 0) {
-                        notNumber = true;
-                    }
-                }
-                /// finding the size fo the temp array ///
-                size = 0;
-                while (temp[size] != 0) {
-                    size++;
-                }
-                /// Time to convert to int///
-                k = (size - 1);
-                calculatedvalue = 0;
-                sum = 0;
-                for (int i = 0; i < size; i++) {
-                    calculatedvalue = ((int) temp[i] - '0') * pow(10, k);
-                    sum = calculatedvalue + sum;
-                    k = (k - 1);
-                    /// Overflow then function fails///
-                    if (sum < 0) {
-                        delete function.components;
-                        return rejected;
-                    }
-                }
-                ///Negative is true sets the sum negative ///
-                if (negativeSign) {
-                    sum = -sum;
-                }
-                Section.constant = sum;
-            }
-        }
-        if (input[iterator + 1] == '^') {
-            iterator += 2;
-            for (int i = 0; i < SizeofString; i++) {
-                temp[i] = 0;
-            }
+//Adds a pen down move along the curve, from wherever the last move ended to end.
+void addCurveToMotionPlanner(MotionPlanner &planner, const CurvePrimitive &curve, Point end);
 
-            notNumber = false;
-            for (int i = 0; !notNumber; i++) {
-                temp[i] = input[iterator];
-                /// If the next value of of iterator is an + or -, then the for loop will end ///
-                /// If the value after the numbers are not +'s or  then we know that it is an incorrect input to what we have ///
-                if ((input[iterator + 1] == '+') || (input[iterator + 1] == '-') || (input[iterator + 1] == 0)) {
-                    notNumber = true;
-                }
-                iterator++;
-            }
+//Works out where the curve is (order 0), or its first or second derivative (order 1 or 2), at t from 0 to 1.
+void evaluateCurve(const CurvePrimitive &curve, double t, int order, double *x, double *y);
 
-            if (input[iterator] == 0) {
-                Done = true;
-                /// finding the size fo the temp array ///
-                int size = 0;
-                while (temp[size] != 0) {
-                    size++;
-                }
-                /// Time to convert to int///
-                calculatedvalue = 0;
-                k = (size - 1);
-                sum = 0;
-                for (int i = 0; i < size; i++) {
-                    calculatedvalue = ((int) temp[i] - '0') * pow(10, k);
-                    sum = calculatedvalue + sum;
-                    k = (k - 1);
-                    /// Overflow then function fails///
-                    if (sum < 0) {
-                        delete function.components;
-                        return rejected;
-                    }
-                }
-                Section.exponent = sum;
-            } else {
-                /// finding the size fo the temp array ///
-                int size = 0;
-                while (temp[size] != 0) {
-                    size++;
-                }
-                /// Time to convert to int///
-                calculatedvalue = 0;
-                k = (size - 1);
-                sum = 0;
-                for (int i = 0; i < size; i++) {
-                    calculatedvalue = ((int) temp[i] - '0') * pow(10, k);
-                    sum = calculatedvalue + sum;
-                    k = (k - 1);
-                    /// Overflow then function fails///
-                    if (sum < 0) {
-                        delete function.components;
-                        return rejected;
-                    }
-                }
-                Section.exponent = sum;
-            }
-        } else if ((input[iterator] == 'x') || (input[iterator] == 'X')) {
-            Section.exponent = 1;
-            iterator++;
-        } else {
-            Section.exponent = 0;
-            if (input[iterator] == 0) {
-                Done = true;
-            } else {
-                iterator++;
-            }
-        }
-        function.components[i] = Section;
-        function.numComponents++;
-        i++;
-        if (input[iterator] == 0) {
-            Done = true;
-        }
-    }
-    return function;
-}
+//Fills in the move's bendSpeeds and bendTicks (it needs numTicks already), and sets cruiseSpeed to the fastest of them.
+void setCurveSpeedLimits(PlannedMove &move);
 
-bool stepMotor(AXIS axis, Direction direction) {
+//How fast the pen can go around a bend with this radius (in steps), in ticks per second.
+float bendSpeed(double radius);
 
-    //Local step and direction GPIOs so that they can be set based on inputs.
-    int stepGPIO;
-    int dirGPIO;
-    switch (axis) {
-        case X:
-            stepGPIO = X_AXIS_STEP_GPIO;
-            dirGPIO = X_AXIS_DIRECTION_GPIO;
-            break;
-        case Y:
-            stepGPIO = Y_AXIS_STEP_GPIO;
-            dirGPIO = Y_AXIS_DIRECTION_GPIO;
-            break;
-    }
+//1 / the radius of the bend in the curve at t.
+double curveCurvature(const CurvePrimitive &curve, double t);
 
-    switch (direction) {
-        case CW:
+//The fastest the curve's bends let the pen go at this many ticks along it.
+float curveSpeedLimit(const PlannedMove &move, float position);
 
-            //Check to see if the limit switch is yelling at you:
-            //Gotta determine if it's the X or the Y axis first though.
-            //IF Y and if CW, then use Limit Y MAX.
-            if (stepGPIO == Y_AXIS_STEP_GPIO && readGPIO(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, Read Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO Limit switch true."
-                          << std::endl;
-                if (readGPIO(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
-                }
-                return false;
-            }
-            //IF X and CW, then use Limit X MAX.
-            if (stepGPIO == X_AXIS_STEP_GPIO && readGPIO(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO Read Limit switch true."
-                          << std::endl;
-                if (readGPIO(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
-                }
-                return false;
-            }
+//The fastest the move can go right at its start (or end, if atEnd is true).
+float moveEndSpeed(const PlannedMove &move, bool atEnd);
 
-            //set directionGPIO to HIGH, because GND is CW.
-            gpio_set_value(dirGPIO, 1);
-            break;
-        case CCW:
-
-            //Check to see if the limit switch is yelling at you:
-            //Gotta determine if it's the X or the Y axis first though.
-            //IF Y and if CCW, then use Limit Y MIN.
-            if (stepGPIO == Y_AXIS_STEP_GPIO && readGPIO(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, Read Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO Limit switch true."
-                          << std::endl;
-                if (readGPIO(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
-                }
-                return false;
-            }
-            //IF X and CCW, then use Limit X MIN.
-            if (stepGPIO == X_AXIS_STEP_GPIO && readGPIO(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, Read X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO Limit switch true."
-                          << std::endl;
-                if (readGPIO(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
-                }
-                return false;
-            }
+//Lowers the speeds at numPlaces places, ticks[i] ticks along, so getting from one to the next never takes more than
+//ACCELERATION.
+void evenOutSpeeds(float *speeds, const float *ticks, int numPlaces);
 
-            //set directionGPIO to GND, because HIGH is CCW.
-            gpio_set_value(dirGPIO, 0);
-            break;
-    }
+//Roughly how long (in seconds) it takes to go through the places, going at most speeds[i] at each one (it evens them
+//out first). If speedUpBetween is false, the pen can't go any faster between two places than it can at them.
+float runTime(float *speeds, const float *ticks, int numPlaces, bool speedUpBetween);
 
-    //sleep for a few more milliseconds, because this function will probably
-    //be called consecutively all the time with no breaks.
-    //We also need to allow time for the direction pin to charge up.
-    usleep(STEP_TIME);
+//Which way a move is heading at its start (or end, if atEnd is true). (startX, startY) is where the move starts.
+void moveDirection(const PlannedMove &move, int startX, int startY, bool atEnd, float *dx, float *dy);
 
-    //pulse step on:
-    gpio_set_value(stepGPIO, 1);
-    //sleep for a few milliseconds, because you need to let the coils charge etc.
-    usleep(STEP_TIME);
-    //pull step to GND, because its GND activated:
-    gpio_set_value(stepGPIO, 0);
-    return true;
-}
+//A CurveTracer gives the steps to take along a curve one tick at a time, all on whole steps. The planner runs one to
+//count the ticks, and the step thread runs the same one again to actually take them.
+void startCurveTracer(CurveTracer &tracer, const CurvePrimitive &curve, int startX, int startY, int endX, int endY);
 
-bool stepMotor(AXIS axis, Direction direction, const int stepTime) {
+//Returns false once it's at the end.
+bool nextCurveStep(CurveTracer &tracer, int *stepX, int *stepY);
 
-    //Local step and direction GPIOs so that they can be set based on inputs.
-    int stepGPIO;
-    int dirGPIO;
-    switch (axis) {
-        case X:
-            stepGPIO = X_AXIS_STEP_GPIO;
-            dirGPIO = X_AXIS_DIRECTION_GPIO;
-            break;
-        case Y:
-            stepGPIO = Y_AXIS_STEP_GPIO;
-            dirGPIO = Y_AXIS_DIRECTION_GPIO;
-            break;
-    }
+//The curve fitter sits in front of the motion planner. It collects runs of points, and sends the planner arcs and
+//Béziers in place of as many of the straight lines between them as it can, within CURVE_FIT_TOLERANCE steps.
+void startCurveFitter(CurveFitter &fitter, MotionPlanner *planner);
 
-    switch (direction) {
-        case CW:
+void addPointToCurveFitter(CurveFitter &fitter, Point point);
 
-            //Check to see if the limit switch is yelling at you:
-            //Gotta determine if it's the X or the Y axis first though.
-            //IF Y and if CW, then use Limit Y MAX.
-            if (stepGPIO == Y_AXIS_STEP_GPIO && readGPIO(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, Read Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO Limit switch true."
-                          << std::endl;
-                if (readGPIO(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
-                }
-                return false;
-            }
-            //IF X and CW, then use Limit X MAX.
-            if (stepGPIO == X_AXIS_STEP_GPIO && readGPIO(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO Read Limit switch true."
-                          << std::endl;
-                if (readGPIO(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
-                }
-                return false;
-            }
+//Sends the planner everything that's left. The planner still has to be finished afterwards.
+void finishCurveFitter(CurveFitter &fitter);
 
-            //set directionGPIO to HIGH, because GND is CW.
-            gpio_set_value(dirGPIO, 1);
-            break;
-        case CCW:
-
-            //Check to see if the limit switch is yelling at you:
-            //Gotta determine if it's the X or the Y axis first though.
-            //IF Y and if CCW, then use Limit Y MIN.
-            if (stepGPIO == Y_AXIS_STEP_GPIO && readGPIO(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, Read Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO Limit switch true."
-                          << std::endl;
-                if (readGPIO(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
+//Sends the planner the longest piece from the start of the run that fits a curve (or just the next line), and keeps
+//the rest. The piece can't end past points[lastEnd].
+void sendFittedPiece(CurveFitter &fitter, int lastEnd);
+
+//Tries to fit an arc, a quadratic Bézier and then a cubic Bézier through points[0] to points[last], in that order.
+//The tangents are unit vectors, the way the points are heading at each end.
+bool fitCurve(const Point *points, int last, double startTangentX, double startTangentY, double endTangentX,
+              double endTangentY, CurvePrimitive *curve);
+
+//How far the curve gets from the points, and from the lines between them. parameters starts off as a guess of where
+//on the curve each point is, and gets moved to the closest spot.
+bool curveFitsPoints(const CurvePrimitive &curve, const Point *points, int last, double *parameters);
+
+//The way the run of points is heading at points[i], as a unit vector.
+void runTangent(const Point *points, int numPoints, int i, double *tangentX, double *tangentY);
+
+void finishMotionPlanner(MotionPlanner &planner);
+
+void recalculateMotionPlannerSpeeds(MotionPlanner &planner);
+
+void sendFirstPlannedMove(MotionPlanner &planner);
+
+void addMoveToMotionPlan(const PlannedMove &move, void *context);
+
+//A single producer, single consumer ring buffer of moves, so the planner thread can plan while the step thread steps.
+bool tryPushStepCommand(StepQueue &queue, const StepCommand &command);
+
+bool tryPopStepCommand(StepQueue &queue, StepCommand *command);
+
+void pushStepCommand(StepQueue &queue, const StepCommand &command);
+
+void popStepCommand(StepQueue &queue, StepCommand *command);
+
+void pushMoveToStepQueue(const PlannedMove &move, void *context);
+
+float junctionSpeed(const PlannedMove &previous, const PlannedMove &next, int previousX, int previousY);
+
+//The same, for a corner where the pen is heading (previousDX, previousDY) and turns to head (nextDX, nextDY).
+float cornerSpeed(float previousDX, float previousDY, float nextDX, float nextDY);
+
+int profileTickTime(const PlannedMove &move, int tick);
+
+//Gets rid of points that are within tolerance steps of the line the points around them already make.
+ArrayOfPoints simplifyPoints(ArrayOfPoints points, float tolerance, SimplificationReport *report);
+
+float distanceFromSegment(Point point, Point segmentStart, Point segmentEnd);
+
+//How long the plan will take to move, in seconds (not counting the pen going up and down).
+float estimatePlanTime(MotionPlan plan);
+
+//Reorders (and flips) the pen down pieces of the points so the pen spends less time travelling with the pen up.
+ArrayOfPoints optimizePenUpTravel(ArrayOfPoints points, Point start, TravelReport *report);
+
+float travelDistance(Point from, Point to);
+
+float penUpTravel(ArrayOfPoints points, const std::vector<PathSegment> &segments, Point start);
+
+bool twoOptPass(ArrayOfPoints points, std::vector<PathSegment> &segments, Point start);
+
+bool orOptPass(ArrayOfPoints points, std::vector<PathSegment> &segments, Point start);
+
+//Does one move, lifting or lowering the pen first if it needs to, and adds how far the pen went while it was down to
+//lengthDrawn. Returns false if a limit switch stopped it before the end of the move.
+bool runMove(const PlannedMove &move, bool *penIsDown, float *lengthDrawn);
+
+//What the planner thread runs: it plans the points and pushes the moves into the queue, then an end of job command.
+void runPlannerThread(PointSource source, int startX, int startY, StepQueue *queue);
+
+//What the step thread runs: it makes itself real time, and then does moves out of the queue until the job ends. If a
+//move gets stopped by a limit switch, it lifts the pen and throws away the rest of the job.
+void runStepThread(StepQueue *queue, float *lengthDrawn);
+
+//Asks for SCHED_FIFO for the thread that calls it, so nothing else gets to run in the middle of a step.
+bool makeThisThreadRealTime();
+
+//Locks all of our memory into RAM, so a step never has to wait for a page to get loaded.
+bool lockMemory();
+
+//Step timing. Every sleep in stepMotors goes until an absolute deadline on CLOCK_MONOTONIC, instead of for a relative
+//time, so being a bit late on one step doesn't make every step after it late too.
+void resetStepClock();
+
+void stepClockSleep(int microseconds);
+
+void logStepTimingStatistics();
+
+//Latency histograms for the things a step is made of: GPIO writes, GPIO reads (the limit switches), how far past its
+//deadline a step clock sleep wakes up, and setting the pen's PWM. They're HDR style, so the buckets get wider as the
+//times get longer but always stay within about 6% of the time, and they're only atomic counters, so any thread can
+//add to them without a lock.
+long latencyNow();
+
+void recordLatency(LatencyHistogram &histogram, long nanoseconds);
+
+int latencyBucketFor(long nanoseconds);
+
+long latencyBucketStart(int bucket);
+
+long latencyPercentile(const LatencyHistogram &histogram, double percentile);
+
+void logLatencyHistogram(const char name[], const LatencyHistogram &histogram);
+
+void logLatencyReport();
+
+void writeGPIO(int gpio, int value);
+
+//Draws the points. If homeFirst is true it goes to zero before it starts (unless the position is already trusted),
+//otherwise it starts from wherever it is (with the pen already up), which is what batch jobs do after the first curve.
+StatisticalData drawPolynomial(ArrayOfPoints points, bool homeFirst);
+
+//Draws numPoints evenly spaced points of the expression, straight from a UniformPointStream into the planner, so it
+//doesn't matter how many points there are. The pieces get drawn left to right, since there isn't a whole array for
+//optimizePenUpTravel to reorder.
+StatisticalData drawUniformPolynomial(const CompiledExpression &expression, float xMin, float xMax, float yMin,
+                                      float yMax, long numPoints, bool homeFirst);
+
+//Runs the planner thread and the step thread on whatever points source gives it, and waits for them to finish.
+//Returns how far the pen went while it was down.
+float drawPointSource(PointSource source);
+
+//Parses the expression, samples it, and simplifies it, so it's ready to draw. Returns false if the expression is bad.
+bool planCurve(const char expression[], float xMin, float xMax, float yMin, float yMax, ArrayOfPoints *points,
+               SimplificationReport *simplificationReport);
+
+void logStatisticalData(StatisticalData statisticalData, SimplificationReport simplificationReport);
+
+//Requests all the GPIOs and starts everything the plotter needs for a run, and then undoes all of it.
+void setupPlotter();
+
+void shutdownPlotter();
+
+//Draws every curve in the job file in one go: the GPIOs get set up once, and it only goes to zero once.
+int runBatchJob(const char filename[]);
+
+//Reads and plans every curve in the job file. Returns false (with nothing left to free) if any line is bad.
+bool loadBatchJob(const char filename[], std::vector<std::string> *expressions, std::vector<ArrayOfPoints> *curves,
+                  std::vector<SimplificationReport> *simplificationReports);
+
+//Draws the G-code in the file (or stdin, if filename is "-") while it's still being read, so the job can be any size
+//and the plotter starts moving as soon as the first few lines are in.
+int runGcodeJob(const char filename[]);
+
+//Goes to zero (unless the position is already trusted) and draws the G-code. succeeded is false if a line was bad or
+//going to zero failed, and then nothing after that gets drawn.
+StatisticalData drawGcode(int file, long *linesRead, bool *succeeded);
+
+//What the planner thread runs for G-code: it reads a line at a time, and plans and pushes the moves into the queue, then
+//an end of job command.
+void runGcodePlannerThread(GcodeJob *job);
+
+//Puts the next line (without the newline) in line, which has to fit GCODE_MAX_LINE characters. Returns false at the end
+//of the file. tooLong is true if the line didn't fit and got cut off.
+bool readGcodeLine(GcodeReader &reader, char line[], bool *tooLong);
+
+//True if there's a whole line (or the end of the file) to read without waiting.
+bool gcodeLineReady(GcodeReader &reader);
+
+//Waits until the next line is ready, but if the step thread runs out of moves first, sends it everything that's
+//planned, so it never sits there waiting for a slow sender when it could be drawing.
+void waitForGcodeLine(GcodeJob &job);
+
+//Splits the line into words, and skips the comments. Returns false (with what's wrong in error) if it isn't G-code.
+bool parseGcodeLine(const char line[], GcodeLine *words, std::string *error);
+
+//Reads a number with an optional sign and decimal point, and nothing else, since strtod would read "0X10" as hex.
+bool parseGcodeNumber(const char **text, double *value);
+
+//Does what the line says. Returns false (with what's wrong in error) if it can't.
+bool runGcodeLine(GcodeJob &job, const GcodeLine &words, std::string *error);
+
+void setGcodePen(GcodeJob &job, bool down);
+
+//Goes to (x, y) in a straight line, drawing it if the pen is down. x and y are in steps.
+bool gcodeLineTo(GcodeJob &job, double x, double y, std::string *error);
+
+//Goes around the circle centred on (centreX, centreY) to (x, y), drawing it if the pen is down.
+bool gcodeArcTo(GcodeJob &job, double x, double y, double centreX, double centreY, bool clockwise,
+                std::string *error);
+
+//G28: lifts the pen and goes to (0, 0), and then the step thread goes to zero there if it doesn't trust the position.
+void gcodeHome(GcodeJob &job);
+
+//Sends the step thread everything that's been planned, with the last move stopping.
+void flushGcodePlanner(GcodeJob &job);
+
+bool insidePlotter(double x, double y);
+
+//Step streams. compileStepStream draws the curves on the simulated plotter, and writes down every tick and pen change
+//it did into a file, so replayStepStream can do exactly the same thing on the real plotter later without parsing,
+//sampling or planning anything.
+int compileStepStream(const char filename[], const std::vector<ArrayOfPoints> &curves);
+
+int replayStepStream(const char filename[]);
+
+void recordStepStreamTick(int stepX, int stepY, int stepTime);
+
+void recordStepStreamPen(bool penDown);
+
+uint32_t stepStreamChecksum(const StepStreamRecord *records, uint32_t numRecords);
+
+//Goes through the records once without moving anything, and returns what's wrong with them (or nullptr if nothing is).
+//A checksum only means the file didn't get mangled, not that whatever wrote it got it right.
+const char *checkStepStreamRecords(const StepStreamHeader &header, const StepStreamRecord *records);
+
+//Works out how long drawing the points will take (and how far the pen will go) by drawing them on the simulated
+//plotter, with the same code that really draws them. It doesn't touch a GPIO, and it puts everything back the way
+//it was after. If homeFirst is true, it goes to zero first from the far corner, since that's the longest it can take.
+PlotEstimate estimatePlot(ArrayOfPoints points, bool homeFirst);
+
+void savePlotterState(PlotterState *state);
+
+void restorePlotterState(PlotterState &state);
+
+void printPlotEstimate(const PlotEstimate &estimate);
+
+//Writes down how far off the estimate was from what really happened, so the constants can be tuned.
+void logPlotEstimateComparison(const PlotEstimate &estimate, StatisticalData statisticalData);
+
+//dry-run: plans the curves and says how long they'll take, without drawing anything.
+int dryRun(const std::vector<ArrayOfPoints> &curves);
+
+//What the step thread runs for a replay. It's the same as runStepThread, but the moves come out of the stream.
+void runStepStreamThread(const StepStreamRecord *records, uint32_t numRecords, float *lengthDrawn);
+
+//Plots every case in PLOT_BENCHMARK_CORPUS on the simulated plotter, and writes how each one went to filename as
+//JSON, so two builds can be compared.
+int benchmarkPlotting(const char filename[]);
+
+//Times pairs of liftPen and lowerPen against the mock PWM backend, so it's just our side of moving the pen (the servo
+//waits are simulated, so they don't count).
+int benchmarkPenCommands(int pairs);
+
+//CPU time used by the whole process (every thread), in seconds.
+double cpuSeconds();
+
+//self-test: runs checks on the simulated plotter, so the stepping can be checked without an Omega. Returns 1 if any of
+//them fail.
+int runSelfTests();
+
+//Logs what failed if condition is false, and returns condition.
+bool selfTestCheck(bool condition, const std::string &what);
+
+//Puts the simulated plotter at (x, y) with the pen up and an empty stepTrace, ready for a test to draw something.
+void startSelfTestPlotter(int x, int y);
+
+//Draws a line in every octant (and along every axis and diagonal), and checks each one with checkLineTrace.
+bool testLineSteps();
+
+//The simulated carriage is further left than the plotter thinks, so the minimum X limit switch stops the first line
+//part way along. Nothing after that can move, and the pen has to end up lifted.
+bool testLimitSwitchStopsJob();
+
+//Runs the limit switch monitor on the simulated edge source, and pushes edges through it by hand. Stepping into a
+//pressed switch has to be refused, and the trip has to say which switch it was, even when another one gets pressed
+//after it.
+bool testLimitSwitchEdges();
+
+//Draws a few long lines, so they get up to CRUISE_SPEED, and checks that every tick is long enough for a whole step
+//pulse and MIN_STEP_LOW_TIME off after it.
+bool testTickTimes();
+
+//Records a few ticks with recordStepStreamTick, checks that checkStepStreamRecords is happy with them, and then breaks
+//the records (or the header) one way at a time, which it has to notice every time.
+bool testStepStreamChecks();
+
+//Waits (for up to a second) for the monitor to see that the switch is in this state.
+bool waitForLimitSwitch(AXIS axis, Direction direction, bool pressed);
+
+//Checks the ticks in stepTrace for a line from (startX, startY) that goes (dx, dy): it has to take max(|dx|, |dy|)
+//ticks, move each axis exactly |dx| and |dy| steps the right way, and end up in the right place. Every tick has to
+//take 2 * STEP_TIME, even when both motors step in it, and so does the simulated clock.
+bool checkLineTrace(int startX, int startY, int dx, int dy);
+
+//Goes to zero in three goes: fast into the minimum limit switches, back off them, then slowly back into them.
+//Returns false if the limit switches never got pressed (or never let go).
+bool gotoZero();
+
+//Runs both axes towards their minimum limit switches until they're both pressed, speeding up to topSpeed.
+bool approachMinimumLimitSwitches(float topSpeed);
+
+//Steps both axes away from their minimum limit switches until they let go, and then steps more past that.
+bool backOffMinimumLimitSwitches(int steps);
+
+//Goes to zero unless the position is already trusted. Returns how long it took.
+float homeIfNeeded();
+
+//Reads HOME_STATE_FILE_NAME into currentX and currentY, and trusts them if it's there and from this boot.
+bool loadHomeState();
+
+//The kernel's random ID for this boot, from BOOT_ID_FILE_NAME, or "" if it can't be read.
+std::string currentBootId();
+
+//Writes currentX and currentY to HOME_STATE_FILE_NAME, so the next run doesn't have to go to zero.
+bool saveHomeState();
+
+bool openLogFile(const char filename[]);
+
+bool closeLogFile();
+
+//The logger. Everything that used to go straight to std::cout or logFile goes through here instead: a line gets
+//handed to a background thread through a ring buffer, and the thread writes them out in batches, so nothing that's
+//stepping ever has to wait for the serial console.
+//logToConsole(level) << ... is a line for the console, and logToFile() << ... is a line for the log file.
+LogLine logToConsole(LogLevel level);
+
+LogLine logToFile();
+
+//Like perror, but through the logger.
+void logSystemError(const char what[]);
+
+void startLogger();
+
+void stopLogger();
+
+//Waits until everything that's been logged so far has been written out.
+void flushLog();
+
+void loggerLoop();
+
+void writeLogEntry(bool toFile, LogLevel level, const std::string &text);
+
+void addLogEntry(bool toFile, LogLevel level, std::string &text);
+
+//Everything main used to do. main just starts and stops the logger around it.
+int runCommand(int argc, const char *const argv[]);
+
+/////////////////////////////////////////////////////
+// Global Variables:
+
+const int X_AXIS_DIRECTION_GPIO = 0;
+const int X_AXIS_STEP_GPIO = 1;
+const int Y_AXIS_DIRECTION_GPIO = 5; //SDA I2C GROUP ONION OMEGA
+const int Y_AXIS_STEP_GPIO = 4; //SCL I2C GROUP ONION OMEGA
+
+const int SERVO_PIN = 18; //PWM0 GROUP ON ONION OMEGA
+const int SERVO_FREQUENCY = 50; //50Hz
+const int SERVO_UP_DUTY_CYCLE = 50; //50% duty cycle for up
+const int SERVO_DOWN_DUTY_CYCLE = 0; //0% duty cycle for down
+const int SERVO_CHANGE_TIME = 100 * 1000; //Time required for the servo to change its position
+
+const int X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO = 45; //TX1 UART1 GROUP ONION OMEGA
+const int X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO = 46; //RX1 UART1 GROUP ONION OMEGA
+const int Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO = 2;
+const int Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO = 3;
+
+
+const int STEP_TIME = 2 * 1000; //time it takes to step a stepper motor in microseconds.
+//The stepper drivers only need the step pin on for a couple of microseconds to see a step, and off for about as long
+//before the next one, and the direction pin has to be set a bit less than a microsecond before the step. These are a
+//few times more than that, so the pins still look right to the driver when a sleep wakes up a little early or late.
+const int STEP_PULSE_TIME = 5; //How long the step pin is held on for each step, in microseconds.
+const int MIN_STEP_LOW_TIME = 5; //The shortest the step pin can be off before the next step, in microseconds.
+const int DIRECTION_SETTLE_TIME = 5; //How long the direction pin needs after changing, in microseconds.
+const float X_MAX = 1650; //The x-limit of the plotter.
+const float Y_MAX = 2100; //The y-limit of the plotter.
+
+//Motion planner settings. Speeds are in ticks per second, acceleration is in ticks per second per second.
+const float START_SPEED = 1000000.0f / (2 * STEP_TIME); //The speed that's safe to start and stop at (one STEP_TIME tick).
+//The fastest ticks can go and still fit a whole step pulse and MIN_STEP_LOW_TIME off in each one.
+const float MAX_STEP_SPEED = 1000000.0f / (STEP_PULSE_TIME + MIN_STEP_LOW_TIME);
+//The fastest the motors can go once they're up to speed.
+const float CRUISE_SPEED = std::min(1000.0f, MAX_STEP_SPEED);
+const float ACCELERATION = 2000; //How fast the motors can speed up or slow down without skipping steps.
+const float JUNCTION_DEVIATION = 1.0f; //How far (in steps) the pen is allowed to cut a corner at full speed.
+
+//How far (in steps) what gets drawn is allowed to be from the real curve. Sampling, simplifying and curve fitting each
+//move the line a bit, and those add up, so each one gets a share of this (rounding to whole steps is on top of it).
+const float PLOT_TOLERANCE = 1.5f;
+
+//Adaptive sampling settings.
+const float SAMPLING_TOLERANCE = PLOT_TOLERANCE / 3; //How far (in steps) a line between two points can be from the curve.
+const int SAMPLING_INITIAL_INTERVALS = 16; //How many pieces the window starts off split into.
+//How far (in steps) a point can be outside the window and still get drawn, right on the edge. It's so a point that's
+//meant to be exactly on the edge can't get lost to rounding.
+const float CLIP_SLACK = 0.01f;
+//How many times isolateCrossings can split a piece in half. Past that, the roots are too close together to matter.
+const int ROOT_ISOLATION_MAX_DEPTH = 60;
+const int SAMPLING_MAX_DEPTH = 20; //How many times a piece can be split in half.
+
+//Expression compiler limits. A polynomial that would have a higher degree than EXPRESSION_MAX_DEGREE stays as a power
+//in the program instead (which still works, it just doesn't get folded).
+const int EXPRESSION_MAX_DEGREE = 32;
+const int EXPRESSION_MAX_NESTING = 100;
+const int EXPRESSION_MAX_STACK = 32;
+const int EXPRESSION_BATCH_SIZE = 64; //How many x-values evaluateExpressionBatch runs the program on at once.
+const int UNIFORM_STREAM_CHUNK = 256; //How many points a UniformPointStream works out at once, if it isn't a polynomial.
+//How many points forward differencing goes before resetForwardDifferences starts it over from the real values.
+const long FORWARD_DIFFERENCE_RESET = 4096;
+//How long benchmarkExpressionParsing keeps compiling each expression for, in seconds.
+const double PARSE_BENCHMARK_TIME = 0.2;
+const int PEN_BENCHMARK_PAIRS = 100000; //How many times benchmark-pen lifts and lowers the pen if it isn't told.
+
+//How far (in steps) simplifyPoints is allowed to move the line when it gets rid of a point.
+const float SIMPLIFY_TOLERANCE = PLOT_TOLERANCE / 3;
+
+//Curve fitting settings.
+//How far (in steps) a fitted curve can be from the points. It's whatever's left of PLOT_TOLERANCE.
+const float CURVE_FIT_TOLERANCE = PLOT_TOLERANCE - SAMPLING_TOLERANCE - SIMPLIFY_TOLERANCE;
+//How many points the curve fitter holds on to at once. A curve can't cover more points than this.
+const int CURVE_FIT_WINDOW = 64;
+const int CURVE_FIT_ITERATIONS = 4; //How many times a cubic gets refitted after moving the points along it.
+const double CURVE_FIT_MAX_RADIUS = 1e6; //An arc bigger than this (in steps) is really just a line.
+//How many places along a curve get checked to find how fast it can go there, for setCurveSpeedLimits.
+const int CURVE_SPEED_SAMPLES = 16;
+
+//The step thread's SCHED_FIFO priority. It's high, but leaves room above it for the kernel's own threads.
+const int STEP_THREAD_PRIORITY = 80;
+const long STEP_LATE_THRESHOLD = 100 * 1000; //A step deadline missed by more than this (in ns) counts as late.
+//If a deadline gets missed by more than this (in ns), the step clock starts over from now instead of trying to catch
+//up, since catching up would mean a burst of steps way faster than the motors can do.
+const long STEP_RESYNC_THRESHOLD = 10 * 1000 * 1000;
+//Latency histogram buckets. Everything under LATENCY_EXACT_BUCKETS ns gets its own bucket, and after that every power
+//of two gets split into LATENCY_SUB_BUCKETS buckets, up to 2^LATENCY_MAX_EXPONENT ns (about 9 minutes).
+const int LATENCY_EXACT_BUCKETS = 32;
+const int LATENCY_SUB_BUCKETS = 16;
+const int LATENCY_SUB_BUCKET_BITS = 4;
+const int LATENCY_MAX_EXPONENT = 39;
+const int LATENCY_BUCKETS = LATENCY_EXACT_BUCKETS + (LATENCY_MAX_EXPONENT - 5 + 1) * LATENCY_SUB_BUCKETS;
+
+//How many moves the motion planner looks ahead. The last move it's looking at always has to be able to stop, so
+//this needs to be enough moves to cover the distance it takes to slow down from CRUISE_SPEED.
+const int PLANNER_LOOKAHEAD = 64;
+const int STEP_QUEUE_SIZE = 256; //How many moves can be waiting for the step thread. Has to be a power of two.
+const int STEP_QUEUE_WAIT = 500; //How long to wait (in microseconds) when the queue is full or empty.
+
+//Homing settings. It runs into the minimum limit switches fast, backs off them, and then comes back slowly, so where
+//it ends up doesn't depend on how hard it hit them the first time.
+const float HOMING_FAST_SPEED = CRUISE_SPEED; //How fast it runs into the limit switches the first time.
+const float HOMING_SLOW_SPEED = START_SPEED / 2; //How fast it comes back into them.
+const int HOMING_BACKOFF_STEPS = 50; //How far it backs off once the limit switches let go.
+//If the limit switches still aren't pressed after this many ticks, something's wrong (like a switch that came
+//unplugged), so it gives up instead of grinding away forever.
+const int HOMING_MAX_TICKS = (int) (1.1f * std::max(X_MAX, Y_MAX));
+
+//G-code settings. The reader only ever has GCODE_BUFFER_SIZE bytes of the input and one line in memory, so a job can
+//be as big as it wants.
+const int GCODE_BUFFER_SIZE = 4096;
+const int GCODE_MAX_LINE = 256; //A line longer than this is an error.
+const int GCODE_MAX_CODES = 8; //The most G codes (or M codes) one line can have.
+const double GCODE_STEPS_PER_MM = 1 / 0.2278; //The same 0.2278mm per step the statistics use.
+const int GCODE_POLL_WAIT = 1; //How long (in ms) to wait for more G-code before checking on the step thread again.
+
+int currentX = 0; // Assuming the plotter starts at x-origin
+int currentY = 0; // Assuming the plotter starts at y-origin
+//True once it's gone to zero (or the home state file says where it is), and nothing has happened since that could
+//have made currentX and currentY wrong. While it's true, going to zero gets skipped.
+bool positionTrusted = false;
+
+std::ofstream logFile;
+const char LOG_FILE_NAME[] = "log_file.txt";
+//Where the plotter was left at the end of the last run, if it was homed and nothing went wrong. setupPlotter deletes
+//it, so if a run dies part way through, the next one goes to zero again. It only counts for the boot it was saved in,
+//since the motors aren't holding the carriage while the Omega is off. If the carriage gets moved by hand in between,
+//delete it (or use rehome).
+const char HOME_STATE_FILE_NAME[] = "home_state.txt";
+const char BOOT_ID_FILE_NAME[] = "/proc/sys/kernel/random/boot_id";
+
+//If this is true, every tick that stepMotors does gets saved in stepTrace, so you can check
+//exactly what the motors did without having the plotter hooked up.
+bool recordStepTrace = false;
+//If this is false, the curve fitter just passes the points straight through, and everything gets drawn as lines.
+//Curves only get used where they're at least as quick as the lines, so it's on unless chords turns it off.
+bool fitCurves = true;
+std::vector<StepTick> stepTrace;
+
+//The limit switches, in the order the limit switch monitor keeps track of them.
+//A switch's index is (axis * 2) + (1 if it's the maximum end, 0 if it's the minimum end).
+const int NUM_LIMIT_SWITCHES = 4;
+const int LIMIT_SWITCH_GPIOS[NUM_LIMIT_SWITCHES] = {X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO, X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO,
+                                                    Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO, Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO};
+const int LIMIT_SWITCH_POLL_TIMEOUT = 100; //How long the monitor waits for an edge before checking if it should stop, in ms.
+
+//Set by the limit switch monitor thread, and read by the step loop. Reading an atomic is basically free, unlike
+//reading the GPIO, which is a system call every time.
+std::atomic<bool> limitSwitchMonitorRunning(false);
+std::atomic<bool> limitSwitchStates[NUM_LIMIT_SWITCHES];
+std::atomic<bool> limitSwitchTripped(false);
+std::atomic<int> trippedLimitSwitch(-1); //The index of the first switch that got pressed, until it gets cleared.
+std::thread limitSwitchMonitorThread;
+
+//The Omega's hardware PWM channels. GPIO18 is PWM0 and GPIO19 is PWM1. The pin has to be muxed to pwm for this to work
+//(omega2-ctrl gpiomux set pwm0 pwm), otherwise we fall back to fast-gpio.
+const char SYSFS_PWM_CHIP[] = "/sys/class/pwm/pwmchip0";
+const int SYSFS_PWM_GPIOS[] = {18, 19};
+
+//The sysfs PWM backend keeps these files open for the whole run, and remembers what it last wrote to them, so changing
+//the pen is just one write. It only drives one pin at a time, the one it was opened with.
+int sysfsPWMGpio = -1;
+int sysfsPWMPeriodFile = -1;
+int sysfsPWMDutyCycleFile = -1;
+int sysfsPWMEnableFile = -1;
+long sysfsPWMPeriod = -1; //In nanoseconds.
+long sysfsPWMDutyCycle = -1; //In nanoseconds.
+bool sysfsPWMEnabled = false;
+
+//What the mock PWM backend got told to do, so it can be checked (or timed) without a servo.
+int mockPWMGpio = -1;
+int mockPWMSetCount = 0;
+int mockPWMStopCount = 0;
+int mockPWMFrequency = 0;
+int mockPWMDutyCycle = 0;
+
+//The simulated edge source sends its edges down this pipe.
+int simulatedLimitEdgePipe[2] = {-1, -1};
+
+//The sysfs edge source keeps the value files of the limit switch GPIOs open, and polls them.
+int sysfsLimitSwitchFiles[NUM_LIMIT_SWITCHES] = {-1, -1, -1, -1};
+
+//The simulated plotter. Its pins are just levels in an array, and it keeps track of where it really is (which is not
+//always where currentX and currentY think it is, before it's gone to zero).
+const int NUM_SIMULATED_GPIOS = 64;
+const int SIMULATED_START_X = (int) X_MAX / 2; //Where the simulated plotter is when it's turned on, in steps.
+const int SIMULATED_START_Y = (int) Y_MAX / 2;
+const char SIMULATED_TRACE_FILE_NAME[] = "simulated_trace.csv";
+bool simulatingHardware = false;
+bool simulatedGPIORequested[NUM_SIMULATED_GPIOS];
+int simulatedGPIOLevels[NUM_SIMULATED_GPIOS];
+int simulatedX = 0;
+int simulatedY = 0;
+int simulatedLimitCrashes = 0; //How many times a motor got pulsed towards a limit switch that was already pressed.
+int simulatedDirectionChanges = 0; //How many times a direction pin changed.
+struct timespec simulatedClock;
+
+const char PLOT_BENCHMARK_FILE_NAME[] = "plot_benchmark.json";
+
+//Step stream files start with a StepStreamHeader, and then it's just StepStreamRecords until the end of the file.
+const char STEP_STREAM_MAGIC[4] = {'P', 'L', 'T', 'S'};
+const uint32_t STEP_STREAM_VERSION = 1;
+const uint8_t STEP_STREAM_STEPS = 0; //count ticks of stepMotors(stepX, stepY, stepTime).
+const uint8_t STEP_STREAM_PEN_UP = 1;
+const uint8_t STEP_STREAM_PEN_DOWN = 2;
+const int STEP_STREAM_MAX_COUNT = 65535; //The most ticks one record can hold.
+
+//While compileStepStream is drawing, stepMotors and the pen write down what they did in here.
+bool recordingStepStream = false;
+std::vector<StepStreamRecord> stepStreamRecords;
+int stepStreamX = 0; //Where the plotter is in the stream being recorded.
+int stepStreamY = 0;
+int stepStreamMinX = 0;
+int stepStreamMaxX = 0;
+int stepStreamMinY = 0;
+int stepStreamMaxY = 0;
+uint32_t stepStreamTicks = 0;
+
+//The logger's ring buffer, and what it takes to share it. Adding a line only holds logMutex long enough to swap the
+//text into its slot, and the logger thread doesn't hold it at all while it's writing.
+const int LOG_RING_SIZE = 1024; //How many lines can be waiting to be written. Has to be a power of two.
+const int LOG_FLUSH_INTERVAL = 100; //How often (in ms) the logger writes out what it has, if it isn't full yet.
+LogLevel consoleLogLevel = LOG_INFO;
+std::mutex logMutex;
+std::condition_variable logReady; //Tells the logger thread there's a lot to write, or someone wants it flushed.
+std::condition_variable logWritten; //Tells everyone else the logger thread has written some lines.
+unsigned int logHead = 0; //The next line the logger thread will write.
+unsigned int logTail = 0; //Where the next line goes.
+bool loggerRunning = false;
+bool logFlushWanted = false;
+int logLinesDropped = 0;
+std::thread loggerThread;
+//The step thread can't wait for anything, so if the ring buffer is full, its lines just get dropped (and counted).
+//Everyone else waits for room.
+thread_local bool neverWaitToLog = false;
+
+/////////////////////////////////////////////////////
+// Function Definitions:
+
+//One line for the log. Whatever gets << into it gets handed to the logger in one piece at the end of the statement.
+//If it's a console line below consoleLogLevel, the << don't do anything at all, so turned off lines cost nothing.
+struct LogLine {
+    bool toFile;
+    LogLevel level;
+    std::ostringstream *text; //nullptr if the line is turned off.
+
+    LogLine(bool toFile, LogLevel level);
+
+    LogLine(LogLine &&other);
+
+    ~LogLine();
+
+    template<typename T>
+    LogLine &operator<<(const T &value) {
+        if (text != nullptr) {
+            *text << value;
+        }
+        return *this;
+    }
+};
+
+//One line in the ring buffer.
+struct LogEntry {
+    bool toFile;
+    LogLevel level;
+    std::string text;
+};
+
+LogEntry logRing[LOG_RING_SIZE];
+
+//This is going to be used in an array of points that will be used to store all of the points on the polynomial.
+struct Point {
+    float x;
+    float y;
+};
+
+struct ArrayOfPoints {
+    Point *points;
+    int numPoints;
+};
+
+struct StatisticalData {
+    float lengthOfTime;
+    float lengthOfFunction;
+    float penUpTravelBefore; //How far the pen would have travelled up if the pieces were drawn in order, in steps.
+    float penUpTravelAfter; //How far it actually travelled up after optimizePenUpTravel, in steps.
+    int penLifts;
+    float homingTime; //How long it spent going to zero, in seconds. It's 0 if it didn't have to.
+};
+
+//The polynomial as one coefficient for every power of x: y = coefficients[0] + coefficients[1]x + ... +
+//coefficients[degree]x^degree. This is what actually gets evaluated, since it's way faster than calling pow for every
+//component.
+struct PolynomialCoefficients {
+    double *coefficients;
+    int degree;
+};
+
+//One piece of the expression, like a number or a +. start is where it is in the expression, for the error messages.
+struct ExpressionToken {
+    ExpressionTokenType type;
+    double value; //For TOKEN_NUMBER.
+    ExpressionOp function; //For TOKEN_FUNCTION.
+    int start;
+};
+
+//A node in the expression's tree. left and right are indexes into the parser's nodes (or -1 if there isn't one).
+//Polynomial nodes don't have either, they're just the coefficients: polynomial[k] is the coefficient of x^k, and a
+//number is a polynomial with only polynomial[0].
+struct ExpressionNode {
+    ExpressionOp op;
+    int left;
+    int right;
+    std::vector<double> polynomial;
+};
+
+struct ExpressionParser {
+    const char *input;
+    int position; //Where the token after this one starts.
+    int nesting; //How deep the parse functions have gone, so something like ((((((x)))))) can't use up all the stack.
+    ExpressionToken token; //The token we're looking at right now.
+    std::vector<ExpressionNode> nodes;
+    std::string error; //Only the first error gets kept, since everything after it is probably because of it.
+};
+
+//One instruction of a compiled expression. value is for OP_CONSTANT, and polynomial is which polynomial in the
+//expression's polynomials OP_POLYNOMIAL works out.
+struct ExpressionInstruction {
+    ExpressionOp op;
+    int polynomial;
+    double value;
+};
+
+//What compileExpression makes. If the whole thing is a polynomial, isPolynomial is true and coefficients is all there
+//is to it (so it can use Horner's method and evaluateCoefficientsBatch). Otherwise program is what gets run.
+struct CompiledExpression {
+    bool isPolynomial;
+    PolynomialCoefficients coefficients;
+    std::vector<ExpressionInstruction> program;
+    std::vector<PolynomialCoefficients> polynomials;
+    int stackSize; //The most things program ever has on the stack at once.
+};
+
+//The driver for one stepper motor. It knows its own pins, and remembers what it last wrote to them, so it doesn't
+//have to write the direction pin (or wait for it to settle) unless the motor is actually changing direction.
+struct StepperAxis {
+    int stepGPIO;
+    int directionGPIO;
+    int minimumLimitGPIO; //The limit switch that CCW heads towards.
+    int maximumLimitGPIO; //The limit switch that CW heads towards.
+    bool directionKnown; //False until the direction pin has been written once.
+    Direction direction;
+    int stepLevel;
+    int pulseTime; //How long to hold the step pin on, in microseconds.
+    int settleTime; //How long to wait after changing the direction pin, in microseconds.
+};
+
+//The drivers for the two motors. These have to be down here, after StepperAxis is defined.
+StepperAxis xAxis = createStepperAxis(X_AXIS_STEP_GPIO, X_AXIS_DIRECTION_GPIO, X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO,
+                                      X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+StepperAxis yAxis = createStepperAxis(Y_AXIS_STEP_GPIO, Y_AXIS_DIRECTION_GPIO, Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO,
+                                      Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+
+//Where the limit switch monitor gets its edges from. open() sets it up, wait() waits up to timeout ms for a switch to
+//change and returns 1 with the switch's index and whether it's pressed now (0 if nothing happened, -1 on an error),
+//and close() cleans it up. There's a real one that uses the sysfs GPIO files, and a simulated one for testing.
+struct LimitEdgeSource {
+    bool (*open)();
+    int (*wait)(int timeout, int *index, bool *pressed);
+    void (*close)();
+};
+
+const LimitEdgeSource SYSFS_LIMIT_EDGE_SOURCE = {openSysfsLimitEdges, waitForSysfsLimitEdge, closeSysfsLimitEdges};
+const LimitEdgeSource SIMULATED_LIMIT_EDGE_SOURCE = {openSimulatedLimitEdges, waitForSimulatedLimitEdge,
+                                                     closeSimulatedLimitEdges};
+
+//The edge source the limit switch monitor is using right now.
+LimitEdgeSource limitEdgeSource;
+
+//How the servo's PWM gets set. set() starts (or changes) PWM on the gpio at that frequency (Hz) and duty cycle (%),
+//and stop() pulls it to GND. open() and close() happen once per run, so the backend can keep whatever it needs open.
+//The sysfs one writes the PWM channel directly, the fast-gpio one runs fast-gpio like we used to, and the mock one
+//doesn't touch anything, so the pen commands can be tested and timed on any computer.
+struct PwmBackend {
+    bool (*open)(int gpio);
+    bool (*set)(int gpio, int frequency, int dutyCycle);
+    void (*stop)(int gpio);
+    void (*close)(int gpio);
+};
+
+const PwmBackend SYSFS_PWM_BACKEND = {openSysfsPWM, setSysfsPWM, stopSysfsPWM, closeSysfsPWM};
+const PwmBackend FAST_GPIO_PWM_BACKEND = {openFastGpioPWM, setFastGpioPWM, stopFastGpioPWM, closeFastGpioPWM};
+const PwmBackend MOCK_PWM_BACKEND = {openMockPWM, setMockPWM, stopMockPWM, closeMockPWM};
+
+//The PWM backend that startPWM and stopPWM use.
+PwmBackend pwmBackend = FAST_GPIO_PWM_BACKEND;
+
+//Everything the plotter does to the hardware goes through here: the GPIO calls are the same as libugpio's, and the
+//clock is what the step timing and the pen sleep on. The Omega one is the real thing, and the simulated one lets a whole
+//plot run headless in milliseconds, since sleeping only moves its clock forwards.
+struct HardwareBackend {
+    int (*isRequested)(int gpio);
+    int (*request)(int gpio);
+    int (*directionOutput)(int gpio, int value);
+    int (*directionInput)(int gpio);
+    int (*free)(int gpio);
+    int (*setValue)(int gpio, int value);
+    int (*getValue)(int gpio);
+    void (*now)(struct timespec *now);
+    void (*sleepUntil)(const struct timespec *deadline);
+    void (*sleep)(int microseconds);
+};
+
+const HardwareBackend OMEGA_HARDWARE = {isOmegaGPIORequested, requestOmegaGPIO, setOmegaGPIODirectionOutput,
+                                        setOmegaGPIODirectionInput, freeOmegaGPIO, setOmegaGPIOValue,
+                                        getOmegaGPIOValue, getOmegaTime, sleepUntilOmegaTime, sleepOmega};
+const HardwareBackend SIMULATED_HARDWARE = {isSimulatedGPIORequested, requestSimulatedGPIO,
+                                            setSimulatedGPIODirectionOutput, setSimulatedGPIODirectionInput,
+                                            freeSimulatedGPIO, setSimulatedGPIOValue, getSimulatedGPIOValue,
+                                            getSimulatedTime, sleepUntilSimulatedTime, sleepSimulated};
+
+//The hardware everything is talking to right now.
+HardwareBackend hardware = OMEGA_HARDWARE;
+
+//One step that the simulated plotter took: when it happened (on the simulated clock, in ns), and where it ended up.
+struct SimulatedStep {
+    long long time;
+    int x;
+    int y;
+    bool penDown;
+};
+
+//The start of a step stream file. Everything in it is 4 bytes, so there's no padding, and the records start right
+//after it. The stream always starts at (0, 0), right after going to zero, with the pen up.
+struct StepStreamHeader {
+    char magic[4]; //STEP_STREAM_MAGIC
+    uint32_t version; //STEP_STREAM_VERSION
+    uint32_t numRecords;
+    uint32_t checksum; //FNV-1a of all the records.
+    int32_t minX; //The box (in steps) the stream stays inside.
+    int32_t minY;
+    int32_t maxX;
+    int32_t maxY;
+    int32_t endX; //Where the plotter is at the end.
+    int32_t endY;
+    uint32_t numTicks;
+    uint32_t predictedMilliseconds; //How long it took on the simulated plotter, pen changes included.
+};
+
+//What estimatePlot thinks will happen. Times are in seconds, and lengths are in steps.
+struct PlotEstimate {
+    float time; //All of it, including homingTime and penTime.
+    float homingTime;
+    float penTime; //How long is spent waiting for the servo to move the pen.
+    float lengthOfFunction; //How far the pen goes while it's down.
+    int steps; //How many steps the motors take, counting each motor separately.
+    int directionChanges;
+    int penLifts;
+    int endX; //Where the plotter is when it's done.
+    int endY;
+};
+
+//Either count ticks that are all the same, or a pen change (with everything else 0).
+struct StepStreamRecord {
+    uint8_t type; //STEP_STREAM_STEPS, STEP_STREAM_PEN_UP or STEP_STREAM_PEN_DOWN
+    int8_t stepX; //-1, 0 or 1, like stepMotors.
+    int8_t stepY;
+    uint8_t unused;
+    uint16_t count;
+    uint16_t stepTime; //Half of how long each tick takes, in microseconds, like stepMotors.
+};
+
+std::vector<SimulatedStep> simulatedStepTrace;
+
+//One expression and window for the plot benchmark.
+struct PlotBenchmarkCase {
+    const char *expression;
+    float xMin;
+    float xMax;
+    float yMin;
+    float yMax;
+};
+
+//The plot benchmark's corpus. Don't change the cases that are already here, or old results can't be compared anymore;
+//add new ones to the end.
+const PlotBenchmarkCase PLOT_BENCHMARK_CORPUS[] = {
+        {"1x^1", 0, 10, 0, 10}, //One straight line.
+        {"1x^2", -10, 10, 0, 100}, //The usual parabola.
+        {"1x^2", -10, 10, 0, 25}, //Only the middle of it is in the window.
+        {"1x^3", -5, 5, -125, 125},
+        {"-3x^3+2x^1", -3, 3, -10, 10},
+        {"2x^3-5x^1+1", -3, 3, -10, 10},
+        {"1x^5-4x^3+3x^1", -2, 2, -2, 2}, //Wiggly.
+        {"3x^4-20x^2+5", -3, 3, -30, 30},
+        {"1x^8-8x^6+20x^4-16x^2+2", -2, 2, -2, 2}, //A Chebyshev polynomial, which has lots of sharp turns.
+        {"5", -10, 10, 0, 10}, //Flat.
+        {"100x^1", -1, 1, -1, 1}, //Almost straight up, and mostly outside the window.
+        {"1x^3-3x^1", -3, 3, -1, 1}, //Goes in and out of the window, so it's three pieces.
+        {"1x^4-5x^2+4", -3, 3, -1, 1}, //Four pieces.
+};
+const int NUM_PLOT_BENCHMARK_CASES = sizeof(PLOT_BENCHMARK_CORPUS) / sizeof(PLOT_BENCHMARK_CORPUS[0]);
+
+//What benchmark-parse compiles if it isn't given anything: the plot benchmark's polynomials written a few different
+//ways, and some that aren't polynomials at all.
+const char *const PARSE_BENCHMARK_CORPUS[] = {
+        "1x^2",
+        "2x^3-5x^1+1",
+        "x^8-8x^6+20x^4-16x^2+2",
+        "3/4x^4 - 2.5x^2 + 0.125",
+        "-(x - 1)(x + 1)(x - 2)(x + 2)",
+        "(x + 1)^6 - (x - 1)^6",
+        "2x(x - 1) + 3x^2 - 4(x + 1/2)",
+        "sin(x)",
+        "exp(-x^2 / 2) / sqrt(2pi)",
+        "x sin(1/x)",
+        "sqrt(1 - x^2) + cos(3x)/2",
+        "((((((((((x + 1) * 2) - 3) / 4) ^ 2) + 5) * 6) - 7) / 8) ^ 2)",
+};
+const int NUM_PARSE_BENCHMARK_EXPRESSIONS = sizeof(PARSE_BENCHMARK_CORPUS) / sizeof(PARSE_BENCHMARK_CORPUS[0]);
+
+//One tick of stepMotors: which way each motor stepped (-1, 0 or 1), where the plotter ended up after, and how long
+//the tick took in microseconds.
+struct StepTick {
+    int stepX;
+    int stepY;
+    int x;
+    int y;
+    int tickTime;
+};
+
+//An arc or a Bézier, in steps. Lines don't need anything here, since a move already knows where it starts and ends.
+struct CurvePrimitive {
+    CurveShape shape;
+    //A Bézier's control points, starting with where it starts (so a quadratic only uses the first 3). For an arc,
+    //x[0], y[0] is the centre.
+    double x[4];
+    double y[4];
+    double radius; //The rest is just for arcs. Angles are in radians, and a positive sweep is anticlockwise.
+    double startAngle;
+    double sweep;
+};
+
+//One line (or curve) that the plotter will move along, with the speeds the motion planner picked for it.
+//Speeds are in ticks per second (a tick is one call to stepMotors), since that's what the motors are limited by.
+struct PlannedMove {
+    int x; //Where the move ends, in steps.
+    int y;
+    bool penDown;
+    //How many ticks gotoPoint will take to do this move. For a line it's max(|dx|, |dy|), and for a curve it's however
+    //many a CurveTracer takes.
+    int numTicks;
+    float entrySpeed;
+    float cruiseSpeed;
+    float exitSpeed;
+    CurvePrimitive curve;
+    //Just for curves: the fastest the pen can go at CURVE_SPEED_SAMPLES + 1 places along the curve, and how many
+    //ticks in each of those places is. In between, v^2 goes in a straight line from one to the next.
+    float bendSpeeds[CURVE_SPEED_SAMPLES + 1];
+    float bendTicks[CURVE_SPEED_SAMPLES + 1];
+};
+
+//Where a CurveTracer is along the curve. (x, y) is the step it's on, and t is the spot on the curve it got there from.
+struct CurveTracer {
+    const CurvePrimitive *curve;
+    double t;
+    int x;
+    int y;
+    int endX;
+    int endY;
+    double curveX; //Where the curve is at t.
+    double curveY;
+    float length; //How far along the curve it's gone, in steps.
+};
+
+//A run of points that hasn't been sent to the planner yet. points[0] has already been sent (it's where the next piece
+//starts), and startTangent is the way the piece before it was heading at the end, so the next one carries on smoothly.
+struct CurveFitter {
+    MotionPlanner *planner;
+    Point points[CURVE_FIT_WINDOW];
+    int numPoints;
+    bool haveStartTangent;
+    double startTangentX;
+    double startTangentY;
+};
+
+struct MotionPlan {
+    PlannedMove *moves;
+    int numMoves;
+};
+
+//A piece of the window, from x = start to x = end, where the polynomial is inside the window the whole way.
+struct VisibleInterval {
+    double start;
+    double end;
+};
+
+//One piece of the points that gets drawn with the pen down, from points[first] to points[last].
+//It can be drawn either way, so if first > last, it gets drawn backwards.
+struct PathSegment {
+    int first;
+    int last;
+};
+
+//How well the step clock kept to its deadlines. Overruns are how long after the deadline stepClockSleep actually
+//woke up, in nanoseconds.
+struct StepTimingStatistics {
+    long numDeadlines;
+    long numLate;
+    long numResyncs;
+    double totalOverrun;
+    long worstOverrun;
+};
+
+//The deadline that the next stepClockSleep counts from, and how well we've kept to the deadlines so far.
+//Only the thread that's stepping touches these.
+struct timespec stepDeadline;
+StepTimingStatistics stepTimingStatistics = {0, 0, 0, 0, 0};
+
+//How many times something took as long as each bucket. There's no total, since the worst time and the buckets
+//are all the report needs.
+struct LatencyHistogram {
+    std::atomic<unsigned long> buckets[LATENCY_BUCKETS];
+    std::atomic<unsigned long> count;
+    std::atomic<long> worst;
+};
+
+//These start out zeroed since they're globals. estimatePlot turns measuringLatencies off, so none of its pretend
+//drawing ends up in the report.
+LatencyHistogram gpioWriteLatency;
+LatencyHistogram gpioReadLatency;
+LatencyHistogram stepSleepOvershoot;
+LatencyHistogram penPWMLatency;
+bool measuringLatencies = true;
+
+//Something that hands out points one at a time, like the points in an array or a UniformPointStream.
+//next puts the next point in point, or returns false if there aren't any left.
+struct PointSource {
+    bool (*next)(void *context, Point *point);
+    void *context;
+};
+
+struct ArrayPointCursor {
+    ArrayOfPoints points;
+    int next;
+};
+
+//Point index is at x = xMin + index * deltaX. For a polynomial, differences[k] is the kth forward difference at the
+//next point (so differences[0] is its y-value), and otherwise yValues has the y-values of the chunk the next point is
+//in.
+struct UniformPointStream {
+    const CompiledExpression *expression;
+    float xMin;
+    float xMax;
+    float yMin;
+    float yMax;
+    long numPoints;
+    long next;
+    double deltaX;
+    double differences[EXPRESSION_MAX_DEGREE + 1];
+    double yValues[UNIFORM_STREAM_CHUNK];
+    bool lastInside; //If the last point was inside the window, to count the pieces.
+    int numPieces;
+    //For polynomials: the visible intervals, which one it's in, and where it's up to in it. The points in the
+    //interval go from firstIndex to lastIndex, and stage says whether it's at the start of the interval, in its
+    //points, at its end, or in the gap after it.
+    VisibleInterval intervals[EXPRESSION_MAX_DEGREE + 1];
+    int numIntervals;
+    int interval;
+    int stage;
+    long firstIndex;
+    long lastIndex;
+};
+
+enum UniformStreamStage {
+    STREAM_INTERVAL_START, STREAM_INTERVAL_POINTS, STREAM_INTERVAL_END, STREAM_INTERVAL_GAP
+};
+
+//Everything that drawing on the simulated plotter changes, so estimatePlot can put it all back.
+struct PlotterState {
+    HardwareBackend hardware;
+    PwmBackend pwmBackend;
+    bool simulatingHardware;
+    StepperAxis xAxis;
+    StepperAxis yAxis;
+    int currentX;
+    int currentY;
+    bool positionTrusted;
+    struct timespec stepDeadline;
+    StepTimingStatistics stepTimingStatistics;
+    bool recordStepTrace;
+    bool simulatedGPIORequested[NUM_SIMULATED_GPIOS];
+    int simulatedGPIOLevels[NUM_SIMULATED_GPIOS];
+    int simulatedX;
+    int simulatedY;
+    int simulatedLimitCrashes;
+    int simulatedDirectionChanges;
+    struct timespec simulatedClock;
+    std::vector<SimulatedStep> simulatedStepTrace;
+    int mockPWMGpio;
+    int mockPWMSetCount;
+    int mockPWMStopCount;
+    int mockPWMFrequency;
+    int mockPWMDutyCycle;
+};
+
+//Plans moves a point at a time. The moves that are still being looked at are in moves, and everything before them
+//has already been sent to output (which is why their speeds can't change anymore).
+struct MotionPlanner {
+    PlannedMove moves[PLANNER_LOOKAHEAD];
+    float maxEntrySpeeds[PLANNER_LOOKAHEAD]; //The fastest each move can start at, because of the corner before it.
+    int numMoves;
+    float firstEntrySpeed; //moves[0] has to start at this, since the move before it has already been sent.
+    PlannedMove lastMove; //The last move that got added, for working out the next corner.
+    int lastMoveStartX;
+    int lastMoveStartY;
+    bool haveLastMove;
+    int lastX; //Where the last move ends.
+    int lastY;
+    bool inRun;
+    void (*output)(const PlannedMove &move, void *context);
+    void *context;
+};
+
+//Something for the step thread to do: a move, the end of the job, or (for G28, once it's already moved to (0, 0))
+//going to zero if something has made the position not trusted anymore.
+struct StepCommand {
+    bool endOfJob;
+    bool goHome;
+    PlannedMove move;
+};
+
+//The planner thread only ever writes tail, and the step thread only ever writes head, so all it takes is
+//acquire/release on those two to hand moves over without a lock.
+struct StepQueue {
+    StepCommand commands[STEP_QUEUE_SIZE];
+    std::atomic<unsigned int> head; //The next command the step thread will take.
+    std::atomic<unsigned int> tail; //Where the planner thread will put the next command.
+    //If going to zero fails part way through a job, the step thread sets stopped and throws away everything else the
+    //planner thread sends it. homingTime is how long the step thread spent going to zero.
+    std::atomic<bool> stopped;
+    float homingTime;
+};
+
+//Reads G-code a line at a time from a file descriptor (usually stdin), through a buffer that never gets any bigger.
+struct GcodeReader {
+    int file;
+    char buffer[GCODE_BUFFER_SIZE];
+    int start; //The first character in buffer that hasn't been used yet.
+    int end;
+    bool endOfFile;
+    long lineNumber; //How many lines have been read so far.
+};
+
+//The words on one line of G-code. G and M codes are kept times 10 (so G91.1 is 911), since a line can have a few of
+//them. Every other letter can only be on a line once, and its number is in values.
+struct GcodeLine {
+    int gCodes[GCODE_MAX_CODES];
+    int numGCodes;
+    int mCodes[GCODE_MAX_CODES];
+    int numMCodes;
+    bool has[26];
+    double values[26];
+};
+
+//Everything the G-code planner thread keeps track of. Positions are in steps.
+struct GcodeJob {
+    GcodeReader reader;
+    MotionPlanner planner;
+    CurveFitter fitter;
+    StepQueue *queue;
+    int motionMode; //0 to 3, for G0 to G3.
+    bool absolute; //G90, or G91 if it's false.
+    //G90.1 (I and J are where the arc's centre is), or G91.1 (they're from the start of the arc) if it's false.
+    bool absoluteArcCentres;
+    double stepsPerUnit; //For G21 (millimetres) or G20 (inches).
+    double x;
+    double y;
+    double z; //Only kept for relative Z moves. Above 0 is pen up.
+    bool penDown;
+    bool ended; //M2 or M30.
+    bool failed;
+    int penLifts;
+    float penUpTravel;
+};
+
+//What simplifyPoints did.
+struct SimplificationReport {
+    int pointsBefore;
+    int pointsAfter;
+    int pointsRemoved; //Only counts real points, not the NaN points between pieces.
+    float timeBefore; //How long the motion would take, in seconds, from estimatePlanTime.
+    float timeAfter;
+};
+
+//What optimizePenUpTravel did. Distances are in steps.
+struct TravelReport {
+    float travelBefore;
+    float travelAfter;
+    int penLiftsBefore;
+    int penLiftsAfter;
+};
+
+ArrayOfPoints
+createArrayOfPolynomialPoints(const CompiledExpression &expression, const float xMax, const float yMin,
+                              const float yMax, const float xMin, const int numPoints) {
+    ArrayOfPoints points;
+    points.points = nullptr;
+    points.numPoints = 0;
+
+    //A polynomial can have three more points for every visible interval (the ends and the NaN after it).
+    UniformPointStream *stream = new UniformPointStream;
+    if (startUniformPointStream(*stream, expression, xMax, yMin, yMax, xMin, numPoints)) {
+        points.points = new Point[numPoints + 3 * (EXPRESSION_MAX_DEGREE + 1)];
+        while (nextUniformPoint(stream, &points.points[points.numPoints])) {
+            points.numPoints++;
+        }
+    }
+    delete stream;
+    return points;
+}
+
+bool startUniformPointStream(UniformPointStream &stream, const CompiledExpression &expression, const float xMax,
+                             const float yMin, const float yMax, const float xMin, long numPoints) {
+    //Close inputs:
+    if (xMax <= xMin || yMax <= yMin || numPoints < 2) {
+        return false;
+    }
+    stream.expression = &expression;
+    stream.xMin = xMin;
+    stream.xMax = xMax;
+    stream.yMin = yMin;
+    stream.yMax = yMax;
+    stream.numPoints = numPoints;
+    stream.next = 0;
+    stream.deltaX = ((double) xMax - xMin) / (numPoints - 1);
+    stream.lastInside = false;
+    stream.numPieces = 0;
+    stream.numIntervals = 0;
+    stream.interval = 0;
+    stream.stage = STREAM_INTERVAL_START;
+    if (expression.isPolynomial) {
+        stream.numIntervals = findVisibleIntervals(expression.coefficients, xMin, xMax, yMin, yMax, stream.intervals);
+        stream.numPieces = stream.numIntervals;
+    }
+    return true;
+}
+
+//Taking differences of y-values over and over would cancel out almost every digit by the dth difference, and then
+//adding it up thousands of times would blow that error up. So the differences come straight from the coefficients:
+//first the polynomial gets shifted so it's in terms of t, the number of points after index (b[j] is the coefficient
+//of t^j), and then the kth difference of t^j at t = 0 is k! times a Stirling number of the second kind, S(j, k).
+void resetForwardDifferences(UniformPointStream &stream, long index) {
+    const PolynomialCoefficients &coefficients = stream.expression->coefficients;
+    int degree = coefficients.degree;
+    double b[EXPRESSION_MAX_DEGREE + 1];
+    std::copy(coefficients.coefficients, coefficients.coefficients + degree + 1, b);
+
+    //Shift x over to the x of this point (Horner's method, once for every coefficient), then scale x to t.
+    double x = stream.xMin + index * stream.deltaX;
+    for (int i = 0; i < degree; i++) {
+        for (int j = degree - 1; j >= i; j--) {
+            b[j] += x * b[j + 1];
+        }
+    }
+    double scale = 1;
+    for (int j = 0; j <= degree; j++) {
+        b[j] *= scale;
+        scale *= stream.deltaX;
+    }
+
+    //surjections[k] is k! S(j, k) for the j we're on. It goes from one j to the next with
+    //k! S(j, k) = k * ((k - 1)! S(j - 1, k - 1) + k! S(j - 1, k)).
+    double surjections[EXPRESSION_MAX_DEGREE + 1];
+    double *differences = stream.differences;
+    surjections[0] = 1;
+    differences[0] = b[0];
+    for (int k = 1; k <= degree; k++) {
+        surjections[k] = 0;
+        differences[k] = 0;
+    }
+    for (int j = 1; j <= degree; j++) {
+        for (int k = j; k >= 1; k--) {
+            surjections[k] = k * (surjections[k] + surjections[k - 1]);
+        }
+        surjections[0] = 0;
+        for (int k = 1; k <= j; k++) {
+            differences[k] += b[j] * surjections[k];
+        }
+    }
+}
+
+//Works out the y-value, clips it and scales it to steps all at once. The x-value in steps doesn't even need the
+//expression, it's just how far along the points we are.
+bool nextUniformPoint(void *context, Point *point) {
+    UniformPointStream &stream = *(UniformPointStream *) context;
+    const CompiledExpression &expression = *stream.expression;
+    double xScale = X_MAX / ((double) stream.xMax - stream.xMin);
+
+    if (expression.isPolynomial) {
+        //Nothing outside of the visible intervals gets worked out at all.
+        while (stream.interval < stream.numIntervals) {
+            const VisibleInterval &interval = stream.intervals[stream.interval];
+            switch (stream.stage) {
+                case STREAM_INTERVAL_START:
+                    //The points strictly inside the interval.
+                    stream.firstIndex = (long) floor((interval.start - stream.xMin) / stream.deltaX) + 1;
+                    stream.lastIndex = (long) ceil((interval.end - stream.xMin) / stream.deltaX) - 1;
+                    stream.lastIndex = std::min(stream.lastIndex, stream.numPoints - 1);
+                    stream.next = stream.firstIndex;
+                    stream.stage = STREAM_INTERVAL_POINTS;
+                    point->x = (float) ((interval.start - stream.xMin) * xScale);
+                    point->y = windowYInSteps(evaluateCoefficients(expression.coefficients, interval.start),
+                                              stream.yMin, stream.yMax);
+                    return true;
+                case STREAM_INTERVAL_POINTS:
+                    if (stream.next <= stream.lastIndex) {
+                        if ((stream.next - stream.firstIndex) % FORWARD_DIFFERENCE_RESET == 0) {
+                            resetForwardDifferences(stream, stream.next);
+                        }
+                        double *differences = stream.differences;
+                        double y = differences[0];
+                        for (int k = 0; k < expression.coefficients.degree; k++) {
+                            differences[k] += differences[k + 1];
+                        }
+                        point->x = (float) ((double) stream.next / (stream.numPoints - 1) * X_MAX);
+                        point->y = windowYInSteps(y, stream.yMin, stream.yMax);
+                        stream.next++;
+                        return true;
+                    }
+                    stream.stage = STREAM_INTERVAL_END;
+                    break;
+                case STREAM_INTERVAL_END:
+                    stream.stage = STREAM_INTERVAL_GAP;
+                    point->x = (float) ((interval.end - stream.xMin) * xScale);
+                    point->y = windowYInSteps(evaluateCoefficients(expression.coefficients, interval.end),
+                                              stream.yMin, stream.yMax);
+                    return true;
+                default:
+                    stream.interval++;
+                    stream.stage = STREAM_INTERVAL_START;
+                    if (stream.interval < stream.numIntervals) {
+                        point->x = (float) ((interval.end - stream.xMin) * xScale);
+                        point->y = NAN;
+                        return true;
+                    }
+                    break;
+            }
+        }
+        return false;
+    }
+
+    long index = stream.next;
+    if (index >= stream.numPoints) {
+        return false;
+    }
+    int inChunk = (int) (index % UNIFORM_STREAM_CHUNK);
+    if (inChunk == 0) {
+        double xValues[UNIFORM_STREAM_CHUNK];
+        int count = (int) std::min((long) UNIFORM_STREAM_CHUNK, stream.numPoints - index);
+        for (int i = 0; i < count; i++) {
+            xValues[i] = stream.xMin + (index + i) * stream.deltaX;
+        }
+        evaluateExpressionBatch(expression, xValues, stream.yValues, count);
+    }
+
+    point->x = (float) ((double) index / (stream.numPoints - 1) * X_MAX);
+    point->y = windowYInSteps(stream.yValues[inChunk], stream.yMin, stream.yMax);
+    bool inside = !std::isnan(point->y);
+    if (inside && !stream.lastInside) {
+        stream.numPieces++;
+    }
+    stream.lastInside = inside;
+    stream.next++;
+    return true;
+}
+
+bool nextArrayPoint(void *context, Point *point) {
+    ArrayPointCursor &cursor = *(ArrayPointCursor *) context;
+    if (cursor.next >= cursor.points.numPoints) {
+        return false;
+    }
+    *point = cursor.points.points[cursor.next];
+    cursor.next++;
+    return true;
+}
+
+void freeCoefficients(PolynomialCoefficients coefficients) {
+    delete[] coefficients.coefficients;
+}
+
+//Horner's method: ax^3 + bx^2 + cx + d = ((ax + b)x + c)x + d.
+double evaluateCoefficients(const PolynomialCoefficients &coefficients, double x) {
+    const double *c = coefficients.coefficients;
+    double y = c[coefficients.degree];
+    for (int k = coefficients.degree - 1; k >= 0; k--) {
+        y = y * x + c[k];
+    }
+    return y;
+}
+
+//Horner's method on a few x-values at once. It uses AVX (4 at a time) or SSE2 / NEON (2 at a time) if the compiler
+//is allowed to, and plain Horner's method for whatever is left over (and on CPUs without any of them, like the Omega).
+void evaluateCoefficientsBatch(const PolynomialCoefficients &coefficients, const double *x, double *y, int count) {
+    const double *c = coefficients.coefficients;
+    const int degree = coefficients.degree;
+    int i = 0;
+
+#if defined(__AVX__)
+    for (; i + 4 <= count; i += 4) {
+        __m256d xs = _mm256_loadu_pd(x + i);
+        __m256d ys = _mm256_set1_pd(c[degree]);
+        for (int k = degree - 1; k >= 0; k--) {
+            ys = _mm256_add_pd(_mm256_mul_pd(ys, xs), _mm256_set1_pd(c[k]));
+        }
+        _mm256_storeu_pd(y + i, ys);
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= count; i += 2) {
+        __m128d xs = _mm_loadu_pd(x + i);
+        __m128d ys = _mm_set1_pd(c[degree]);
+        for (int k = degree - 1; k >= 0; k--) {
+            ys = _mm_add_pd(_mm_mul_pd(ys, xs), _mm_set1_pd(c[k]));
+        }
+        _mm_storeu_pd(y + i, ys);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 2 <= count; i += 2) {
+        float64x2_t xs = vld1q_f64(x + i);
+        float64x2_t ys = vdupq_n_f64(c[degree]);
+        for (int k = degree - 1; k >= 0; k--) {
+            ys = vfmaq_f64(vdupq_n_f64(c[k]), ys, xs);
+        }
+        vst1q_f64(y + i, ys);
+    }
+#endif
+
+    for (; i < count; i++) {
+        y[i] = evaluateCoefficients(coefficients, x[i]);
+    }
+}
+
+//Times the old way (pow for every power of x) against evaluateExpression and the batch version, for grids of 10^2 up
+//to 10^7 points between -1 and 1. The grid is done in chunks, so it doesn't need 10^7 points worth of memory.
+//Only polynomials can be done the old way, so for anything else the pow column is the same as evaluateExpression.
+int benchmarkPolynomialEvaluation(const char input[]) {
+    const int CHUNK_SIZE = 4096;
+
+    CompiledExpression expression;
+    std::string error;
+    if (!compileExpression(input, &expression, &error)) {
+        logToConsole(LOG_ERROR) << "Error, \"" << input << "\" is not valid: " << error;
+        return 1;
+    }
+
+    double *x = new double[CHUNK_SIZE];
+    double *y = new double[CHUNK_SIZE];
+    double checksum = 0;
+
+    logToConsole(LOG_INFO) << "points, pow (ns/point), one at a time (ns/point), batch (ns/point)";
+    for (long numPoints = 100; numPoints <= 10000000; numPoints *= 10) {
+        double times[3];
+        for (int method = 0; method < 3; method++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (long done = 0; done < numPoints; done += CHUNK_SIZE) {
+                int count = (int) std::min((long) CHUNK_SIZE, numPoints - done);
+                for (int i = 0; i < count; i++) {
+                    x[i] = -1.0 + 2.0 * (double) (done + i) / (double) numPoints;
+                }
+                if (method == 0 && expression.isPolynomial) {
+                    const PolynomialCoefficients &coefficients = expression.coefficients;
+                    for (int i = 0; i < count; i++) {
+                        y[i] = 0;
+                        for (int k = 0; k <= coefficients.degree; k++) {
+                            y[i] += coefficients.coefficients[k] * pow(x[i], (double) k);
+                        }
+                    }
+                } else if (method < 2) {
+                    for (int i = 0; i < count; i++) {
+                        y[i] = evaluateExpression(expression, x[i]);
+                    }
+                } else {
+                    evaluateExpressionBatch(expression, x, y, count);
+                }
+                checksum += y[count - 1];
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            times[method] = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / numPoints;
+        }
+        logToConsole(LOG_INFO) << numPoints << ", " << times[0] << ", " << times[1] << ", " << times[2];
+    }
+    //Print this so the compiler can't skip any of the work.
+    logToConsole(LOG_INFO) << "checksum: " << checksum;
+
+    delete[] x;
+    delete[] y;
+    freeCompiledExpression(expression);
+    return 0;
+}
+
+//Where x on the polynomial ends up on the plotter, in steps. y is NaN if it's outside of the window.
+Point polynomialPointInSteps(const CompiledExpression &expression, const float xMax, const float yMin,
+                             const float yMax, const float xMin, float x) {
+    Point point;
+    point.x = (x - xMin) / (xMax - xMin) * X_MAX;
+    point.y = windowYInSteps(evaluateExpression(expression, x), yMin, yMax);
+    return point;
+}
+
+float windowYInSteps(double y, const float yMin, const float yMax) {
+    double steps = (y - yMin) / ((double) yMax - yMin) * Y_MAX;
+    if (std::isnan(steps) || steps < -CLIP_SLACK || steps > Y_MAX + CLIP_SLACK) {
+        return NAN;
+    }
+    return (float) std::min(std::max(steps, 0.0), (double) Y_MAX);
+}
+
+int findVisibleIntervals(const PolynomialCoefficients &coefficients, double xMin, double xMax, double yMin,
+                         double yMax, VisibleInterval *intervals) {
+    std::vector<double> edges;
+    edges.push_back(xMin);
+    findPolynomialCrossings(coefficients, yMin, xMin, xMax, edges);
+    findPolynomialCrossings(coefficients, yMax, xMin, xMax, edges);
+    edges.push_back(xMax);
+    std::sort(edges.begin(), edges.end());
+
+    //The polynomial is all the way in or all the way out between two edges, so the middle says which.
+    int numIntervals = 0;
+    for (size_t i = 0; i + 1 < edges.size(); i++) {
+        if (edges[i + 1] <= edges[i]) {
+            continue;
+        }
+        double y = evaluateCoefficients(coefficients, (edges[i] + edges[i + 1]) / 2);
+        if (y < yMin || y > yMax) {
+            continue;
+        }
+        //Two in a row can happen if it crosses yMin and yMax at almost exactly the same x, which means it's so steep
+        //that it doesn't matter, so they just get joined.
+        if (numIntervals > 0 && intervals[numIntervals - 1].end == edges[i]) {
+            intervals[numIntervals - 1].end = edges[i + 1];
+        } else if (numIntervals <= EXPRESSION_MAX_DEGREE) {
+            intervals[numIntervals].start = edges[i];
+            intervals[numIntervals].end = edges[i + 1];
+            numIntervals++;
+        }
+    }
+    return numIntervals;
+}
+
+void findPolynomialCrossings(const PolynomialCoefficients &coefficients, double value, double xMin, double xMax,
+                             std::vector<double> &crossings) {
+    std::vector<double> polynomial(coefficients.coefficients, coefficients.coefficients + coefficients.degree + 1);
+    polynomial[0] -= value;
+    if (polynomial.size() < 2) {
+        return;
+    }
+    std::vector<std::vector<double> > sequence = sturmSequence(polynomial);
+    isolateCrossings(sequence, xMin, xMax, sturmSignChanges(sequence, xMin), sturmSignChanges(sequence, xMax), 0,
+                     crossings);
+}
+
+std::vector<std::vector<double> > sturmSequence(const std::vector<double> &polynomial) {
+    std::vector<std::vector<double> > sequence;
+    sequence.push_back(polynomial);
+    std::vector<double> derivative(polynomial.size() - 1);
+    for (size_t k = 1; k < polynomial.size(); k++) {
+        derivative[k - 1] = k * polynomial[k];
+    }
+    sequence.push_back(derivative);
+
+    while (sequence.back().size() > 1) {
+        //Long division, keeping only the remainder.
+        std::vector<double> remainder = sequence[sequence.size() - 2];
+        const std::vector<double> &divisor = sequence.back();
+        double size = 0;
+        for (size_t k = 0; k < remainder.size(); k++) {
+            size = std::max(size, fabs(remainder[k]));
+        }
+        for (int k = (int) remainder.size() - 1; k >= (int) divisor.size() - 1; k--) {
+            double factor = remainder[k] / divisor.back();
+            for (size_t j = 0; j < divisor.size(); j++) {
+                remainder[k - divisor.size() + 1 + j] -= factor * divisor[j];
+            }
+        }
+        remainder.resize(divisor.size() - 1);
+
+        //Anything that's just rounding error counts as zero. If the whole remainder is zero, the polynomial has
+        //repeated roots, and the sequence stops here (it still counts each root once).
+        double largest = 0;
+        for (size_t k = 0; k < remainder.size(); k++) {
+            if (fabs(remainder[k]) <= size * 1e-12) {
+                remainder[k] = 0;
+            }
+            largest = std::max(largest, fabs(remainder[k]));
+        }
+        while (remainder.size() > 1 && remainder.back() == 0) {
+            remainder.pop_back();
+        }
+        if (largest == 0) {
+            break;
+        }
+        //Scale it so the biggest coefficient is -1 (it's the negative of the remainder), so the numbers don't run
+        //off to infinity or zero.
+        for (size_t k = 0; k < remainder.size(); k++) {
+            remainder[k] /= -largest;
+        }
+        sequence.push_back(remainder);
+    }
+    return sequence;
+}
+
+int sturmSignChanges(const std::vector<std::vector<double> > &sequence, double x) {
+    int changes = 0;
+    double last = 0;
+    for (size_t i = 0; i < sequence.size(); i++) {
+        double value = evaluatePolynomial(sequence[i], x);
+        if (value == 0) {
+            continue;
+        }
+        if (last != 0 && (value > 0) != (last > 0)) {
+            changes++;
+        }
+        last = value;
+    }
+    return changes;
+}
+
+void isolateCrossings(const std::vector<std::vector<double> > &sequence, double a, double b, int changesA,
+                      int changesB, int depth, std::vector<double> &crossings) {
+    int numRoots = changesA - changesB;
+    if (numRoots <= 0) {
+        return;
+    }
+    double middle = (a + b) / 2;
+    if (numRoots > 1 && depth < ROOT_ISOLATION_MAX_DEPTH && middle > a && middle < b) {
+        int changesMiddle = sturmSignChanges(sequence, middle);
+        isolateCrossings(sequence, a, middle, changesA, changesMiddle, depth + 1, crossings);
+        isolateCrossings(sequence, middle, b, changesMiddle, changesB, depth + 1, crossings);
+        return;
+    }
+
+    //Only one root in here (or they're too close together to tell apart). If the sign is the same at both ends, it
+    //only touches and doesn't cross, so it doesn't change what's visible.
+    const std::vector<double> &polynomial = sequence[0];
+    double valueA = evaluatePolynomial(polynomial, a);
+    double valueB = evaluatePolynomial(polynomial, b);
+    if (valueB == 0) {
+        crossings.push_back(b);
+        return;
+    }
+    if ((valueA > 0) == (valueB > 0)) {
+        return;
+    }
+    while (true) {
+        middle = (a + b) / 2;
+        if (middle <= a || middle >= b) {
+            break;
+        }
+        double value = evaluatePolynomial(polynomial, middle);
+        if (value == 0) {
+            a = b = middle;
+            break;
+        }
+        if ((value > 0) == (valueA > 0)) {
+            a = middle;
+            valueA = value;
+        } else {
+            b = middle;
+        }
+    }
+    crossings.push_back((a + b) / 2);
+}
+
+double evaluatePolynomial(const std::vector<double> &polynomial, double x) {
+    double y = polynomial.back();
+    for (int k = (int) polynomial.size() - 2; k >= 0; k--) {
+        y = y * x + polynomial[k];
+    }
+    return y;
+}
+
+//How far point is from the line through lineStart and lineEnd, in steps.
+float distanceFromChord(Point point, Point lineStart, Point lineEnd) {
+    float dx = lineEnd.x - lineStart.x;
+    float dy = lineEnd.y - lineStart.y;
+    float length = sqrtf(dx * dx + dy * dy);
+    if (length == 0) {
+        return sqrtf((point.x - lineStart.x) * (point.x - lineStart.x) +
+                     (point.y - lineStart.y) * (point.y - lineStart.y));
+    }
+    return fabsf(dy * (point.x - lineStart.x) - dx * (point.y - lineStart.y)) / length;
+}
+
+//Adds the points for the piece of the polynomial between a and b (but not a itself, the caller already has that one).
+//It checks the middle and the quarter points of the piece:
+//- If the whole thing is inside the window, and they're all within tolerance of the line from a to b, b is enough.
+//- If some of it is inside the window and some isn't, it keeps splitting until it finds the edge to within a step.
+//- If none of it is inside the window, b gets added as a NaN point so the pen goes up.
+//Otherwise it splits the piece in half and does each half.
+void sampleAdaptively(const CompiledExpression &expression, const float xMax, const float yMin, const float yMax,
+                      const float xMin, const float tolerance, float a, float b, int depth,
+                      std::vector<Point> &points) {
+    Point start = polynomialPointInSteps(expression, xMax, yMin, yMax, xMin, a);
+    Point end = polynomialPointInSteps(expression, xMax, yMin, yMax, xMin, b);
+    Point checks[3];
+    for (int i = 0; i < 3; i++) {
+        checks[i] = polynomialPointInSteps(expression, xMax, yMin, yMax, xMin, a + (b - a) * (i + 1) / 4.0f);
+    }
+
+    int numInside = (!std::isnan(start.y)) + (!std::isnan(end.y));
+    for (int i = 0; i < 3; i++) {
+        numInside += !std::isnan(checks[i].y);
+    }
+
+    bool done;
+    if (numInside == 0) {
+        done = true;
+    } else if (numInside == 5) {
+        float error = 0;
+        for (int i = 0; i < 3; i++) {
+            error = std::max(error, distanceFromChord(checks[i], start, end));
+        }
+        done = error <= tolerance;
+    } else {
+        //Half a step is close enough to the edge of the window.
+        done = (end.x - start.x) <= 0.5f;
+    }
+
+    if (done || depth >= SAMPLING_MAX_DEPTH) {
+        points.push_back(end);
+        return;
+    }
+
+    float middle = (a + b) / 2;
+    sampleAdaptively(expression, xMax, yMin, yMax, xMin, tolerance, a, middle, depth + 1, points);
+    sampleAdaptively(expression, xMax, yMin, yMax, xMin, tolerance, middle, b, depth + 1, points);
+}
+
+//Flat parts of the polynomial only get a few points, and steep or curvy parts get lots, so the plotter gets the
+//fewest points it needs to draw the curve to within tolerance steps. The points are already in steps (translated and
+//scaled like createArrayOfPolynomialPoints does), and the ones outside the window have a NaN y-value.
+//Polynomials only get sampled inside their visible intervals, which start and end exactly on the edge of the window,
+//with one NaN point between each of them. Anything else gets sampled across the whole window, and sampleAdaptively
+//finds the edges.
+ArrayOfPoints
+createArrayOfAdaptivePolynomialPoints(const CompiledExpression &expression, const float xMax, const float yMin,
+                                      const float yMax, const float xMin, const float tolerance) {
+    //Close inputs:
+    if (xMax <= xMin || yMax <= yMin) {
+        ArrayOfPoints failure;
+        failure.points = nullptr;
+        failure.numPoints = 0;
+        return failure;
+    }
+
+    VisibleInterval intervals[EXPRESSION_MAX_DEGREE + 1];
+    int numIntervals = 1;
+    intervals[0].start = xMin;
+    intervals[0].end = xMax;
+    if (expression.isPolynomial) {
+        numIntervals = findVisibleIntervals(expression.coefficients, xMin, xMax, yMin, yMax, intervals);
+    }
+
+    std::vector<Point> sampled;
+    if (numIntervals == 0) {
+        sampled.push_back(polynomialPointInSteps(expression, xMax, yMin, yMax, xMin, xMin));
+    }
+    for (int i = 0; i < numIntervals; i++) {
+        float start = (float) intervals[i].start;
+        float end = (float) intervals[i].end;
+        if (i > 0) {
+            Point gap;
+            gap.x = (start - xMin) / (xMax - xMin) * X_MAX;
+            gap.y = NAN;
+            sampled.push_back(gap);
+        }
+        sampled.push_back(polynomialPointInSteps(expression, xMax, yMin, yMax, xMin, start));
+
+        //Start off with a few evenly spaced pieces, so that a wiggle in the middle of a big piece doesn't get missed.
+        //Each interval gets its share of SAMPLING_INITIAL_INTERVALS.
+        int numPieces = std::max(1, (int) ceil(SAMPLING_INITIAL_INTERVALS * (end - start) / (xMax - xMin)));
+        float deltaX = (end - start) / numPieces;
+        for (int j = 0; j < numPieces; j++) {
+            float a = start + deltaX * j;
+            float b = (j == numPieces - 1) ? end : start + deltaX * (j + 1);
+            sampleAdaptively(expression, xMax, yMin, yMax, xMin, tolerance, a, b, 0, sampled);
+        }
+    }
+
+    ArrayOfPoints points;
+    points.numPoints = (int) sampled.size();
+    points.points = new Point[points.numPoints];
+    for (int i = 0; i < points.numPoints; i++) {
+        points.points[i] = sampled[i];
+    }
+    return points;
+}
+
+bool compileExpression(const char input[], CompiledExpression *expression, std::string *error) {
+    ExpressionParser parser;
+    parser.input = input;
+    parser.position = 0;
+    parser.nesting = 0;
+    nextExpressionToken(parser);
+
+    int root = parseExpressionSum(parser);
+    if (root >= 0 && parser.token.type != TOKEN_END) {
+        expressionError(parser, (parser.token.type == TOKEN_RIGHT_PARENTHESIS) ? "there's a ) without a (" :
+                                "expected + or -");
+    }
+    if (!parser.error.empty()) {
+        *error = parser.error;
+        return false;
+    }
+
+    expression->program.clear();
+    expression->polynomials.clear();
+    expression->stackSize = 0;
+    expression->isPolynomial = (parser.nodes[root].op == OP_POLYNOMIAL);
+    if (expression->isPolynomial) {
+        const std::vector<double> &polynomial = parser.nodes[root].polynomial;
+        expression->coefficients.degree = (int) polynomial.size() - 1;
+        expression->coefficients.coefficients = new double[polynomial.size()];
+        std::copy(polynomial.begin(), polynomial.end(), expression->coefficients.coefficients);
+        return true;
+    }
+    expression->coefficients.degree = 0;
+    expression->coefficients.coefficients = nullptr;
+
+    emitExpressionNode(parser, root, *expression);
+
+    //Go through the program once to see how big the stack gets.
+    int stackSize = 0;
+    for (size_t i = 0; i < expression->program.size(); i++) {
+        ExpressionOp op = expression->program[i].op;
+        if (op == OP_CONSTANT || op == OP_X || op == OP_POLYNOMIAL) {
+            stackSize++;
+        } else if (op == OP_ADD || op == OP_SUBTRACT || op == OP_MULTIPLY || op == OP_DIVIDE || op == OP_POWER) {
+            stackSize--;
+        }
+        expression->stackSize = std::max(expression->stackSize, stackSize);
+    }
+    if (expression->stackSize > EXPRESSION_MAX_STACK) {
+        freeCompiledExpression(*expression);
+        *error = "it's too complicated";
+        return false;
+    }
+    return true;
+}
+
+void freeCompiledExpression(CompiledExpression &expression) {
+    if (expression.isPolynomial) {
+        freeCoefficients(expression.coefficients);
+    }
+    for (size_t i = 0; i < expression.polynomials.size(); i++) {
+        freeCoefficients(expression.polynomials[i]);
+    }
+    expression.polynomials.clear();
+    expression.program.clear();
+}
+
+//Reads the next token into parser.token. Spaces don't matter anywhere.
+void nextExpressionToken(ExpressionParser &parser) {
+    const char *input = parser.input;
+    while (input[parser.position] == ' ' || input[parser.position] == '\t') {
+        parser.position++;
+    }
+
+    ExpressionToken &token = parser.token;
+    token.start = parser.position;
+    token.value = 0;
+    char c = input[parser.position];
+
+    if ((c >= '0' && c <= '9') || c == '.') {
+        //Read the digits straight into a double, so there isn't any limit on how many there are.
+        bool haveDigits = false;
+        while (input[parser.position] >= '0' && input[parser.position] <= '9') {
+            token.value = token.value * 10 + (input[parser.position] - '0');
+            parser.position++;
+            haveDigits = true;
+        }
+        if (input[parser.position] == '.') {
+            parser.position++;
+            double place = 0.1;
+            while (input[parser.position] >= '0' && input[parser.position] <= '9') {
+                token.value += (input[parser.position] - '0') * place;
+                place /= 10;
+                parser.position++;
+                haveDigits = true;
+            }
+        }
+        token.type = haveDigits ? TOKEN_NUMBER : TOKEN_INVALID;
+        return;
+    }
+
+    //x is always one letter by itself, so 2xsin(x) is 2 * x * sin(x).
+    if (c == 'x' || c == 'X') {
+        token.type = TOKEN_X;
+        parser.position++;
+        return;
+    }
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        int end = parser.position;
+        while ((input[end] >= 'a' && input[end] <= 'z') || (input[end] >= 'A' && input[end] <= 'Z')) {
+            end++;
+        }
+        std::string name(input + parser.position, input + end);
+        parser.position = end;
+        token.type = TOKEN_FUNCTION;
+        if (name == "sin") {
+            token.function = OP_SIN;
+        } else if (name == "cos") {
+            token.function = OP_COS;
+        } else if (name == "exp") {
+            token.function = OP_EXP;
+        } else if (name == "sqrt") {
+            token.function = OP_SQRT;
+        } else if (name == "pi") {
+            token.type = TOKEN_NUMBER;
+            token.value = M_PI;
+        } else {
+            token.type = TOKEN_INVALID;
+        }
+        return;
+    }
+
+    switch (c) {
+        case 0:
+            token.type = TOKEN_END;
+            return;
+        case '+':
+            token.type = TOKEN_PLUS;
+            break;
+        case '-':
+            token.type = TOKEN_MINUS;
+            break;
+        case '*':
+            token.type = TOKEN_TIMES;
+            break;
+        case '/':
+            token.type = TOKEN_DIVIDE;
+            break;
+        case '^':
+            token.type = TOKEN_POWER;
+            break;
+        case '(':
+            token.type = TOKEN_LEFT_PARENTHESIS;
+            break;
+        case ')':
+            token.type = TOKEN_RIGHT_PARENTHESIS;
+            break;
+        default:
+            token.type = TOKEN_INVALID;
+            break;
+    }
+    parser.position++;
+}
+
+int parseExpressionSum(ExpressionParser &parser) {
+    int node = parseExpressionProduct(parser);
+    while (node >= 0 && (parser.token.type == TOKEN_PLUS || parser.token.type == TOKEN_MINUS)) {
+        ExpressionOp op = (parser.token.type == TOKEN_PLUS) ? OP_ADD : OP_SUBTRACT;
+        nextExpressionToken(parser);
+        int right = parseExpressionProduct(parser);
+        if (right < 0) {
+            return -1;
+        }
+        node = addExpressionNode(parser, op, node, right);
+    }
+    return node;
+}
+
+//Two things next to each other get multiplied (2x, 3(x + 1), x sin(x), 2pi), unless the second one is written out in
+//digits, since something like 2 3 is much more likely to be a typo than 6.
+int parseExpressionProduct(ExpressionParser &parser) {
+    int node = parseExpressionUnary(parser);
+    while (node >= 0) {
+        ExpressionTokenType type = parser.token.type;
+        ExpressionOp op;
+        if (type == TOKEN_TIMES || type == TOKEN_DIVIDE) {
+            op = (type == TOKEN_TIMES) ? OP_MULTIPLY : OP_DIVIDE;
+            nextExpressionToken(parser);
+        } else if (type == TOKEN_X || type == TOKEN_FUNCTION || type == TOKEN_LEFT_PARENTHESIS ||
+                   (type == TOKEN_NUMBER && isalpha(parser.input[parser.token.start]))) {
+            op = OP_MULTIPLY;
+        } else {
+            break;
+        }
+        int right = parseExpressionUnary(parser);
+        if (right < 0) {
+            return -1;
+        }
+        node = addExpressionNode(parser, op, node, right);
+    }
+    return node;
+}
+
+int parseExpressionUnary(ExpressionParser &parser) {
+    if (++parser.nesting > EXPRESSION_MAX_NESTING) {
+        expressionError(parser, "it's nested too deep");
+        return -1;
+    }
+    int node;
+    if (parser.token.type == TOKEN_MINUS || parser.token.type == TOKEN_PLUS) {
+        bool negate = (parser.token.type == TOKEN_MINUS);
+        nextExpressionToken(parser);
+        node = parseExpressionUnary(parser);
+        if (node >= 0 && negate) {
+            node = addExpressionNode(parser, OP_NEGATE, node, -1);
+        }
+    } else {
+        node = parseExpressionPower(parser);
+    }
+    parser.nesting--;
+    return node;
+}
+
+//^ goes right to left, so x^2^3 is x^8, and it comes before a - in front of it, so -x^2 is -(x^2).
+int parseExpressionPower(ExpressionParser &parser) {
+    int node = parseExpressionPrimary(parser);
+    if (node < 0 || parser.token.type != TOKEN_POWER) {
+        return node;
+    }
+    nextExpressionToken(parser);
+    int exponent = parseExpressionUnary(parser);
+    if (exponent < 0) {
+        return -1;
+    }
+    return addExpressionNode(parser, OP_POWER, node, exponent);
+}
+
+int parseExpressionPrimary(ExpressionParser &parser) {
+    ExpressionToken token = parser.token;
+    if (token.type == TOKEN_NUMBER) {
+        nextExpressionToken(parser);
+        return addPolynomialNode(parser, std::vector<double>(1, token.value));
+    }
+    if (token.type == TOKEN_X) {
+        nextExpressionToken(parser);
+        std::vector<double> x(2, 0.0);
+        x[1] = 1;
+        return addPolynomialNode(parser, x);
+    }
+    if (token.type == TOKEN_FUNCTION || token.type == TOKEN_LEFT_PARENTHESIS) {
+        nextExpressionToken(parser);
+        if (token.type == TOKEN_FUNCTION) {
+            if (parser.token.type != TOKEN_LEFT_PARENTHESIS) {
+                expressionError(parser, "expected a ( after the function");
+                return -1;
+            }
+            nextExpressionToken(parser);
+        }
+        int node = parseExpressionSum(parser);
+        if (node < 0) {
+            return -1;
+        }
+        if (parser.token.type != TOKEN_RIGHT_PARENTHESIS) {
+            expressionError(parser, "expected a )");
+            return -1;
+        }
+        nextExpressionToken(parser);
+        return (token.type == TOKEN_FUNCTION) ? addExpressionNode(parser, token.function, node, -1) : node;
+    }
+
+    if (token.type == TOKEN_END) {
+        expressionError(parser, "it ends too soon");
+    } else if (token.type == TOKEN_INVALID) {
+        expressionError(parser, "don't know what this is");
+    } else {
+        expressionError(parser, "expected a number, x, a function or a (");
+    }
+    return -1;
+}
+
+void expressionError(ExpressionParser &parser, const std::string &message) {
+    if (!parser.error.empty()) {
+        return;
+    }
+    std::ostringstream error;
+    error << message << " (at character " << parser.token.start + 1 << ")";
+    parser.error = error.str();
+}
+
+int addExpressionNode(ExpressionParser &parser, ExpressionOp op, int left, int right) {
+    //These are only good until the next node gets added, since that can move the nodes around.
+    static const std::vector<double> none;
+    const std::vector<double> &a = parser.nodes[left].polynomial;
+    const std::vector<double> &b = (right >= 0) ? parser.nodes[right].polynomial : none;
+    bool leftIsPolynomial = (parser.nodes[left].op == OP_POLYNOMIAL);
+    bool rightIsPolynomial = (right >= 0 && parser.nodes[right].op == OP_POLYNOMIAL);
+    bool leftIsNumber = leftIsPolynomial && a.size() == 1;
+    bool rightIsNumber = rightIsPolynomial && b.size() == 1;
+
+    switch (op) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+            if (leftIsPolynomial && rightIsPolynomial) {
+                return addPolynomialNode(parser, addPolynomials(a, b, (op == OP_ADD) ? 1 : -1));
+            }
+            break;
+        case OP_MULTIPLY:
+            if (leftIsPolynomial && rightIsPolynomial && (int) (a.size() + b.size()) - 2 <= EXPRESSION_MAX_DEGREE) {
+                return addPolynomialNode(parser, multiplyPolynomials(a, b));
+            }
+            break;
+        case OP_DIVIDE:
+            if (rightIsNumber && b[0] == 0) {
+                expressionError(parser, "it divides by zero");
+                return -1;
+            }
+            if (leftIsPolynomial && rightIsNumber) {
+                return addPolynomialNode(parser, multiplyPolynomials(a, std::vector<double>(1, 1 / b[0])));
+            }
+            break;
+        case OP_POWER:
+            if (leftIsNumber && rightIsNumber) {
+                double value = pow(a[0], b[0]);
+                if (std::isnan(value) || std::isinf(value)) {
+                    expressionError(parser, "that power isn't a real number");
+                    return -1;
+                }
+                return addPolynomialNode(parser, std::vector<double>(1, value));
+            }
+            //(x + 1)^3 gets multiplied out, as long as the power is a whole number and it isn't too big.
+            if (leftIsPolynomial && rightIsNumber && b[0] >= 0 && b[0] == floor(b[0]) &&
+                (a.size() - 1) * b[0] <= EXPRESSION_MAX_DEGREE) {
+                std::vector<double> power(1, 1.0);
+                for (int i = 0; i < (int) b[0]; i++) {
+                    power = multiplyPolynomials(power, a);
+                }
+                return addPolynomialNode(parser, power);
+            }
+            break;
+        case OP_NEGATE:
+            if (leftIsPolynomial) {
+                return addPolynomialNode(parser, multiplyPolynomials(a, std::vector<double>(1, -1.0)));
+            }
+            break;
+        case OP_SIN:
+        case OP_COS:
+        case OP_EXP:
+        case OP_SQRT:
+            if (leftIsNumber) {
+                if (op == OP_SQRT && a[0] < 0) {
+                    expressionError(parser, "it takes the square root of a negative number");
+                    return -1;
+                }
+                double value = (op == OP_SIN) ? sin(a[0]) : (op == OP_COS) ? cos(a[0]) : (op == OP_EXP) ? exp(a[0])
+                                                                                                     : sqrt(a[0]);
+                return addPolynomialNode(parser, std::vector<double>(1, value));
+            }
+            break;
+        default:
+            break;
+    }
+
+    ExpressionNode node;
+    node.op = op;
+    node.left = left;
+    node.right = right;
+    parser.nodes.push_back(node);
+    return (int) parser.nodes.size() - 1;
+}
+
+//Gets rid of leading zeros (like 2x^3 - 2x^3 + x) first, so Horner's method doesn't do any extra work.
+int addPolynomialNode(ExpressionParser &parser, const std::vector<double> &polynomial) {
+    ExpressionNode node;
+    node.op = OP_POLYNOMIAL;
+    node.left = -1;
+    node.right = -1;
+    node.polynomial = polynomial;
+    while (node.polynomial.size() > 1 && node.polynomial.back() == 0) {
+        node.polynomial.pop_back();
+    }
+    parser.nodes.push_back(node);
+    return (int) parser.nodes.size() - 1;
+}
+
+//a + bSign * b.
+std::vector<double> addPolynomials(const std::vector<double> &a, const std::vector<double> &b, double bSign) {
+    std::vector<double> sum(std::max(a.size(), b.size()), 0.0);
+    for (size_t i = 0; i < a.size(); i++) {
+        sum[i] += a[i];
+    }
+    for (size_t i = 0; i < b.size(); i++) {
+        sum[i] += bSign * b[i];
+    }
+    return sum;
+}
+
+std::vector<double> multiplyPolynomials(const std::vector<double> &a, const std::vector<double> &b) {
+    std::vector<double> product(a.size() + b.size() - 1, 0.0);
+    for (size_t i = 0; i < a.size(); i++) {
+        for (size_t j = 0; j < b.size(); j++) {
+            product[i + j] += a[i] * b[j];
+        }
+    }
+    return product;
+}
+
+//Adds the instructions for node to the end of the program: its left side, then its right side, then itself.
+void emitExpressionNode(const ExpressionParser &parser, int node, CompiledExpression &expression) {
+    const ExpressionNode &expressionNode = parser.nodes[node];
+    ExpressionInstruction instruction;
+    instruction.op = expressionNode.op;
+    instruction.polynomial = -1;
+    instruction.value = 0;
+
+    if (expressionNode.op == OP_POLYNOMIAL) {
+        const std::vector<double> &polynomial = expressionNode.polynomial;
+        if (polynomial.size() == 1) {
+            instruction.op = OP_CONSTANT;
+            instruction.value = polynomial[0];
+        } else if (polynomial.size() == 2 && polynomial[0] == 0 && polynomial[1] == 1) {
+            instruction.op = OP_X;
+        } else {
+            PolynomialCoefficients coefficients;
+            coefficients.degree = (int) polynomial.size() - 1;
+            coefficients.coefficients = new double[polynomial.size()];
+            std::copy(polynomial.begin(), polynomial.end(), coefficients.coefficients);
+            instruction.polynomial = (int) expression.polynomials.size();
+            expression.polynomials.push_back(coefficients);
+        }
+        expression.program.push_back(instruction);
+        return;
+    }
+
+    emitExpressionNode(parser, expressionNode.left, expression);
+    if (expressionNode.right >= 0) {
+        emitExpressionNode(parser, expressionNode.right, expression);
+    }
+    expression.program.push_back(instruction);
+}
+
+double evaluateExpression(const CompiledExpression &expression, double x) {
+    if (expression.isPolynomial) {
+        return evaluateCoefficients(expression.coefficients, x);
+    }
+
+    double stack[EXPRESSION_MAX_STACK];
+    int top = -1;
+    const ExpressionInstruction *program = expression.program.data();
+    const int programSize = (int) expression.program.size();
+    for (int i = 0; i < programSize; i++) {
+        switch (program[i].op) {
+            case OP_CONSTANT:
+                stack[++top] = program[i].value;
+                break;
+            case OP_X:
+                stack[++top] = x;
+                break;
+            case OP_POLYNOMIAL:
+                stack[++top] = evaluateCoefficients(expression.polynomials[program[i].polynomial], x);
+                break;
+            case OP_ADD:
+                top--;
+                stack[top] += stack[top + 1];
+                break;
+            case OP_SUBTRACT:
+                top--;
+                stack[top] -= stack[top + 1];
+                break;
+            case OP_MULTIPLY:
+                top--;
+                stack[top] *= stack[top + 1];
+                break;
+            case OP_DIVIDE:
+                top--;
+                stack[top] /= stack[top + 1];
+                break;
+            case OP_POWER:
+                top--;
+                stack[top] = pow(stack[top], stack[top + 1]);
+                break;
+            case OP_NEGATE:
+                stack[top] = -stack[top];
+                break;
+            case OP_SIN:
+                stack[top] = sin(stack[top]);
+                break;
+            case OP_COS:
+                stack[top] = cos(stack[top]);
+                break;
+            case OP_EXP:
+                stack[top] = exp(stack[top]);
+                break;
+            case OP_SQRT:
+                stack[top] = sqrt(stack[top]);
+                break;
+        }
+    }
+    return stack[0];
+}
+
+void evaluateExpressionBatch(const CompiledExpression &expression, const double *x, double *y, int count) {
+    if (expression.isPolynomial) {
+        evaluateCoefficientsBatch(expression.coefficients, x, y, count);
+        return;
+    }
+
+    double stack[EXPRESSION_MAX_STACK][EXPRESSION_BATCH_SIZE];
+    const ExpressionInstruction *program = expression.program.data();
+    const int programSize = (int) expression.program.size();
+    for (int done = 0; done < count; done += EXPRESSION_BATCH_SIZE) {
+        const int n = std::min(EXPRESSION_BATCH_SIZE, count - done);
+        const double *xs = x + done;
+        int top = -1;
+        for (int i = 0; i < programSize; i++) {
+            double *a = (top >= 0) ? stack[top] : nullptr;
+            double *b = stack[top + 1];
+            switch (program[i].op) {
+                case OP_CONSTANT:
+                    std::fill(b, b + n, program[i].value);
+                    top++;
+                    break;
+                case OP_X:
+                    std::copy(xs, xs + n, b);
+                    top++;
+                    break;
+                case OP_POLYNOMIAL:
+                    evaluateCoefficientsBatch(expression.polynomials[program[i].polynomial], xs, b, n);
+                    top++;
+                    break;
+                case OP_ADD:
+                    top--;
+                    a = stack[top];
+                    b = stack[top + 1];
+                    for (int j = 0; j < n; j++) {
+                        a[j] += b[j];
+                    }
+                    break;
+                case OP_SUBTRACT:
+                    top--;
+                    a = stack[top];
+                    b = stack[top + 1];
+                    for (int j = 0; j < n; j++) {
+                        a[j] -= b[j];
+                    }
+                    break;
+                case OP_MULTIPLY:
+                    top--;
+                    a = stack[top];
+                    b = stack[top + 1];
+                    for (int j = 0; j < n; j++) {
+                        a[j] *= b[j];
+                    }
+                    break;
+                case OP_DIVIDE:
+                    top--;
+                    a = stack[top];
+                    b = stack[top + 1];
+                    for (int j = 0; j < n; j++) {
+                        a[j] /= b[j];
+                    }
+                    break;
+                case OP_POWER:
+                    top--;
+                    a = stack[top];
+                    b = stack[top + 1];
+                    for (int j = 0; j < n; j++) {
+                        a[j] = pow(a[j], b[j]);
+                    }
+                    break;
+                case OP_NEGATE:
+                    for (int j = 0; j < n; j++) {
+                        a[j] = -a[j];
+                    }
+                    break;
+                case OP_SIN:
+                    for (int j = 0; j < n; j++) {
+                        a[j] = sin(a[j]);
+                    }
+                    break;
+                case OP_COS:
+                    for (int j = 0; j < n; j++) {
+                        a[j] = cos(a[j]);
+                    }
+                    break;
+                case OP_EXP:
+                    for (int j = 0; j < n; j++) {
+                        a[j] = exp(a[j]);
+                    }
+                    break;
+                case OP_SQRT:
+                    for (int j = 0; j < n; j++) {
+                        a[j] = sqrt(a[j]);
+                    }
+                    break;
+            }
+        }
+        std::copy(stack[0], stack[0] + n, y + done);
+    }
+}
+
+//Each expression gets compiled over and over for PARSE_BENCHMARK_TIME seconds, and it prints how long one compile
+//took and how many characters a second that is.
+int benchmarkExpressionParsing(int numExpressions, const char *const expressions[]) {
+    if (numExpressions == 0) {
+        numExpressions = NUM_PARSE_BENCHMARK_EXPRESSIONS;
+        expressions = PARSE_BENCHMARK_CORPUS;
+    }
+
+    logToConsole(LOG_INFO) << "expression, compiles, ns/compile, MB/s, compiled to";
+    for (int i = 0; i < numExpressions; i++) {
+        CompiledExpression expression;
+        std::string error;
+        if (!compileExpression(expressions[i], &expression, &error)) {
+            logToConsole(LOG_ERROR) << "Error, \"" << expressions[i] << "\" is not valid: " << error;
+            return 1;
+        }
+        std::ostringstream compiledTo;
+        if (expression.isPolynomial) {
+            compiledTo << "degree " << expression.coefficients.degree << " polynomial";
+        } else {
+            compiledTo << expression.program.size() << " instructions";
+        }
+        freeCompiledExpression(expression);
+
+        long compiles = 0;
+        double elapsed = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (elapsed < PARSE_BENCHMARK_TIME) {
+            for (int j = 0; j < 1000; j++) {
+                compileExpression(expressions[i], &expression, &error);
+                freeCompiledExpression(expression);
+            }
+            compiles += 1000;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        }
+        double nanosecondsPerCompile = elapsed * 1e9 / compiles;
+        logToConsole(LOG_INFO) << "\"" << expressions[i] << "\", " << compiles << ", " << nanosecondsPerCompile
+                               << ", " << strlen(expressions[i]) * compiles / elapsed / 1e6 << ", "
+                               << compiledTo.str();
+    }
+    return 0;
+}
+
+//Creates the driver for one axis. The direction isn't known until the first time it gets set, so the first
+//step always writes the direction pin.
+StepperAxis createStepperAxis(int stepGPIO, int directionGPIO, int minimumLimitGPIO, int maximumLimitGPIO) {
+    StepperAxis stepperAxis;
+    stepperAxis.stepGPIO = stepGPIO;
+    stepperAxis.directionGPIO = directionGPIO;
+    stepperAxis.minimumLimitGPIO = minimumLimitGPIO;
+    stepperAxis.maximumLimitGPIO = maximumLimitGPIO;
+    stepperAxis.directionKnown = false;
+    stepperAxis.direction = CW;
+    stepperAxis.stepLevel = 0;
+    stepperAxis.pulseTime = STEP_PULSE_TIME;
+    stepperAxis.settleTime = DIRECTION_SETTLE_TIME;
+    return stepperAxis;
+}
+
+StepperAxis &stepperAxisFor(AXIS axis) {
+    return (axis == X) ? xAxis : yAxis;
+}
+
+//Sets the direction pin, but only if the direction is actually changing.
+//Returns true if it had to change, which means the caller needs to wait settleTime before stepping.
+bool setStepperAxisDirection(StepperAxis &stepperAxis, Direction direction) {
+    if (stepperAxis.directionKnown && stepperAxis.direction == direction) {
+        return false;
+    }
+    //set directionGPIO to HIGH for CW, and GND for CCW.
+    writeGPIO(stepperAxis.directionGPIO, direction == CW ? 1 : 0);
+    stepperAxis.direction = direction;
+    stepperAxis.directionKnown = true;
+    return true;
+}
+
+//Sets the step pin, but only if it isn't already at that level.
+void setStepperAxisStepLevel(StepperAxis &stepperAxis, int level) {
+    if (stepperAxis.stepLevel == level) {
+        return;
+    }
+    writeGPIO(stepperAxis.stepGPIO, level);
+    stepperAxis.stepLevel = level;
+}
+
+bool stepMotor(AXIS axis, Direction direction) {
+    return stepMotor(axis, direction, STEP_TIME);
+}
+
+//Steps just one motor. It's the same thing as stepMotors with the other axis not moving.
+bool stepMotor(AXIS axis, Direction direction, const int stepTime) {
+    int step = (direction == CW) ? 1 : -1;
+    if (axis == X) {
+        return stepMotors(step, 0, stepTime);
+    }
+    return stepMotors(0, step, stepTime);
+}
+
+//Returns true if the limit switch at the end of the axis that direction is heading towards is pressed.
+//CW heads towards the maximum limit switch and CCW heads towards the minimum one.
+//If the limit switch monitor is running, this is just an atomic read. Otherwise it has to read the GPIO.
+bool limitSwitchPressed(AXIS axis, Direction direction) {
+    if (limitSwitchMonitorRunning.load(std::memory_order_relaxed)) {
+        return limitSwitchStates[limitSwitchIndex(axis, direction)].load(std::memory_order_relaxed);
+    }
+    const StepperAxis &stepperAxis = stepperAxisFor(axis);
+    return readGPIO((direction == CW) ? stepperAxis.maximumLimitGPIO : stepperAxis.minimumLimitGPIO);
+}
+
+//Steps the x and y motors at the same time, so a diagonal step only takes as long as a single step does.
+//Both direction pins get set first (if they changed), then both step pins get pulsed together in the same tick.
+//If either motor that's supposed to move is up against its limit switch, neither one moves and it returns false.
+bool stepMotors(int stepX, int stepY) {
+    return stepMotors(stepX, stepY, STEP_TIME);
+}
+
+//Same as above, but a whole tick takes 2 * stepTime microseconds (plus the direction settle time, if a motor
+//changed direction).
+bool stepMotors(int stepX, int stepY, const int stepTime) {
+    Direction directionX = (stepX > 0) ? CW : CCW;
+    Direction directionY = (stepY > 0) ? CW : CCW;
+
+    if (stepX == 0 && stepY == 0) {
+        return true;
+    }
+
+    //Check to see if the limit switches are yelling at you (going to zero runs into them on purpose every time, so
+    //this only gets printed when it's verbose):
+    if (stepX != 0 && limitSwitchPressed(X, directionX)) {
+        logToConsole(LOG_DEBUG) << "Failed to step motors, X axis " << (directionX == CW ? "maximum" : "minimum")
+                                << " limit switch true.";
+        tripLimitSwitch(limitSwitchIndex(X, directionX));
+        return false;
+    }
+    if (stepY != 0 && limitSwitchPressed(Y, directionY)) {
+        logToConsole(LOG_DEBUG) << "Failed to step motors, Y axis " << (directionY == CW ? "maximum" : "minimum")
+                                << " limit switch true.";
+        tripLimitSwitch(limitSwitchIndex(Y, directionY));
+        return false;
+    }
+
+    //Only write the direction pins (and wait for them to settle) if a motor is actually changing direction.
+    bool directionChanged = false;
+    if (stepX != 0 && setStepperAxisDirection(xAxis, directionX)) {
+        directionChanged = true;
+    }
+    if (stepY != 0 && setStepperAxisDirection(yAxis, directionY)) {
+        directionChanged = true;
+    }
+    if (directionChanged) {
+        stepClockSleep(std::max(xAxis.settleTime, yAxis.settleTime));
+    }
+
+    //pulse both steps on:
+    if (stepX != 0) {
+        setStepperAxisStepLevel(xAxis, 1);
+    }
+    if (stepY != 0) {
+        setStepperAxisStepLevel(yAxis, 1);
+    }
+    //hold them on for the pulse width, so the driver sees the step, but always leave it MIN_STEP_LOW_TIME off before
+    //the next tick:
+    int pulseTime = std::min(std::max(xAxis.pulseTime, yAxis.pulseTime), 2 * stepTime - MIN_STEP_LOW_TIME);
+    stepClockSleep(pulseTime);
+    //pull steps to GND, because they're GND activated, and wait out the rest of the tick:
+    setStepperAxisStepLevel(xAxis, 0);
+    setStepperAxisStepLevel(yAxis, 0);
+    stepClockSleep(2 * stepTime - pulseTime);
+
+    if (recordStepTrace) {
+        StepTick tick;
+        tick.stepX = stepX;
+        tick.stepY = stepY;
+        tick.x = currentX + stepX;
+        tick.y = currentY + stepY;
+        tick.tickTime = 2 * stepTime;
+        stepTrace.push_back(tick);
+    }
+    if (recordingStepStream) {
+        recordStepStreamTick(stepX, stepY, stepTime);
+    }
+    return true;
+}
+
+//Writes out every tick in stepTrace to the log file, one per line: "tick: stepX, stepY -> (x, y)".
+void writeStepTrace() {
+    for (size_t i = 0; i < stepTrace.size(); i++) {
+        logToFile() << i + 1 << ": " << stepTrace[i].stepX << ", " << stepTrace[i].stepY << " -> (" << stepTrace[i].x
+                    << ", " << stepTrace[i].y << ") " << stepTrace[i].tickTime << "us";
+    }
+}
+
+//How far point is from the line segment between segmentStart and segmentEnd (not the whole line, so points that are
+//past either end get measured to that end).
+float distanceFromSegment(Point point, Point segmentStart, Point segmentEnd) {
+    float dx = segmentEnd.x - segmentStart.x;
+    float dy = segmentEnd.y - segmentStart.y;
+    float lengthSquared = dx * dx + dy * dy;
+    float t = 0;
+    if (lengthSquared > 0) {
+        t = ((point.x - segmentStart.x) * dx + (point.y - segmentStart.y) * dy) / lengthSquared;
+        t = std::max(0.0f, std::min(1.0f, t));
+    }
+    float closestX = segmentStart.x + t * dx;
+    float closestY = segmentStart.y + t * dy;
+    return sqrtf((point.x - closestX) * (point.x - closestX) + (point.y - closestY) * (point.y - closestY));
+}
+
+//Ramer-Douglas-Peucker, done separately on every run of points between NaNs so the pen still goes up and down in
+//the same places: keep the first and last point of the run, find the point furthest from the line between them, and
+//if it's more than tolerance steps away, keep it and do the same thing to both sides of it. Everything else goes.
+//It uses a stack instead of recursion so a huge run can't overflow the real stack.
+//Consecutive NaN points get squished into one, since they all just mean "pen up".
+//The new points are returned in a new array, and report says how many points went and how much time that saves.
+ArrayOfPoints simplifyPoints(ArrayOfPoints points, float tolerance, SimplificationReport *report) {
+    std::vector<bool> keep(points.numPoints, false);
+    std::vector<std::pair<int, int> > stack;
+
+    int runStart = -1;
+    for (int i = 0; i <= points.numPoints; i++) {
+        bool valid = (i < points.numPoints) && !std::isnan(points.points[i].y);
+        if (valid && runStart < 0) {
+            runStart = i;
+        } else if (!valid && runStart >= 0) {
+            keep[runStart] = true;
+            keep[i - 1] = true;
+            stack.push_back(std::make_pair(runStart, i - 1));
+            while (!stack.empty()) {
+                int first = stack.back().first;
+                int last = stack.back().second;
+                stack.pop_back();
+
+                float furthestDistance = 0;
+                int furthest = -1;
+                for (int k = first + 1; k < last; k++) {
+                    float distance = distanceFromSegment(points.points[k], points.points[first], points.points[last]);
+                    if (distance > furthestDistance) {
+                        furthestDistance = distance;
+                        furthest = k;
+                    }
+                }
+                if (furthest >= 0 && furthestDistance > tolerance) {
+                    keep[furthest] = true;
+                    stack.push_back(std::make_pair(first, furthest));
+                    stack.push_back(std::make_pair(furthest, last));
+                }
+            }
+            runStart = -1;
+        }
+    }
+
+    ArrayOfPoints simplified;
+    simplified.numPoints = 0;
+    simplified.points = new Point[points.numPoints > 0 ? points.numPoints : 1];
+    int validBefore = 0;
+    int validAfter = 0;
+    for (int i = 0; i < points.numPoints; i++) {
+        if (std::isnan(points.points[i].y)) {
+            if (simplified.numPoints > 0 && !std::isnan(simplified.points[simplified.numPoints - 1].y)) {
+                simplified.points[simplified.numPoints++] = points.points[i];
+            }
+            continue;
+        }
+        validBefore++;
+        if (keep[i]) {
+            simplified.points[simplified.numPoints++] = points.points[i];
+            validAfter++;
+        }
+    }
+
+    report->pointsBefore = points.numPoints;
+    report->pointsAfter = simplified.numPoints;
+    report->pointsRemoved = validBefore - validAfter;
+
+    MotionPlan planBefore = planMotion(points);
+    MotionPlan planAfter = planMotion(simplified);
+    report->timeBefore = estimatePlanTime(planBefore);
+    report->timeAfter = estimatePlanTime(planAfter);
+    delete[] planBefore.moves;
+    delete[] planAfter.moves;
+
+    return simplified;
+}
+
+//Adds up how long every tick of every move will take, going by the speed profiles.
+float estimatePlanTime(MotionPlan plan) {
+    double time = 0;
+    for (int i = 0; i < plan.numMoves; i++) {
+        for (int tick = 0; tick < plan.moves[i].numTicks; tick++) {
+            time += profileTickTime(plan.moves[i], tick);
+        }
+    }
+    return (float) (time / 1000000.0);
+}
+
+//How far it is between two points for the plotter, in steps. Both motors move at the same time, so it's however far
+//the axis that has to move the most has to go.
+float travelDistance(Point from, Point to) {
+    return std::max(fabsf(to.x - from.x), fabsf(to.y - from.y));
+}
+
+//How far the pen travels up if the segments get drawn in this order, starting from start.
+float penUpTravel(ArrayOfPoints points, const std::vector<PathSegment> &segments, Point start) {
+    float travel = 0;
+    Point position = start;
+    for (size_t i = 0; i < segments.size(); i++) {
+        travel += travelDistance(position, points.points[segments[i].first]);
+        position = points.points[segments[i].last];
+    }
+    return travel;
+}
+
+//2-opt: if drawing segments i through j in the opposite order (and each one backwards) makes the pen up travel shorter,
+//do it. Only the two pen up moves at the ends of the flipped part change, since distances are the same both ways.
+//Returns true if it changed anything.
+bool twoOptPass(ArrayOfPoints points, std::vector<PathSegment> &segments, Point start) {
+    bool improved = false;
+    int numSegments = (int) segments.size();
+    for (int i = 0; i < numSegments - 1; i++) {
+        for (int j = i + 1; j < numSegments; j++) {
+            Point previous = (i == 0) ? start : points.points[segments[i - 1].last];
+            Point entry = points.points[segments[i].first];
+            Point exit = points.points[segments[j].last];
+
+            float before = travelDistance(previous, entry);
+            float after = travelDistance(previous, exit);
+            if (j + 1 < numSegments) {
+                Point next = points.points[segments[j + 1].first];
+                before += travelDistance(exit, next);
+                after += travelDistance(entry, next);
+            }
+
+            if (after < before - 0.5f) {
+                std::reverse(segments.begin() + i, segments.begin() + j + 1);
+                for (int k = i; k <= j; k++) {
+                    std::swap(segments[k].first, segments[k].last);
+                }
+                improved = true;
+            }
+        }
+    }
+    return improved;
+}
+
+//Or-opt: take one segment out, and put it back wherever (and whichever way around) it makes the pen up travel the
+//shortest. Returns true if it changed anything.
+bool orOptPass(ArrayOfPoints points, std::vector<PathSegment> &segments, Point start) {
+    bool improved = false;
+    for (int i = 0; i < (int) segments.size(); i++) {
+        PathSegment segment = segments[i];
+        Point previous = (i == 0) ? start : points.points[segments[i - 1].last];
+        Point entry = points.points[segment.first];
+        Point exit = points.points[segment.last];
+
+        //How much travel taking it out saves.
+        float saved = travelDistance(previous, entry);
+        if (i + 1 < (int) segments.size()) {
+            Point next = points.points[segments[i + 1].first];
+            saved += travelDistance(exit, next) - travelDistance(previous, next);
+        }
+
+        std::vector<PathSegment> remaining(segments);
+        remaining.erase(remaining.begin() + i);
+
+        //Try every gap (including the very end) and both directions.
+        float bestCost = saved - 0.5f;
+        int bestPosition = -1;
+        bool bestReversed = false;
+        for (int position = 0; position <= (int) remaining.size(); position++) {
+            Point before = (position == 0) ? start : points.points[remaining[position - 1].last];
+            for (int reversed = 0; reversed < 2; reversed++) {
+                Point newEntry = reversed ? exit : entry;
+                Point newExit = reversed ? entry : exit;
+                float cost = travelDistance(before, newEntry);
+                if (position < (int) remaining.size()) {
+                    Point after = points.points[remaining[position].first];
+                    cost += travelDistance(newExit, after) - travelDistance(before, after);
+                }
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestPosition = position;
+                    bestReversed = reversed;
+                }
+            }
+        }
+
+        if (bestPosition >= 0) {
+            if (bestReversed) {
+                std::swap(segment.first, segment.last);
+            }
+            remaining.insert(remaining.begin() + bestPosition, segment);
+            segments = remaining;
+            improved = true;
+        }
+    }
+    return improved;
+}
+
+//Every run of points between NaNs gets drawn with the pen down, and the pen goes up to get from one to the next.
+//This figures out what order (and which direction) to draw the runs in so the pen up travel is as short as possible:
+//it starts with nearest neighbour (always go to the closest end of a run that isn't drawn yet), and then keeps doing
+//2-opt and Or-opt passes until they stop finding anything better.
+//If one run ends exactly where the next one starts, they get joined so the pen doesn't have to go up at all.
+//Runs that are only one point long don't draw anything, so they get dropped.
+//The new points are returned in a new array (with NaN points between the runs), and report says what changed.
+ArrayOfPoints optimizePenUpTravel(ArrayOfPoints points, Point start, TravelReport *report) {
+    const int MAX_PASSES = 50;
+
+    //Find the runs:
+    std::vector<PathSegment> segments;
+    int runStart = -1;
+    for (int i = 0; i <= points.numPoints; i++) {
+        bool valid = (i < points.numPoints) && !std::isnan(points.points[i].y);
+        if (valid && runStart < 0) {
+            runStart = i;
+        } else if (!valid && runStart >= 0) {
+            if (i - 1 > runStart) {
+                PathSegment segment;
+                segment.first = runStart;
+                segment.last = i - 1;
+                segments.push_back(segment);
+            }
+            runStart = -1;
+        }
+    }
+
+    report->travelBefore = penUpTravel(points, segments, start);
+    report->penLiftsBefore = (int) segments.size();
+
+    //Nearest neighbour:
+    std::vector<PathSegment> ordered;
+    std::vector<bool> used(segments.size(), false);
+    Point position = start;
+    for (size_t n = 0; n < segments.size(); n++) {
+        int best = -1;
+        bool bestReversed = false;
+        float bestDistance = 0;
+        for (size_t i = 0; i < segments.size(); i++) {
+            if (used[i]) {
+                continue;
+            }
+            float forwards = travelDistance(position, points.points[segments[i].first]);
+            float backwards = travelDistance(position, points.points[segments[i].last]);
+            if (best < 0 || forwards < bestDistance) {
+                best = (int) i;
+                bestReversed = false;
+                bestDistance = forwards;
+            }
+            if (backwards < bestDistance) {
+                best = (int) i;
+                bestReversed = true;
+                bestDistance = backwards;
+            }
+        }
+        PathSegment segment = segments[best];
+        if (bestReversed) {
+            std::swap(segment.first, segment.last);
+        }
+        used[best] = true;
+        ordered.push_back(segment);
+        position = points.points[segment.last];
+    }
+
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+        bool improved = twoOptPass(points, ordered, start);
+        if (orOptPass(points, ordered, start)) {
+            improved = true;
+        }
+        if (!improved) {
+            break;
+        }
+    }
+
+    //Build the new points, with a NaN point between runs, unless one run ends right where the next one starts.
+    ArrayOfPoints optimized;
+    optimized.numPoints = 0;
+    optimized.points = new Point[points.numPoints + (int) ordered.size() + 1];
+    report->penLiftsAfter = 0;
+    for (size_t n = 0; n < ordered.size(); n++) {
+        int first = ordered[n].first;
+        int last = ordered[n].last;
+        int direction = (last >= first) ? 1 : -1;
+
+        bool joined = n > 0 && travelDistance(points.points[ordered[n - 1].last], points.points[first]) < 0.5f;
+        if (n > 0 && !joined) {
+            Point gap;
+            gap.x = points.points[ordered[n - 1].last].x;
+            gap.y = NAN;
+            optimized.points[optimized.numPoints++] = gap;
+        }
+        if (!joined) {
+            report->penLiftsAfter++;
+        }
+        for (int i = first; i != last + direction; i += direction) {
+            optimized.points[optimized.numPoints++] = points.points[i];
+        }
+    }
+    report->travelAfter = penUpTravel(points, ordered, start);
+    return optimized;
+}
+
+bool runMove(const PlannedMove &move, bool *penIsDown, float *lengthDrawn) {
+    if (move.penDown && !*penIsDown) {
+        lowerPen();
+        *penIsDown = true;
+    } else if (!move.penDown && *penIsDown) {
+        liftPen();
+        *penIsDown = false;
+    }
+
+    logToConsole(LOG_DEBUG) << "Going to point: (" << move.x << ", " << move.y << ")";
+    float distance = gotoPoint(move);
+    if (move.penDown) {
+        *lengthDrawn += distance;
+    }
+    //gotoPoint only ever stops short of the end of a move when a limit switch stops it.
+    return currentX == move.x && currentY == move.y;
+}
+
+void runPlannerThread(PointSource source, int startX, int startY, StepQueue *queue) {
+    MotionPlanner *planner = new MotionPlanner;
+    startMotionPlanner(*planner, startX, startY, pushMoveToStepQueue, queue);
+    CurveFitter *fitter = new CurveFitter;
+    startCurveFitter(*fitter, planner);
+    Point point;
+    while (!queue->stopped && source.next(source.context, &point)) {
+        addPointToCurveFitter(*fitter, point);
+    }
+    finishCurveFitter(*fitter);
+    finishMotionPlanner(*planner);
+    delete fitter;
+    delete planner;
+
+    StepCommand end;
+    end.endOfJob = true;
+    end.goHome = false;
+    pushStepCommand(*queue, end);
+}
+
+void runStepThread(StepQueue *queue, float *lengthDrawn) {
+    neverWaitToLog = true;
+    if (!simulatingHardware) {
+        makeThisThreadRealTime();
+    }
+    bool penIsDown = false;
+    *lengthDrawn = 0;
+    //Anything that got hit before the job started isn't what stopped it.
+    clearLimitSwitchTrip();
+    while (true) {
+        StepCommand command;
+        popStepCommand(*queue, &command);
+        if (command.endOfJob) {
+            break;
+        }
+        if (queue->stopped) {
+            continue;
+        }
+        //The planner already sent a move to (0, 0), so this only has to go to zero if that move can't be trusted.
+        if (command.goHome) {
+            if (!positionTrusted) {
+                if (penIsDown) {
+                    liftPen();
+                    penIsDown = false;
+                }
+                queue->homingTime += homeIfNeeded();
+                if (!positionTrusted) {
+                    queue->stopped = true;
+                }
+            }
+            continue;
+        }
+        //Where we think we are is wrong now, so every move after this one would be in the wrong place.
+        if (!runMove(command.move, &penIsDown, lengthDrawn)) {
+            AXIS axis;
+            Direction direction;
+            if (getLimitSwitchTrip(&axis, &direction)) {
+                logToConsole(LOG_ERROR) << "The " << (axis == X ? "X" : "Y") << " axis "
+                                        << (direction == CW ? "maximum" : "minimum") << " limit switch stopped the "
+                                        << "plotter at (" << currentX << ", " << currentY
+                                        << "), so the rest of the job didn't get drawn.";
+            } else {
+                logToConsole(LOG_ERROR) << "A limit switch stopped the plotter at (" << currentX << ", " << currentY
+                                        << "), so the rest of the job didn't get drawn.";
+            }
+            if (penIsDown) {
+                liftPen();
+                penIsDown = false;
+            }
+            queue->stopped = true;
+        }
+    }
+    if (penIsDown) {
+        liftPen();
+    }
+}
+
+//This needs root (or CAP_SYS_NICE). If it doesn't work, the steps still happen, just with more jitter.
+bool makeThisThreadRealTime() {
+    struct sched_param parameters;
+    parameters.sched_priority = STEP_THREAD_PRIORITY;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters);
+    if (error != 0) {
+        logToConsole(LOG_WARNING) << "Couldn't make the step thread real time: " << strerror(error);
+        return false;
+    }
+    return true;
+}
+
+bool lockMemory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        logSystemError("mlockall");
+        return false;
+    }
+    return true;
+}
+
+//Starts the step clock over from right now. gotoPoint does this at the start of every move, since the pen moving in
+//between moves isn't part of the step timing.
+void resetStepClock() {
+    hardware.now(&stepDeadline);
+}
+
+//Sleeps until microseconds after the last deadline (not after now), and writes down how late it woke up.
+void stepClockSleep(int microseconds) {
+    stepDeadline.tv_nsec += (long) microseconds * 1000;
+    while (stepDeadline.tv_nsec >= 1000000000L) {
+        stepDeadline.tv_nsec -= 1000000000L;
+        stepDeadline.tv_sec++;
+    }
+
+    hardware.sleepUntil(&stepDeadline);
+
+    struct timespec now;
+    hardware.now(&now);
+    long overrun = (now.tv_sec - stepDeadline.tv_sec) * 1000000000L + (now.tv_nsec - stepDeadline.tv_nsec);
+    if (overrun < 0) {
+        overrun = 0;
+    }
+
+    if (measuringLatencies) {
+        recordLatency(stepSleepOvershoot, overrun);
+    }
+    stepTimingStatistics.numDeadlines++;
+    stepTimingStatistics.totalOverrun += overrun;
+    if (overrun > stepTimingStatistics.worstOverrun) {
+        stepTimingStatistics.worstOverrun = overrun;
+    }
+    if (overrun > STEP_LATE_THRESHOLD) {
+        stepTimingStatistics.numLate++;
+    }
+    if (overrun > STEP_RESYNC_THRESHOLD) {
+        stepTimingStatistics.numResyncs++;
+        stepDeadline = now;
+    }
+}
+
+void logStepTimingStatistics() {
+    double averageOverrun = 0;
+    if (stepTimingStatistics.numDeadlines > 0) {
+        averageOverrun = stepTimingStatistics.totalOverrun / stepTimingStatistics.numDeadlines;
+    }
+    logToFile() << "Step deadlines: " << stepTimingStatistics.numDeadlines;
+    logToFile() << "Late step deadlines (over " << STEP_LATE_THRESHOLD / 1000 << "us): "
+                << stepTimingStatistics.numLate;
+    logToFile() << "Step clock restarts: " << stepTimingStatistics.numResyncs;
+    logToFile() << "Average step overrun: " << averageOverrun / 1000.0 << "us";
+    logToFile() << "Worst step overrun: " << stepTimingStatistics.worstOverrun / 1000.0 << "us";
+    logLatencyReport();
+}
+
+//Always real time (even when the hardware is simulated), since it's timing how long our own code takes.
+//CLOCK_MONOTONIC is the closest thing to a cycle counter that every board we run on has.
+long latencyNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void recordLatency(LatencyHistogram &histogram, long nanoseconds) {
+    histogram.buckets[latencyBucketFor(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    long worst = histogram.worst.load(std::memory_order_relaxed);
+    while (nanoseconds > worst &&
+           !histogram.worst.compare_exchange_weak(worst, nanoseconds, std::memory_order_relaxed));
+}
+
+//Under LATENCY_EXACT_BUCKETS it's just the time. Past that, the highest set bit picks the power of two, and the next
+//LATENCY_SUB_BUCKET_BITS bits under it pick which bucket in that power of two.
+int latencyBucketFor(long nanoseconds) {
+    if (nanoseconds < LATENCY_EXACT_BUCKETS) {
+        return (nanoseconds < 0) ? 0 : (int) nanoseconds;
+    }
+    int exponent = (int) (sizeof(unsigned long) * 8) - 1 - __builtin_clzl((unsigned long) nanoseconds);
+    if (exponent > LATENCY_MAX_EXPONENT) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int subBucket = (int) (nanoseconds >> (exponent - LATENCY_SUB_BUCKET_BITS)) - LATENCY_SUB_BUCKETS;
+    return LATENCY_EXACT_BUCKETS + (exponent - 5) * LATENCY_SUB_BUCKETS + subBucket;
+}
+
+//The shortest time that goes in the bucket.
+long latencyBucketStart(int bucket) {
+    if (bucket < LATENCY_EXACT_BUCKETS) {
+        return bucket;
+    }
+    int exponent = 5 + (bucket - LATENCY_EXACT_BUCKETS) / LATENCY_SUB_BUCKETS;
+    long subBucket = (bucket - LATENCY_EXACT_BUCKETS) % LATENCY_SUB_BUCKETS;
+    return (LATENCY_SUB_BUCKETS + subBucket) << (exponent - LATENCY_SUB_BUCKET_BITS);
+}
+
+//The time that percentile of everything was at or under, rounded up to the end of its bucket (but never past the
+//worst time we actually saw).
+long latencyPercentile(const LatencyHistogram &histogram, double percentile) {
+    unsigned long count = histogram.count.load(std::memory_order_relaxed);
+    unsigned long wanted = (unsigned long) ceil(count * percentile / 100.0);
+    if (wanted == 0) {
+        wanted = 1;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen >= wanted) {
+            long end = (i + 1 < LATENCY_BUCKETS) ? latencyBucketStart(i + 1) - 1 : latencyBucketStart(i);
+            return std::min(end, histogram.worst.load(std::memory_order_relaxed));
+        }
+    }
+    return histogram.worst.load(std::memory_order_relaxed);
+}
+
+//One summary line, and then every bucket that has anything in it, with how much of the total is at or under it.
+void logLatencyHistogram(const char name[], const LatencyHistogram &histogram) {
+    unsigned long count = histogram.count.load(std::memory_order_relaxed);
+    if (count == 0) {
+        logToFile() << name << ": nothing measured";
+        return;
+    }
+    logToFile() << name << " (" << count << " times): p50 " << latencyPercentile(histogram, 50) / 1000.0
+                << "us, p90 " << latencyPercentile(histogram, 90) / 1000.0 << "us, p99 "
+                << latencyPercentile(histogram, 99) / 1000.0 << "us, p99.9 "
+                << latencyPercentile(histogram, 99.9) / 1000.0 << "us, max "
+                << histogram.worst.load(std::memory_order_relaxed) / 1000.0 << "us";
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        unsigned long inBucket = histogram.buckets[i].load(std::memory_order_relaxed);
+        if (inBucket == 0) {
+            continue;
+        }
+        seen += inBucket;
+        logToFile() << "    " << latencyBucketStart(i) / 1000.0 << "us+: " << inBucket << " ("
+                    << 100.0 * seen / count << "%)";
+    }
+}
+
+//Also works out how much of a STEP_TIME half tick the work in a step takes at p99.9 (two GPIO writes, a limit
+//switch read and the sleep overshoot), which is how close STEP_TIME can get to the hardware before steps start
+//running late.
+void logLatencyReport() {
+    logToFile() << "Step latency report:";
+    logLatencyHistogram("GPIO write", gpioWriteLatency);
+    logLatencyHistogram("GPIO read", gpioReadLatency);
+    logLatencyHistogram("Step sleep overshoot", stepSleepOvershoot);
+    logLatencyHistogram("Pen PWM set", penPWMLatency);
+    long stepWork = 2 * latencyPercentile(gpioWriteLatency, 99.9) + latencyPercentile(gpioReadLatency, 99.9) +
+                    latencyPercentile(stepSleepOvershoot, 99.9);
+    logToFile() << "Step work at p99.9: " << stepWork / 1000.0 << "us, " << 100.0 * stepWork / (STEP_TIME * 1000.0)
+                << "% of STEP_TIME (" << STEP_TIME << "us)";
+}
+
+StatisticalData drawPolynomial(ArrayOfPoints points, bool homeFirst) {
+
+    StatisticalData statisticalData;
+    statisticalData.lengthOfFunction = 0;
+    statisticalData.penUpTravelBefore = 0;
+    statisticalData.penUpTravelAfter = 0;
+    statisticalData.penLifts = 0;
+    statisticalData.homingTime = 0;
+
+    //Time it on the hardware's clock, so a simulated run says how long the real plotter would take.
+    double startTime = hardwareSeconds();
+
+    //First of all, lift the pen, and go to zero (if we don't already know where we are)!
+    if (homeFirst) {
+        liftPen();
+        statisticalData.homingTime = homeIfNeeded();
+        if (!positionTrusted) {
+            statisticalData.lengthOfTime = (float) (hardwareSeconds() - startTime);
+            return statisticalData;
+        }
+    }
+    //Print everything out human readable:
+    for (int i = 0; i < points.numPoints; i++) {
+        logToConsole(LOG_DEBUG) << "Point " << i + 1 << ": (" << points.points[i].x << ", " << points.points[i].y
+                                << ")";
+    }
+    logToConsole(LOG_DEBUG) << "";
+
+    //Draw the pieces in whatever order has the least pen up travel.
+    Point start;
+    start.x = (float) currentX;
+    start.y = (float) currentY;
+    TravelReport travelReport;
+    ArrayOfPoints optimizedPoints = optimizePenUpTravel(points, start, &travelReport);
+    statisticalData.penUpTravelBefore = travelReport.travelBefore;
+    statisticalData.penUpTravelAfter = travelReport.travelAfter;
+    statisticalData.penLifts = travelReport.penLiftsAfter;
+    logToConsole(LOG_INFO) << "Pen up travel: " << travelReport.travelBefore << " steps in order, "
+                           << travelReport.travelAfter << " steps optimized (" << travelReport.penLiftsBefore
+                           << " pen lifts before, " << travelReport.penLiftsAfter << " after).";
+
+    ArrayPointCursor cursor;
+    cursor.points = optimizedPoints;
+    cursor.next = 0;
+    PointSource source;
+    source.next = nextArrayPoint;
+    source.context = &cursor;
+    statisticalData.lengthOfFunction += drawPointSource(source);
+    delete[] optimizedPoints.points;
+
+    statisticalData.lengthOfTime = (float) (hardwareSeconds() - startTime);
+
+    return statisticalData;
+}
+
+StatisticalData drawUniformPolynomial(const CompiledExpression &expression, float xMin, float xMax, float yMin,
+                                      float yMax, long numPoints, bool homeFirst) {
+    StatisticalData statisticalData;
+    statisticalData.lengthOfFunction = 0;
+    statisticalData.penUpTravelBefore = 0;
+    statisticalData.penUpTravelAfter = 0;
+    statisticalData.penLifts = 0;
+    statisticalData.homingTime = 0;
+    statisticalData.lengthOfTime = 0;
+
+    UniformPointStream *stream = new UniformPointStream;
+    if (!startUniformPointStream(*stream, expression, xMax, yMin, yMax, xMin, numPoints)) {
+        delete stream;
+        return statisticalData;
+    }
+
+    double startTime = hardwareSeconds();
+    if (homeFirst) {
+        liftPen();
+        statisticalData.homingTime = homeIfNeeded();
+        if (!positionTrusted) {
+            delete stream;
+            statisticalData.lengthOfTime = (float) (hardwareSeconds() - startTime);
+            return statisticalData;
+        }
+    }
+
+    PointSource source;
+    source.next = nextUniformPoint;
+    source.context = stream;
+    statisticalData.lengthOfFunction = drawPointSource(source);
+    statisticalData.penLifts = stream->numPieces;
+    delete stream;
+
+    statisticalData.lengthOfTime = (float) (hardwareSeconds() - startTime);
+    return statisticalData;
+}
+
+float drawPointSource(PointSource source) {
+    //The planner thread plans moves and puts them in the queue, while the step thread takes them out and does them,
+    //so the motors start as soon as the first few moves are planned.
+    StepQueue *queue = new StepQueue;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->stopped = false;
+    queue->homingTime = 0;
+    float lengthDrawn = 0;
+    std::thread plannerThread(runPlannerThread, source, currentX, currentY, queue);
+    std::thread stepThread(runStepThread, queue, &lengthDrawn);
+    plannerThread.join();
+    stepThread.join();
+    delete queue;
+    return lengthDrawn;
+}
+
+void requestGPIOAndSetDirectionOutput(int gpio) {
+    int gpioRequest;
+    int gpioDirection;
+
+    // check if gpio is already requested
+    if ((gpioRequest = hardware.isRequested(gpio)) < 0) {
+        logSystemError("gpio_is_requested");
+        throw std::exception();
+    }
+
+    // request the gpio
+    if (!gpioRequest) {
+        logToConsole(LOG_DEBUG) << "> exporting gpio";
+        if ((gpioDirection = hardware.request(gpio)) < 0) {
+            logSystemError("gpio_request");
+            throw std::exception();
+        }
+    }
+
+    // set to output direction:
+    logToConsole(LOG_DEBUG) << "> setting to output";
+    if ((gpioDirection = hardware.directionOutput(gpio, 0)) < 0) {
+        logSystemError("gpio_direction_output");
+    }
+}
+
+void requestGPIOAndSetDirectionInput(int gpio) {
+    int gpioRequest;
+    int gpioDirection;
+
+    // check if gpio is already requested
+    if ((gpioRequest = hardware.isRequested(gpio)) < 0) {
+        logSystemError("gpio_is_requested");
+        throw std::exception();
+    }
+
+    // request the gpio
+    if (!gpioRequest) {
+        logToConsole(LOG_DEBUG) << "> exporting gpio";
+        if ((gpioDirection = hardware.request(gpio)) < 0) {
+            logSystemError("gpio_request");
+            throw std::exception();
+        }
+    }
+
+    // set to output direction:
+    logToConsole(LOG_DEBUG) << "> setting to input";
+    if ((gpioDirection = hardware.directionInput(gpio)) < 0) {
+        logSystemError("gpio_direction_input");
+    }
+}
+
+void freeGPIO(int gpio) {
+    if (hardware.free(gpio) < 0) {
+        logSystemError("freeGPIO");
+    }
+}
+
+//Goes to the point (x, y) in a straight line at START_SPEED, without any speeding up or slowing down.
+//Returns the distance it took to go to the point specified.
+float gotoPoint(int x, int y) {
+    PlannedMove move;
+    move.x = x;
+    move.y = y;
+    move.penDown = false;
+    move.numTicks = std::max(abs(x - currentX), abs(y - currentY));
+    move.entrySpeed = START_SPEED;
+    move.cruiseSpeed = START_SPEED;
+    move.exitSpeed = START_SPEED;
+    move.curve.shape = CURVE_LINE;
+    return gotoPoint(move);
+}
+
+//Goes to the end of the move in a straight line, using Bresenham's line algorithm.
+//Everything is done with integers, so there's no slope to recalculate after every step, and it works for every
+//direction the line could go in (steep lines, lines going backwards, etc).
+//Every time through the loop the x motor steps, the y motor steps, or both do. Both motors step in the same tick
+//with stepMotors, so it only takes max(|dx|, |dy|) ticks to get there, while still sending the least number of
+//steps possible (|dx| + |dy|). How long each tick takes comes from the move's speed profile.
+//If a limit switch stops the motors, it stops there and returns the distance it actually went.
+float gotoPoint(const PlannedMove &move) {
+    if (move.curve.shape != CURVE_LINE) {
+        return traceCurve(move);
+    }
+    int oldX = currentX;
+    int oldY = currentY;
+    int x = move.x;
+    int y = move.y;
+
+    //How far we have to go on each axis, and which way:
+    int deltaX = abs(x - currentX);
+    int deltaY = abs(y - currentY);
+    int changeofX = (x >= currentX) ? 1 : -1;
+    int changeofY = (y >= currentY) ? 1 : -1;
+
+    //The error is how far off the real line we are, times the length of the line (which is what the cross product of
+    //where we've got to and the line's direction works out to, so it stays an integer), plus deltaX - deltaY so that
+    //comparing 2 * error against deltaX and -deltaY picks whichever step stays closest to the line.
+    int error = deltaX - deltaY;
+
+    resetStepClock();
+    int tick = 0;
+    while (currentX != x || currentY != y) {
+        int doubleError = 2 * error;
+        int stepX = (doubleError > -deltaY) ? changeofX : 0;
+        int stepY = (doubleError < deltaX) ? changeofY : 0;
+
+        if (!stepMotors(stepX, stepY, profileTickTime(move, tick) / 2)) {
+            //Nothing we planned should ever run into a limit switch, so where we think we are must be wrong.
+            positionTrusted = false;
+            break;
+        }
+        if (stepX != 0) {
+            error -= deltaY;
+            currentX += stepX;
+        }
+        if (stepY != 0) {
+            error += deltaX;
+            currentY += stepY;
+        }
+        tick++;
+    }
+
+    //Calculate distance using pythagorean theorem:
+    float dx = (float) (currentX - oldX);
+    float dy = (float) (currentY - oldY);
+    return (float) sqrt(dx * dx + dy * dy);
+}
+
+//How long (in microseconds) tick number "tick" of the move should take.
+//This is a trapezoid: speed up from entrySpeed at ACCELERATION, cruise at cruiseSpeed, then slow down to exitSpeed,
+//so the speed at any tick is the smallest of those three limits. A curve also can't go faster than its bends let it
+//right there. The middle of the tick is used for the speed.
+int profileTickTime(const PlannedMove &move, int tick) {
+    float position = (float) tick + 0.5f;
+    float remaining = (float) move.numTicks - position;
+    if (remaining < 0) {
+        remaining = 0;
+    }
+
+    float speed = move.cruiseSpeed;
+    float accelerating = sqrtf(move.entrySpeed * move.entrySpeed + 2 * ACCELERATION * position);
+    float decelerating = sqrtf(move.exitSpeed * move.exitSpeed + 2 * ACCELERATION * remaining);
+    if (accelerating < speed) {
+        speed = accelerating;
+    }
+    if (decelerating < speed) {
+        speed = decelerating;
+    }
+    if (move.curve.shape != CURVE_LINE) {
+        speed = std::min(speed, curveSpeedLimit(move, position));
+    }
+    if (speed < START_SPEED) {
+        speed = START_SPEED;
+    }
+    if (speed > MAX_STEP_SPEED) {
+        speed = MAX_STEP_SPEED;
+    }
+    return (int) (1000000.0f / speed);
+}
+
+//How fast the pen can go around the corner from previous into next, in ticks per second.
+//(previousX, previousY) is where the previous move started.
+//This uses the junction deviation idea: pretend the corner is a little circle that is JUNCTION_DEVIATION steps away
+//from the real corner, and go as fast as you can around that circle without going over ACCELERATION.
+//Straight lines get CRUISE_SPEED, and going back the way you came gets START_SPEED. For curves, it's the way they're
+//heading right at the corner that counts.
+float junctionSpeed(const PlannedMove &previous, const PlannedMove &next, int previousX, int previousY) {
+    float previousDX;
+    float previousDY;
+    float nextDX;
+    float nextDY;
+    moveDirection(previous, previousX, previousY, true, &previousDX, &previousDY);
+    moveDirection(next, previous.x, previous.y, false, &nextDX, &nextDY);
+    return cornerSpeed(previousDX, previousDY, nextDX, nextDY);
+}
+
+float cornerSpeed(float previousDX, float previousDY, float nextDX, float nextDY) {
+    float previousLength = sqrtf(previousDX * previousDX + previousDY * previousDY);
+    float nextLength = sqrtf(nextDX * nextDX + nextDY * nextDY);
+    if (previousLength == 0 || nextLength == 0) {
+        return START_SPEED;
+    }
+
+    //The cosine of the angle between going backwards along the previous move and going forwards along the next one.
+    float cosTheta = -(previousDX * nextDX + previousDY * nextDY) / (previousLength * nextLength);
+    if (cosTheta > 0.999f) {
+        return START_SPEED;
+    }
+    if (cosTheta < -0.999f) {
+        return CRUISE_SPEED;
+    }
+
+    float sinHalfTheta = sqrtf(0.5f * (1.0f - cosTheta));
+    float speed = sqrtf(ACCELERATION * JUNCTION_DEVIATION * sinHalfTheta / (1.0f - sinHalfTheta));
+    if (speed < START_SPEED) {
+        speed = START_SPEED;
+    }
+    if (speed > CRUISE_SPEED) {
+        speed = CRUISE_SPEED;
+    }
+    return speed;
+}
+
+//Gets the motion planner ready to plan moves starting from (startX, startY).
+void startMotionPlanner(MotionPlanner &planner, int startX, int startY,
+                        void (*output)(const PlannedMove &move, void *context), void *context) {
+    planner.numMoves = 0;
+    planner.firstEntrySpeed = START_SPEED;
+    planner.haveLastMove = false;
+    planner.lastMoveStartX = startX;
+    planner.lastMoveStartY = startY;
+    planner.lastX = startX;
+    planner.lastY = startY;
+    planner.inRun = false;
+    planner.output = output;
+    planner.context = context;
+}
+
+//Every run of points between NaNs becomes a pen up move to the start of the run, and then pen down moves through the
+//rest of it. Points that round to the same step as the last one don't make a move.
+void addPointToMotionPlanner(MotionPlanner &planner, Point point) {
+    if (std::isnan(point.y)) {
+        planner.inRun = false;
+        return;
+    }
+    int x = (int) lroundf(point.x);
+    int y = (int) lroundf(point.y);
+    if (x == planner.lastX && y == planner.lastY) {
+        planner.inRun = true;
+        return;
+    }
+
+    PlannedMove move;
+    move.x = x;
+    move.y = y;
+    move.penDown = planner.inRun;
+    move.numTicks = std::max(abs(x - planner.lastX), abs(y - planner.lastY));
+    move.cruiseSpeed = CRUISE_SPEED;
+    move.entrySpeed = START_SPEED;
+    move.exitSpeed = START_SPEED;
+    move.curve.shape = CURVE_LINE;
+    addMoveToMotionPlanner(planner, move);
+}
+
+void addCurveToMotionPlanner(MotionPlanner &planner, const CurvePrimitive &curve, Point end) {
+    int x = (int) lroundf(end.x);
+    int y = (int) lroundf(end.y);
+    if (x == planner.lastX && y == planner.lastY) {
+        return;
+    }
+
+    PlannedMove move;
+    move.x = x;
+    move.y = y;
+    move.penDown = true;
+    move.curve = curve;
+    move.entrySpeed = START_SPEED;
+    move.exitSpeed = START_SPEED;
+    CurveTracer tracer;
+    startCurveTracer(tracer, move.curve, planner.lastX, planner.lastY, x, y);
+    move.numTicks = 0;
+    int stepX;
+    int stepY;
+    while (nextCurveStep(tracer, &stepX, &stepY)) {
+        move.numTicks++;
+    }
+    setCurveSpeedLimits(move);
+    addMoveToMotionPlanner(planner, move);
+}
+
+//Puts the move at the end of the ones being looked at (sending the oldest one on if there's no room), and works out
+//all their speeds again.
+void addMoveToMotionPlanner(MotionPlanner &planner, const PlannedMove &move) {
+    //The pen has to be stopped whenever it goes up or down, but between two pen down moves it only has to slow down
+    //as much as the corner needs (and no faster than either move can go there, since curves can be slower).
+    float maxEntrySpeed = START_SPEED;
+    if (move.penDown && planner.haveLastMove && planner.lastMove.penDown) {
+        maxEntrySpeed = junctionSpeed(planner.lastMove, move, planner.lastMoveStartX, planner.lastMoveStartY);
+        maxEntrySpeed = std::min(maxEntrySpeed, std::min(moveEndSpeed(planner.lastMove, true),
+                                                         moveEndSpeed(move, false)));
+    }
+
+    if (planner.numMoves == PLANNER_LOOKAHEAD) {
+        sendFirstPlannedMove(planner);
+    }
+    planner.moves[planner.numMoves] = move;
+    planner.maxEntrySpeeds[planner.numMoves] = maxEntrySpeed;
+    planner.numMoves++;
+    recalculateMotionPlannerSpeeds(planner);
+
+    planner.lastMove = move;
+    planner.lastMoveStartX = planner.lastX;
+    planner.lastMoveStartY = planner.lastY;
+    planner.haveLastMove = true;
+    planner.lastX = move.x;
+    planner.lastY = move.y;
+    planner.inRun = true;
+}
+
+//Works out the speeds of all the moves that are still being looked at.
+//It does a backwards pass so that every move can slow down in time for the next one (and the last one can stop, since
+//we don't know what comes after it yet), and then a forwards pass so that every move only goes as fast as it could
+//speed up to.
+void recalculateMotionPlannerSpeeds(MotionPlanner &planner) {
+    PlannedMove *moves = planner.moves;
+    int numMoves = planner.numMoves;
+
+    //Backwards pass:
+    float exitSpeed = START_SPEED;
+    for (int i = numMoves - 1; i >= 0; i--) {
+        PlannedMove &move = moves[i];
+        move.exitSpeed = exitSpeed;
+        if (i == 0) {
+            move.entrySpeed = planner.firstEntrySpeed;
+        } else {
+            float reachable = sqrtf(exitSpeed * exitSpeed + 2 * ACCELERATION * move.numTicks);
+            move.entrySpeed = std::min(planner.maxEntrySpeeds[i], reachable);
+        }
+        //Only carry speed over into the previous move if there's no pen change in between.
+        exitSpeed = (i > 0 && move.penDown && moves[i - 1].penDown) ? move.entrySpeed : START_SPEED;
+    }
+
+    //Forwards pass:
+    for (int i = 0; i < numMoves; i++) {
+        PlannedMove &move = moves[i];
+        float reachable = sqrtf(move.entrySpeed * move.entrySpeed + 2 * ACCELERATION * move.numTicks);
+        if (move.exitSpeed > reachable) {
+            move.exitSpeed = reachable;
+            if (i + 1 < numMoves && moves[i + 1].penDown && move.penDown) {
+                moves[i + 1].entrySpeed = reachable;
+            }
+        }
+    }
+}
+
+//Sends the oldest move to output. Whatever it ends at is what the next move has to start at.
+void sendFirstPlannedMove(MotionPlanner &planner) {
+    PlannedMove move = planner.moves[0];
+    bool carriesSpeed = planner.numMoves > 1 && move.penDown && planner.moves[1].penDown;
+    planner.firstEntrySpeed = carriesSpeed ? move.exitSpeed : START_SPEED;
+
+    for (int i = 1; i < planner.numMoves; i++) {
+        planner.moves[i - 1] = planner.moves[i];
+        planner.maxEntrySpeeds[i - 1] = planner.maxEntrySpeeds[i];
+    }
+    planner.numMoves--;
+
+    planner.output(move, planner.context);
+}
+
+//Sends out all the moves that are left. The last one stops.
+void finishMotionPlanner(MotionPlanner &planner) {
+    while (planner.numMoves > 0) {
+        sendFirstPlannedMove(planner);
+    }
+    planner.firstEntrySpeed = START_SPEED;
+}
+
+void addMoveToMotionPlan(const PlannedMove &move, void *context) {
+    MotionPlan *plan = (MotionPlan *) context;
+    plan->moves[plan->numMoves] = move;
+    plan->numMoves++;
+}
+
+//Turns the points into moves the plotter can do, starting from where the plotter is right now, all at once.
+//There's never more than one move per point (a curve always takes the place of at least two).
+MotionPlan planMotion(ArrayOfPoints points) {
+    MotionPlan plan;
+    plan.moves = new PlannedMove[points.numPoints > 0 ? points.numPoints : 1];
+    plan.numMoves = 0;
+
+    MotionPlanner *planner = new MotionPlanner;
+    startMotionPlanner(*planner, currentX, currentY, addMoveToMotionPlan, &plan);
+    CurveFitter *fitter = new CurveFitter;
+    startCurveFitter(*fitter, planner);
+    for (int i = 0; i < points.numPoints; i++) {
+        addPointToCurveFitter(*fitter, points.points[i]);
+    }
+    finishCurveFitter(*fitter);
+    finishMotionPlanner(*planner);
+    delete fitter;
+    delete planner;
+    return plan;
+}
+
+void evaluateCurve(const CurvePrimitive &curve, double t, int order, double *x, double *y) {
+    const double *px = curve.x;
+    const double *py = curve.y;
+    if (curve.shape == CURVE_ARC) {
+        double angle = curve.startAngle + curve.sweep * t;
+        //Every derivative just turns it another quarter turn and scales it by the sweep.
+        double scale = curve.radius * pow(curve.sweep, order);
+        double cosine = cos(angle + order * M_PI_2);
+        double sine = sin(angle + order * M_PI_2);
+        *x = (order == 0 ? px[0] : 0) + scale * cosine;
+        *y = (order == 0 ? py[0] : 0) + scale * sine;
+        return;
+    }
+    double u = 1 - t;
+    if (curve.shape == CURVE_QUADRATIC) {
+        if (order == 0) {
+            *x = u * u * px[0] + 2 * u * t * px[1] + t * t * px[2];
+            *y = u * u * py[0] + 2 * u * t * py[1] + t * t * py[2];
+        } else if (order == 1) {
+            *x = 2 * u * (px[1] - px[0]) + 2 * t * (px[2] - px[1]);
+            *y = 2 * u * (py[1] - py[0]) + 2 * t * (py[2] - py[1]);
+        } else {
+            *x = 2 * (px[2] - 2 * px[1] + px[0]);
+            *y = 2 * (py[2] - 2 * py[1] + py[0]);
+        }
+        return;
+    }
+    if (order == 0) {
+        *x = u * u * u * px[0] + 3 * u * u * t * px[1] + 3 * u * t * t * px[2] + t * t * t * px[3];
+        *y = u * u * u * py[0] + 3 * u * u * t * py[1] + 3 * u * t * t * py[2] + t * t * t * py[3];
+    } else if (order == 1) {
+        *x = 3 * u * u * (px[1] - px[0]) + 6 * u * t * (px[2] - px[1]) + 3 * t * t * (px[3] - px[2]);
+        *y = 3 * u * u * (py[1] - py[0]) + 6 * u * t * (py[2] - py[1]) + 3 * t * t * (py[3] - py[2]);
+    } else {
+        *x = 6 * u * (px[2] - 2 * px[1] + px[0]) + 6 * t * (px[3] - 2 * px[2] + px[1]);
+        *y = 6 * u * (py[2] - 2 * py[1] + py[0]) + 6 * t * (py[3] - 2 * py[2] + py[1]);
+    }
+}
+
+//The bends are checked at CURVE_SPEED_SAMPLES + 1 places, spread out evenly in t, which is plenty for curves this
+//simple. How far along each place is in ticks comes from adding up max(|dx|, |dy|), since that's how many ticks it
+//takes to go along a bit of the curve.
+void setCurveSpeedLimits(PlannedMove &move) {
+    float *speeds = move.bendSpeeds;
+    float *ticks = move.bendTicks;
+    double previousRate = 0;
+    double length = 0;
+    for (int i = 0; i <= CURVE_SPEED_SAMPLES; i++) {
+        double t = (double) i / CURVE_SPEED_SAMPLES;
+        double dx;
+        double dy;
+        evaluateCurve(move.curve, t, 1, &dx, &dy);
+        double rate = std::max(fabs(dx), fabs(dy));
+        if (i > 0) {
+            length += 0.5 * (previousRate + rate) / CURVE_SPEED_SAMPLES;
+        }
+        previousRate = rate;
+        ticks[i] = (float) length;
+
+        double curvature = curveCurvature(move.curve, t);
+        speeds[i] = curvature > 0 ? bendSpeed(1 / curvature) : CRUISE_SPEED;
+    }
+    for (int i = 0; i <= CURVE_SPEED_SAMPLES; i++) {
+        ticks[i] = length > 0 ? (float) (ticks[i] / length * move.numTicks) : 0;
+    }
+
+    evenOutSpeeds(speeds, ticks, CURVE_SPEED_SAMPLES + 1);
+    move.cruiseSpeed = *std::max_element(speeds, speeds + CURVE_SPEED_SAMPLES + 1);
+}
+
+//Backwards and then forwards, like recalculateMotionPlannerSpeeds does for whole moves.
+void evenOutSpeeds(float *speeds, const float *ticks, int numPlaces) {
+    for (int i = numPlaces - 2; i >= 0; i--) {
+        float reachable = sqrtf(speeds[i + 1] * speeds[i + 1] + 2 * ACCELERATION * (ticks[i + 1] - ticks[i]));
+        speeds[i] = std::min(speeds[i], reachable);
+    }
+    for (int i = 1; i < numPlaces; i++) {
+        float reachable = sqrtf(speeds[i - 1] * speeds[i - 1] + 2 * ACCELERATION * (ticks[i] - ticks[i - 1]));
+        speeds[i] = std::min(speeds[i], reachable);
+    }
+}
+
+//Between two places, lines speed up as much as they can and slow back down again (the trapezoid profileTickTime
+//does), but a curve's bends hold it back the whole way, so it just goes at the average of the speeds at either end.
+float runTime(float *speeds, const float *ticks, int numPlaces, bool speedUpBetween) {
+    evenOutSpeeds(speeds, ticks, numPlaces);
+    float time = 0;
+    for (int i = 0; i + 1 < numPlaces; i++) {
+        float entry = speeds[i];
+        float exit = speeds[i + 1];
+        float length = ticks[i + 1] - ticks[i];
+        if (!speedUpBetween) {
+            time += 2 * length / (entry + exit);
+            continue;
+        }
+        float peak = sqrtf(0.5f * (entry * entry + exit * exit) + ACCELERATION * length);
+        if (peak <= CRUISE_SPEED) {
+            time += (2 * peak - entry - exit) / ACCELERATION;
+        } else {
+            float rampLength = (2 * CRUISE_SPEED * CRUISE_SPEED - entry * entry - exit * exit) / (2 * ACCELERATION);
+            time += (2 * CRUISE_SPEED - entry - exit) / ACCELERATION + (length - rampLength) / CRUISE_SPEED;
+        }
+    }
+    return time;
+}
+
+double curveCurvature(const CurvePrimitive &curve, double t) {
+    if (curve.shape == CURVE_ARC) {
+        return 1 / curve.radius;
+    }
+    double dx;
+    double dy;
+    double ddx;
+    double ddy;
+    evaluateCurve(curve, t, 1, &dx, &dy);
+    evaluateCurve(curve, t, 2, &ddx, &ddy);
+    double speed = sqrt(dx * dx + dy * dy);
+    if (speed == 0) {
+        return 0;
+    }
+    return fabs(dx * ddy - dy * ddx) / (speed * speed * speed);
+}
+
+float curveSpeedLimit(const PlannedMove &move, float position) {
+    const float *speeds = move.bendSpeeds;
+    const float *ticks = move.bendTicks;
+    int i = 0;
+    while (i < CURVE_SPEED_SAMPLES - 1 && position > ticks[i + 1]) {
+        i++;
+    }
+    float gap = ticks[i + 1] - ticks[i];
+    float along = gap > 0 ? (position - ticks[i]) / gap : 0;
+    along = std::min(std::max(along, 0.0f), 1.0f);
+    return sqrtf(speeds[i] * speeds[i] + along * (speeds[i + 1] * speeds[i + 1] - speeds[i] * speeds[i]));
+}
+
+float moveEndSpeed(const PlannedMove &move, bool atEnd) {
+    if (move.curve.shape == CURVE_LINE) {
+        return move.cruiseSpeed;
+    }
+    return move.bendSpeeds[atEnd ? CURVE_SPEED_SAMPLES : 0];
+}
+
+//This is the same allowance junctionSpeed gives lines, so a bend goes the same speed whether it's a curve or not.
+//Drawn as lines, the bend would be chords that are SAMPLING_TOLERANCE off it in the middle. Each corner between
+//them turns by 2 * acos(1 - h / r), so sin(theta / 2) in junctionSpeed is 1 - h / r, and
+//ACCELERATION * JUNCTION_DEVIATION * sin(theta / 2) / (1 - sin(theta / 2)) works out to the v^2 below.
+float bendSpeed(double radius) {
+    double h = SAMPLING_TOLERANCE;
+    if (radius <= h) {
+        return START_SPEED;
+    }
+    double speed = sqrt(ACCELERATION * JUNCTION_DEVIATION * (radius - h) / h);
+    return (float) std::min(std::max(speed, (double) START_SPEED), (double) CRUISE_SPEED);
+}
+
+void moveDirection(const PlannedMove &move, int startX, int startY, bool atEnd, float *dx, float *dy) {
+    if (move.curve.shape == CURVE_LINE) {
+        *dx = (float) (move.x - startX);
+        *dy = (float) (move.y - startY);
+        return;
+    }
+    double x;
+    double y;
+    evaluateCurve(move.curve, atEnd ? 1 : 0, 1, &x, &y);
+    *dx = (float) x;
+    *dy = (float) y;
+}
+
+void startCurveTracer(CurveTracer &tracer, const CurvePrimitive &curve, int startX, int startY, int endX, int endY) {
+    tracer.curve = &curve;
+    tracer.t = 0;
+    tracer.x = startX;
+    tracer.y = startY;
+    tracer.endX = endX;
+    tracer.endY = endY;
+    evaluateCurve(curve, 0, 0, &tracer.curveX, &tracer.curveY);
+    tracer.length = 0;
+}
+
+//This is the midpoint idea, but following the curve's parameter instead of an implicit equation, so the same thing
+//works for arcs and Béziers. Whichever axis the curve is moving along faster is the major axis, and every tick moves
+//one step along it: Newton's method finds the t where the curve gets to the next step on that axis, and then the other
+//axis steps too if the curve is past the midpoint between the two steps it could be on (which is just rounding).
+//Once t gets to 1, it finishes off with straight steps to (endX, endY), which is never more than a step or so away.
+bool nextCurveStep(CurveTracer &tracer, int *stepX, int *stepY) {
+    const CurvePrimitive &curve = *tracer.curve;
+    while (tracer.t < 1) {
+        double dx;
+        double dy;
+        evaluateCurve(curve, tracer.t, 1, &dx, &dy);
+        bool majorIsX = fabs(dx) >= fabs(dy);
+        double direction = majorIsX ? dx : dy;
+        double target = (majorIsX ? tracer.x : tracer.y) + (direction >= 0 ? 1 : -1);
+
+        double t = tracer.t;
+        for (int i = 0; i < 8; i++) {
+            double x;
+            double y;
+            double derivativeX;
+            double derivativeY;
+            evaluateCurve(curve, t, 0, &x, &y);
+            evaluateCurve(curve, t, 1, &derivativeX, &derivativeY);
+            double error = (majorIsX ? x : y) - target;
+            double derivative = majorIsX ? derivativeX : derivativeY;
+            //If it's stopped heading towards the target, Newton's method would send it backwards.
+            if (derivative * direction <= 0) {
+                break;
+            }
+            double next = std::min(std::max(t - error / derivative, tracer.t), 1.0);
+            if (fabs(next - t) < 1e-12) {
+                t = next;
+                break;
+            }
+            t = next;
+        }
+        //If it didn't get anywhere, move on by half a step's worth of t so it can never get stuck.
+        if (t <= tracer.t) {
+            double speed = sqrt(dx * dx + dy * dy);
+            t = std::min(tracer.t + (speed > 0 ? 0.5 / speed : 1e-3), 1.0);
+        }
+
+        double x;
+        double y;
+        evaluateCurve(curve, t, 0, &x, &y);
+        double movedX = x - tracer.curveX;
+        double movedY = y - tracer.curveY;
+        tracer.length += (float) sqrt(movedX * movedX + movedY * movedY);
+        tracer.t = t;
+        tracer.curveX = x;
+        tracer.curveY = y;
+        if (t >= 1) {
+            break;
+        }
+
+        *stepX = std::min(std::max((int) lround(x) - tracer.x, -1), 1);
+        *stepY = std::min(std::max((int) lround(y) - tracer.y, -1), 1);
+        if (*stepX != 0 || *stepY != 0) {
+            tracer.x += *stepX;
+            tracer.y += *stepY;
+            return true;
+        }
+    }
+
+    *stepX = (tracer.endX > tracer.x) - (tracer.endX < tracer.x);
+    *stepY = (tracer.endY > tracer.y) - (tracer.endY < tracer.y);
+    tracer.x += *stepX;
+    tracer.y += *stepY;
+    return *stepX != 0 || *stepY != 0;
+}
+
+//It's gotoPoint for curves: the steps come from a CurveTracer, and how long each tick takes comes from the move's
+//speed profile, the same as a line.
+float traceCurve(const PlannedMove &move) {
+    CurveTracer tracer;
+    startCurveTracer(tracer, move.curve, currentX, currentY, move.x, move.y);
+    resetStepClock();
+    int tick = 0;
+    int stepX;
+    int stepY;
+    while (nextCurveStep(tracer, &stepX, &stepY)) {
+        if (!stepMotors(stepX, stepY, profileTickTime(move, tick) / 2)) {
+            //Nothing we planned should ever run into a limit switch, so where we think we are must be wrong.
+            positionTrusted = false;
+            break;
+        }
+        currentX += stepX;
+        currentY += stepY;
+        tick++;
+    }
+    return tracer.length;
+}
+
+void startCurveFitter(CurveFitter &fitter, MotionPlanner *planner) {
+    fitter.planner = planner;
+    fitter.numPoints = 0;
+    fitter.haveStartTangent = false;
+}
+
+//The first point of a run goes straight to the planner (it's the pen up move to the start), and the rest wait in
+//points until there are enough of them to fit curves through. Points that round to the same step as the last one
+//wouldn't make a move anyway, so they get dropped here too.
+void addPointToCurveFitter(CurveFitter &fitter, Point point) {
+    if (!fitCurves) {
+        addPointToMotionPlanner(*fitter.planner, point);
+        return;
+    }
+    if (std::isnan(point.y)) {
+        finishCurveFitter(fitter);
+        addPointToMotionPlanner(*fitter.planner, point);
+        return;
+    }
+    if (fitter.numPoints == 0) {
+        addPointToMotionPlanner(*fitter.planner, point);
+        fitter.points[0] = point;
+        fitter.numPoints = 1;
+        fitter.haveStartTangent = false;
+        return;
+    }
+    const Point &last = fitter.points[fitter.numPoints - 1];
+    if (lroundf(point.x) == lroundf(last.x) && lroundf(point.y) == lroundf(last.y)) {
+        return;
+    }
+    fitter.points[fitter.numPoints++] = point;
+    //When it's full, the piece can't go all the way to the end, since the tangent there needs the point after it.
+    if (fitter.numPoints == CURVE_FIT_WINDOW) {
+        sendFittedPiece(fitter, CURVE_FIT_WINDOW - 2);
+    }
+}
+
+void finishCurveFitter(CurveFitter &fitter) {
+    while (fitter.numPoints > 1) {
+        sendFittedPiece(fitter, fitter.numPoints - 1);
+    }
+    fitter.numPoints = 0;
+}
+
+//Fitting is pretty much always possible up to some point and then not after it, so it's a binary search for that
+//point, starting with the whole lot since that's what happens most of the time.
+void sendFittedPiece(CurveFitter &fitter, int lastEnd) {
+    Point *points = fitter.points;
+    int numPoints = fitter.numPoints;
+    double startTangentX = fitter.startTangentX;
+    double startTangentY = fitter.startTangentY;
+    if (!fitter.haveStartTangent) {
+        runTangent(points, numPoints, 0, &startTangentX, &startTangentY);
+    }
+
+    CurvePrimitive curve;
+    CurvePrimitive candidate;
+    int end = 1;
+    double endTangentX;
+    double endTangentY;
+    if (lastEnd >= 2) {
+        runTangent(points, numPoints, lastEnd, &endTangentX, &endTangentY);
+        if (fitCurve(points, lastEnd, startTangentX, startTangentY, endTangentX, endTangentY, &curve)) {
+            end = lastEnd;
+        } else {
+            int fits = 1;
+            int doesNotFit = lastEnd;
+            while (doesNotFit - fits > 1) {
+                int middle = (fits + doesNotFit) / 2;
+                runTangent(points, numPoints, middle, &endTangentX, &endTangentY);
+                if (middle >= 2 && fitCurve(points, middle, startTangentX, startTangentY, endTangentX, endTangentY,
+                                            &candidate)) {
+                    fits = middle;
+                    curve = candidate;
+                } else {
+                    doesNotFit = middle;
                 }
+            }
+            end = fits;
+        }
+    }
+
+    if (end >= 2) {
+        addCurveToMotionPlanner(*fitter.planner, curve, points[end]);
+        //Carry on the way the curve actually ends up going, so the next piece joins it without a corner.
+        double dx;
+        double dy;
+        evaluateCurve(curve, 1, 1, &dx, &dy);
+        double length = sqrt(dx * dx + dy * dy);
+        fitter.startTangentX = dx / length;
+        fitter.startTangentY = dy / length;
+    } else {
+        addPointToMotionPlanner(*fitter.planner, points[1]);
+        runTangent(points, numPoints, 1, &fitter.startTangentX, &fitter.startTangentY);
+    }
+    fitter.haveStartTangent = true;
+
+    for (int i = end; i < numPoints; i++) {
+        points[i - end] = points[i];
+    }
+    fitter.numPoints = numPoints - end;
+}
+
+//The arc leaves the first point along the start tangent and goes through the last point. The quadratic's middle control
+//point is where the two tangents cross. The cubic is Schneider's least squares fit with the tangents fixed, with the
+//points moved along it to their closest spots a few times.
+bool fitCurve(const Point *points, int last, double startTangentX, double startTangentY, double endTangentX,
+              double endTangentY, CurvePrimitive *curve) {
+    double parameters[CURVE_FIT_WINDOW];
+    //Start off with the points spread along the curve by how far apart they are.
+    parameters[0] = 0;
+    for (int i = 1; i <= last; i++) {
+        parameters[i] = parameters[i - 1] + travelDistance(points[i - 1], points[i]);
+    }
+    double chordLength = parameters[last];
+    if (chordLength <= 0) {
+        return false;
+    }
+    for (int i = 1; i <= last; i++) {
+        parameters[i] /= chordLength;
+    }
+    double guesses[CURVE_FIT_WINDOW];
+    memcpy(guesses, parameters, (last + 1) * sizeof(double));
+
+    double x0 = points[0].x;
+    double y0 = points[0].y;
+    double x2 = points[last].x;
+    double y2 = points[last].y;
+
+    //Arc: the centre is on the normal to the start tangent (to the left of it), and the same distance from both ends.
+    //That makes it join the piece before it without a corner, the same as the Béziers do.
+    double normalX = -startTangentY;
+    double normalY = startTangentX;
+    double along = (x2 - x0) * normalX + (y2 - y0) * normalY;
+    if (fabs(along) > 1e-9) {
+        //Negative if the centre is to the right, which means the arc goes clockwise.
+        double radius = ((x2 - x0) * (x2 - x0) + (y2 - y0) * (y2 - y0)) / (2 * along);
+        curve->shape = CURVE_ARC;
+        curve->x[0] = x0 + radius * normalX;
+        curve->y[0] = y0 + radius * normalY;
+        curve->radius = fabs(radius);
+        curve->startAngle = atan2(y0 - curve->y[0], x0 - curve->x[0]);
+        double sweep = atan2(y2 - curve->y[0], x2 - curve->x[0]) - curve->startAngle;
+        if (radius > 0 && sweep <= 0) {
+            sweep += 2 * M_PI;
+        } else if (radius < 0 && sweep >= 0) {
+            sweep -= 2 * M_PI;
+        }
+        curve->sweep = sweep;
+        if (curve->radius < CURVE_FIT_MAX_RADIUS && curveFitsPoints(*curve, points, last, parameters)) {
+            return true;
+        }
+        memcpy(parameters, guesses, (last + 1) * sizeof(double));
+    }
+
+    //Quadratic Bézier: x0 + a * startTangent = x2 - b * endTangent, and both a and b have to be forwards.
+    double cross = startTangentX * endTangentY - startTangentY * endTangentX;
+    if (fabs(cross) > 1e-9) {
+        double a = ((x2 - x0) * endTangentY - (y2 - y0) * endTangentX) / cross;
+        double b = ((x2 - x0) * startTangentY - (y2 - y0) * startTangentX) / cross;
+        if (a > 0 && b > 0) {
+            curve->shape = CURVE_QUADRATIC;
+            curve->x[0] = x0;
+            curve->y[0] = y0;
+            curve->x[1] = x0 + a * startTangentX;
+            curve->y[1] = y0 + a * startTangentY;
+            curve->x[2] = x2;
+            curve->y[2] = y2;
+            if (curveFitsPoints(*curve, points, last, parameters)) {
+                return true;
+            }
+            memcpy(parameters, guesses, (last + 1) * sizeof(double));
+        }
+    }
+
+    //Cubic Bézier: the control points are x0 + alpha0 * startTangent and x2 - alpha1 * endTangent, with the alphas
+    //picked so the points are as close as they can be (in the least squares sense) at their parameters.
+    curve->shape = CURVE_CUBIC;
+    curve->x[0] = x0;
+    curve->y[0] = y0;
+    curve->x[3] = x2;
+    curve->y[3] = y2;
+    for (int iteration = 0; iteration <= CURVE_FIT_ITERATIONS; iteration++) {
+        double c00 = 0;
+        double c01 = 0;
+        double c11 = 0;
+        double r0 = 0;
+        double r1 = 0;
+        for (int i = 0; i <= last; i++) {
+            double t = parameters[i];
+            double u = 1 - t;
+            double b0 = u * u * u;
+            double b1 = 3 * u * u * t;
+            double b2 = 3 * u * t * t;
+            double b3 = t * t * t;
+            double a0X = startTangentX * b1;
+            double a0Y = startTangentY * b1;
+            double a1X = -endTangentX * b2;
+            double a1Y = -endTangentY * b2;
+            double restX = points[i].x - (x0 * (b0 + b1) + x2 * (b2 + b3));
+            double restY = points[i].y - (y0 * (b0 + b1) + y2 * (b2 + b3));
+            c00 += a0X * a0X + a0Y * a0Y;
+            c01 += a0X * a1X + a0Y * a1Y;
+            c11 += a1X * a1X + a1Y * a1Y;
+            r0 += a0X * restX + a0Y * restY;
+            r1 += a1X * restX + a1Y * restY;
+        }
+        double alpha0 = 0;
+        double alpha1 = 0;
+        double systemDeterminant = c00 * c11 - c01 * c01;
+        if (fabs(systemDeterminant) > 1e-12) {
+            alpha0 = (r0 * c11 - r1 * c01) / systemDeterminant;
+            alpha1 = (c00 * r1 - c01 * r0) / systemDeterminant;
+        }
+        //If the least squares fit says to go backwards, a third of the way along the chord is a safe bet.
+        if (alpha0 < 1e-6 * chordLength || alpha1 < 1e-6 * chordLength) {
+            alpha0 = chordLength / 3;
+            alpha1 = chordLength / 3;
+        }
+        curve->x[1] = x0 + alpha0 * startTangentX;
+        curve->y[1] = y0 + alpha0 * startTangentY;
+        curve->x[2] = x2 - alpha1 * endTangentX;
+        curve->y[2] = y2 - alpha1 * endTangentY;
+        if (curveFitsPoints(*curve, points, last, parameters)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Every point gets one Newton step towards the closest spot on the curve (minimising the squared distance), and then
+//has to be within CURVE_FIT_TOLERANCE of it. The points have to stay in order along the curve, and halfway between
+//each pair of them the curve has to be close to the line between them too, so it can't go off and do a loop.
+//The line between two points can already be SIMPLIFY_TOLERANCE off the real curve, so that gets allowed for.
+//A curve can be close to the points and still bend a lot tighter than they do somewhere (Béziers do it near their ends
+//a lot), and then it'd be slower than just drawing the lines between the points, so it also has to be at least as quick
+//as the lines would be. A tie goes to the curve, since one long move lets the planner see a lot further ahead than
+//PLANNER_LOOKAHEAD short ones.
+bool curveFitsPoints(const CurvePrimitive &curve, const Point *points, int last, double *parameters) {
+    bool fits = true;
+    for (int i = 1; i < last; i++) {
+        double t = parameters[i];
+        double x;
+        double y;
+        double dx;
+        double dy;
+        double ddx;
+        double ddy;
+        evaluateCurve(curve, t, 0, &x, &y);
+        evaluateCurve(curve, t, 1, &dx, &dy);
+        evaluateCurve(curve, t, 2, &ddx, &ddy);
+        double offX = x - points[i].x;
+        double offY = y - points[i].y;
+        double denominator = dx * dx + dy * dy + offX * ddx + offY * ddy;
+        if (denominator > 0) {
+            t = std::min(std::max(t - (offX * dx + offY * dy) / denominator, 0.0), 1.0);
+            evaluateCurve(curve, t, 0, &x, &y);
+        }
+        parameters[i] = t;
+        if ((x - points[i].x) * (x - points[i].x) + (y - points[i].y) * (y - points[i].y) >
+            CURVE_FIT_TOLERANCE * CURVE_FIT_TOLERANCE) {
+            fits = false;
+        }
+    }
+    if (!fits) {
+        return false;
+    }
+
+    for (int i = 0; i < last; i++) {
+        if (parameters[i + 1] <= parameters[i]) {
+            return false;
+        }
+        double x;
+        double y;
+        evaluateCurve(curve, 0.5 * (parameters[i] + parameters[i + 1]), 0, &x, &y);
+        Point middle;
+        middle.x = (float) x;
+        middle.y = (float) y;
+        if (distanceFromSegment(middle, points[i], points[i + 1]) > CURVE_FIT_TOLERANCE + SIMPLIFY_TOLERANCE) {
+            return false;
+        }
+    }
+
+    //The lines get CRUISE_SPEED at the ends, since what's on the other side isn't known yet.
+    float curveSpeeds[CURVE_FIT_WINDOW];
+    float linesSpeeds[CURVE_FIT_WINDOW];
+    float ticks[CURVE_FIT_WINDOW];
+    ticks[0] = 0;
+    for (int i = 0; i <= last; i++) {
+        if (i > 0) {
+            float dx = fabsf(points[i].x - points[i - 1].x);
+            float dy = fabsf(points[i].y - points[i - 1].y);
+            ticks[i] = ticks[i - 1] + std::max(dx, dy);
+        }
+        double t = (i == 0) ? 0 : ((i == last) ? 1 : parameters[i]);
+        double curvature = curveCurvature(curve, t);
+        curveSpeeds[i] = curvature > 0 ? bendSpeed(1 / curvature) : CRUISE_SPEED;
+        linesSpeeds[i] = CRUISE_SPEED;
+        if (i > 0 && i < last) {
+            linesSpeeds[i] = cornerSpeed(points[i].x - points[i - 1].x, points[i].y - points[i - 1].y,
+                                         points[i + 1].x - points[i].x, points[i + 1].y - points[i].y);
+        }
+    }
+    return runTime(curveSpeeds, ticks, last + 1, false) <= runTime(linesSpeeds, ticks, last + 1, true);
+}
+
+//It's the derivative of the parabola through three of the points (the ones either side of points[i], or the first or
+//last three at the ends), using the distance along the points as the parameter so uneven spacing doesn't throw it off.
+void runTangent(const Point *points, int numPoints, int i, double *tangentX, double *tangentY) {
+    double x;
+    double y;
+    if (numPoints < 3) {
+        x = points[1].x - points[0].x;
+        y = points[1].y - points[0].y;
+    } else {
+        int first = std::min(std::max(i - 1, 0), numPoints - 3);
+        double s0 = 0;
+        double s1 = travelDistance(points[first], points[first + 1]);
+        double s2 = s1 + travelDistance(points[first + 1], points[first + 2]);
+        double s = (i == first) ? s0 : ((i == first + 1) ? s1 : s2);
+        //The derivatives of the three Lagrange polynomials at s.
+        double l0 = (2 * s - s1 - s2) / ((s0 - s1) * (s0 - s2));
+        double l1 = (2 * s - s0 - s2) / ((s1 - s0) * (s1 - s2));
+        double l2 = (2 * s - s0 - s1) / ((s2 - s0) * (s2 - s1));
+        x = l0 * points[first].x + l1 * points[first + 1].x + l2 * points[first + 2].x;
+        y = l0 * points[first].y + l1 * points[first + 1].y + l2 * points[first + 2].y;
+    }
+    double length = sqrt(x * x + y * y);
+    if (length == 0) {
+        length = 1;
+    }
+    *tangentX = x / length;
+    *tangentY = y / length;
+}
+
+bool tryPushStepCommand(StepQueue &queue, const StepCommand &command) {
+    unsigned int tail = queue.tail.load(std::memory_order_relaxed);
+    unsigned int head = queue.head.load(std::memory_order_acquire);
+    if (tail - head == (unsigned int) STEP_QUEUE_SIZE) {
+        return false;
+    }
+    queue.commands[tail % STEP_QUEUE_SIZE] = command;
+    queue.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool tryPopStepCommand(StepQueue &queue, StepCommand *command) {
+    unsigned int head = queue.head.load(std::memory_order_relaxed);
+    unsigned int tail = queue.tail.load(std::memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    *command = queue.commands[head % STEP_QUEUE_SIZE];
+    queue.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+//The planner is way faster than the motors, so the queue is almost always full, and the planner just waits.
+void pushStepCommand(StepQueue &queue, const StepCommand &command) {
+    while (!tryPushStepCommand(queue, command)) {
+        usleep(STEP_QUEUE_WAIT);
+    }
+}
+
+//This only really waits at the start of a job, before the planner has sent anything.
+void popStepCommand(StepQueue &queue, StepCommand *command) {
+    while (!tryPopStepCommand(queue, command)) {
+        usleep(STEP_QUEUE_WAIT);
+    }
+}
+
+void pushMoveToStepQueue(const PlannedMove &move, void *context) {
+    StepCommand command;
+    command.endOfJob = false;
+    command.goHome = false;
+    command.move = move;
+    pushStepCommand(*(StepQueue *) context, command);
+}
+
+//Returns the distance it took to go to the point specified.
+//The point gets rounded to the nearest step, and then it's just the integer gotoPoint.
+float gotoPoint(Point point) {
+    return gotoPoint((int) lroundf(point.x), (int) lroundf(point.y));
+}
+
+bool gotoZero() {
+    positionTrusted = false;
+    if (!approachMinimumLimitSwitches(HOMING_FAST_SPEED) || !backOffMinimumLimitSwitches(HOMING_BACKOFF_STEPS) ||
+        !approachMinimumLimitSwitches(HOMING_SLOW_SPEED)) {
+        logToConsole(LOG_ERROR) << "Error, couldn't find the minimum limit switches while going to zero.";
+        return false;
+    }
+    //We're up against both minimum limit switches now, so this is (0, 0). Homing hits them on purpose, so that
+    //doesn't count as a trip.
+    currentX = 0;
+    currentY = 0;
+    positionTrusted = true;
+    clearLimitSwitchTrip();
+    return true;
+}
+
+//Each axis stops as soon as its own limit switch is pressed, and the other one keeps going. There's no slowing down at
+//the end, since the limit switch is where it has to stop, and the slow approach is what makes that repeatable.
+bool approachMinimumLimitSwitches(float topSpeed) {
+    resetStepClock();
+    for (int tick = 0; tick < HOMING_MAX_TICKS; tick++) {
+        int stepX = limitSwitchPressed(X, CCW) ? 0 : -1;
+        int stepY = limitSwitchPressed(Y, CCW) ? 0 : -1;
+        if (stepX == 0 && stepY == 0) {
+            return true;
+        }
+        float speed = std::min(topSpeed, sqrtf(START_SPEED * START_SPEED + 2 * ACCELERATION * tick));
+        stepMotors(stepX, stepY, (int) (500000.0f / speed));
+    }
+    return limitSwitchPressed(X, CCW) && limitSwitchPressed(Y, CCW);
+}
+
+//Both axes step together at START_SPEED, even once one of the switches has let go, since a few extra steps on one
+//axis don't matter.
+bool backOffMinimumLimitSwitches(int steps) {
+    resetStepClock();
+    int stepsPastSwitches = 0;
+    for (int tick = 0; tick < HOMING_MAX_TICKS; tick++) {
+        if (!limitSwitchPressed(X, CCW) && !limitSwitchPressed(Y, CCW)) {
+            if (stepsPastSwitches == steps) {
+                return true;
+            }
+            stepsPastSwitches++;
+        }
+        if (!stepMotors(1, 1, STEP_TIME)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+float homeIfNeeded() {
+    if (positionTrusted) {
+        logToConsole(LOG_INFO) << "Already homed, starting from (" << currentX << ", " << currentY << ").";
+        return 0;
+    }
+    double startTime = hardwareSeconds();
+    gotoZero();
+    return (float) (hardwareSeconds() - startTime);
+}
+
+//The file is just "x y bootId". Anything else in it (or numbers that are off the plotter) and it doesn't get trusted.
+//It doesn't get trusted after a reboot either, or if the boot ID can't be read, since there's no telling then.
+bool loadHomeState() {
+    std::ifstream file(HOME_STATE_FILE_NAME);
+    int x;
+    int y;
+    std::string bootId;
+    if (!file.is_open() || !(file >> x >> y >> bootId) || x < 0 || y < 0 || x > X_MAX || y > Y_MAX) {
+        return false;
+    }
+    std::string thisBootId = currentBootId();
+    if (thisBootId.empty() || bootId != thisBootId) {
+        logToConsole(LOG_DEBUG) << "Home state is from a different boot, so it's going to zero.";
+        return false;
+    }
+    currentX = x;
+    currentY = y;
+    positionTrusted = true;
+    logToConsole(LOG_DEBUG) << "Home state: (" << x << ", " << y << ").";
+    return true;
+}
+
+bool saveHomeState() {
+    std::ofstream file(HOME_STATE_FILE_NAME);
+    if (!file.is_open()) {
+        logSystemError("saveHomeState");
+        return false;
+    }
+    file << currentX << " " << currentY << " " << currentBootId() << "\n";
+    return (bool) file;
+}
+
+std::string currentBootId() {
+    std::ifstream file(BOOT_ID_FILE_NAME);
+    std::string bootId;
+    if (!file.is_open() || !(file >> bootId)) {
+        return "";
+    }
+    return bootId;
+}
+
+bool readGPIO(int gpio) {
+    if (!measuringLatencies) {
+        return (bool) hardware.getValue(gpio);
+    }
+    long start = latencyNow();
+    bool value = (bool) hardware.getValue(gpio);
+    recordLatency(gpioReadLatency, latencyNow() - start);
+    return value;
+}
+
+void writeGPIO(int gpio, int value) {
+    if (!measuringLatencies) {
+        hardware.setValue(gpio, value);
+        return;
+    }
+    long start = latencyNow();
+    hardware.setValue(gpio, value);
+    recordLatency(gpioWriteLatency, latencyNow() - start);
+}
+
+int isOmegaGPIORequested(int gpio) {
+    return gpio_is_requested(gpio);
+}
+
+int requestOmegaGPIO(int gpio) {
+    return gpio_request(gpio, NULL);
+}
+
+int setOmegaGPIODirectionOutput(int gpio, int value) {
+    return gpio_direction_output(gpio, value);
+}
+
+int setOmegaGPIODirectionInput(int gpio) {
+    return gpio_direction_input(gpio);
+}
+
+int freeOmegaGPIO(int gpio) {
+    return gpio_free(gpio);
+}
+
+int setOmegaGPIOValue(int gpio, int value) {
+    return gpio_set_value(gpio, value);
+}
+
+int getOmegaGPIOValue(int gpio) {
+    return gpio_get_value(gpio);
+}
+
+void getOmegaTime(struct timespec *now) {
+    clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+void sleepUntilOmegaTime(const struct timespec *deadline) {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+}
+
+void sleepOmega(int microseconds) {
+    usleep(microseconds);
+}
+
+//Switches everything over to the simulated plotter (and the mock PWM backend for the pen), with the plotter sitting at
+//(startX, startY) and the clock at 0. Call it before setupPlotter.
+void useSimulatedHardware(int startX, int startY) {
+    simulatingHardware = true;
+    hardware = SIMULATED_HARDWARE;
+    pwmBackend = MOCK_PWM_BACKEND;
+    //The simulated pins all start at GND, so the drivers have to forget what they think they wrote to them.
+    xAxis = createStepperAxis(X_AXIS_STEP_GPIO, X_AXIS_DIRECTION_GPIO, X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO,
+                              X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+    yAxis = createStepperAxis(Y_AXIS_STEP_GPIO, Y_AXIS_DIRECTION_GPIO, Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO,
+                              Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+    for (int i = 0; i < NUM_SIMULATED_GPIOS; i++) {
+        simulatedGPIORequested[i] = false;
+        simulatedGPIOLevels[i] = 0;
+    }
+    simulatedX = startX;
+    simulatedY = startY;
+    //Nothing about the real plotter's position applies to the simulated one.
+    positionTrusted = false;
+    simulatedLimitCrashes = 0;
+    simulatedDirectionChanges = 0;
+    simulatedClock.tv_sec = 0;
+    simulatedClock.tv_nsec = 0;
+    simulatedStepTrace.clear();
+}
+
+int isSimulatedGPIORequested(int gpio) {
+    if (gpio < 0 || gpio >= NUM_SIMULATED_GPIOS) {
+        return -1;
+    }
+    return simulatedGPIORequested[gpio] ? 1 : 0;
+}
+
+int requestSimulatedGPIO(int gpio) {
+    if (gpio < 0 || gpio >= NUM_SIMULATED_GPIOS) {
+        return -1;
+    }
+    simulatedGPIORequested[gpio] = true;
+    return 0;
+}
+
+int setSimulatedGPIODirectionOutput(int gpio, int value) {
+    return setSimulatedGPIOValue(gpio, value);
+}
+
+int setSimulatedGPIODirectionInput(int gpio) {
+    return isSimulatedGPIORequested(gpio) < 0 ? -1 : 0;
+}
+
+int freeSimulatedGPIO(int gpio) {
+    if (gpio < 0 || gpio >= NUM_SIMULATED_GPIOS) {
+        return -1;
+    }
+    simulatedGPIORequested[gpio] = false;
+    return 0;
+}
+
+//The motors step when their step pin goes from GND to HIGH, towards whichever way their direction pin says.
+int setSimulatedGPIOValue(int gpio, int value) {
+    if (gpio < 0 || gpio >= NUM_SIMULATED_GPIOS) {
+        return -1;
+    }
+    bool risingEdge = simulatedGPIOLevels[gpio] == 0 && value != 0;
+    if ((gpio == X_AXIS_DIRECTION_GPIO || gpio == Y_AXIS_DIRECTION_GPIO) && simulatedGPIOLevels[gpio] != (value ? 1 : 0)) {
+        simulatedDirectionChanges++;
+    }
+    simulatedGPIOLevels[gpio] = value ? 1 : 0;
+    if (risingEdge && gpio == X_AXIS_STEP_GPIO) {
+        simulateStepPulse(X);
+    } else if (risingEdge && gpio == Y_AXIS_STEP_GPIO) {
+        simulateStepPulse(Y);
+    }
+    return 0;
+}
+
+//The limit switches read from where the simulated plotter actually is, and everything else reads back what was
+//written to it.
+int getSimulatedGPIOValue(int gpio) {
+    if (gpio < 0 || gpio >= NUM_SIMULATED_GPIOS) {
+        return -1;
+    }
+    if (gpio == X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO) {
+        return simulatedX <= 0;
+    }
+    if (gpio == X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO) {
+        return simulatedX >= X_MAX;
+    }
+    if (gpio == Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO) {
+        return simulatedY <= 0;
+    }
+    if (gpio == Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO) {
+        return simulatedY >= Y_MAX;
+    }
+    return simulatedGPIOLevels[gpio];
+}
+
+void getSimulatedTime(struct timespec *now) {
+    *now = simulatedClock;
+}
+
+//Nothing else is running on the simulated clock, so sleeping until a deadline is just jumping to it.
+void sleepUntilSimulatedTime(const struct timespec *deadline) {
+    if (deadline->tv_sec > simulatedClock.tv_sec ||
+        (deadline->tv_sec == simulatedClock.tv_sec && deadline->tv_nsec > simulatedClock.tv_nsec)) {
+        simulatedClock = *deadline;
+    }
+}
+
+void sleepSimulated(int microseconds) {
+    simulatedClock.tv_nsec += (long) microseconds * 1000;
+    while (simulatedClock.tv_nsec >= 1000000000L) {
+        simulatedClock.tv_nsec -= 1000000000L;
+        simulatedClock.tv_sec++;
+    }
+}
+
+//Moves the simulated plotter one step on the axis. If the limit switch it's heading towards is already pressed, the
+//carriage is up against the end, so it doesn't move, and it gets counted as a crash.
+void simulateStepPulse(AXIS axis) {
+    bool towardsMaximum = simulatedGPIOLevels[axis == X ? X_AXIS_DIRECTION_GPIO : Y_AXIS_DIRECTION_GPIO] != 0;
+    int &position = (axis == X) ? simulatedX : simulatedY;
+    float maximum = (axis == X) ? X_MAX : Y_MAX;
+    if ((towardsMaximum && position >= maximum) || (!towardsMaximum && position <= 0)) {
+        simulatedLimitCrashes++;
+        return;
+    }
+    position += towardsMaximum ? 1 : -1;
+
+    SimulatedStep step;
+    step.time = (long long) simulatedClock.tv_sec * 1000000000LL + simulatedClock.tv_nsec;
+    step.x = simulatedX;
+    step.y = simulatedY;
+    step.penDown = mockPWMSetCount > 0 && mockPWMDutyCycle == SERVO_DOWN_DUTY_CYCLE;
+    simulatedStepTrace.push_back(step);
+}
+
+bool writeSimulatedStepTrace(const char filename[]) {
+    std::ofstream traceFile(filename);
+    if (!traceFile.is_open()) {
+        return false;
+    }
+    traceFile << "time_ns,x,y,pen_down\n";
+    for (size_t i = 0; i < simulatedStepTrace.size(); i++) {
+        const SimulatedStep &step = simulatedStepTrace[i];
+        traceFile << step.time << "," << step.x << "," << step.y << "," << (step.penDown ? 1 : 0) << "\n";
+    }
+    return true;
+}
+
+double hardwareSeconds() {
+    struct timespec now;
+    hardware.now(&now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//The index that the limit switch monitor uses for the switch that direction is heading towards on that axis.
+int limitSwitchIndex(AXIS axis, Direction direction) {
+    return (axis == X ? 0 : 2) + (direction == CW ? 1 : 0);
+}
+
+//Starts watching the limit switches with a background thread.
+//Edges only tell you when something changes, so every switch gets read once first to know where it starts.
+//Returns false (and leaves stepping reading the GPIOs like before) if the edge source couldn't be set up.
+bool startLimitSwitchMonitor(LimitEdgeSource source) {
+    if (limitSwitchMonitorRunning) {
+        return true;
+    }
+    if (!source.open()) {
+        logSystemError("startLimitSwitchMonitor");
+        return false;
+    }
+    limitEdgeSource = source;
+
+    for (int i = 0; i < NUM_LIMIT_SWITCHES; i++) {
+        limitSwitchStates[i] = readGPIO(LIMIT_SWITCH_GPIOS[i]);
+    }
+    clearLimitSwitchTrip();
+
+    limitSwitchMonitorRunning = true;
+    limitSwitchMonitorThread = std::thread(limitSwitchMonitorLoop);
+    return true;
+}
+
+void stopLimitSwitchMonitor() {
+    if (!limitSwitchMonitorRunning) {
+        return;
+    }
+    limitSwitchMonitorRunning = false;
+    limitSwitchMonitorThread.join();
+    limitEdgeSource.close();
+}
+
+//This is what the monitor thread runs. It just waits for edges, and writes down what happened.
+//It only wakes up every LIMIT_SWITCH_POLL_TIMEOUT ms when nothing is happening, to check if it should stop.
+void limitSwitchMonitorLoop() {
+    while (limitSwitchMonitorRunning) {
+        int index;
+        bool pressed;
+        int result = limitEdgeSource.wait(LIMIT_SWITCH_POLL_TIMEOUT, &index, &pressed);
+        if (result < 0) {
+            logSystemError("limitSwitchMonitorLoop");
+            usleep(LIMIT_SWITCH_POLL_TIMEOUT * 1000);
+            continue;
+        }
+        if (result == 0 || index < 0 || index >= NUM_LIMIT_SWITCHES) {
+            continue;
+        }
+
+        limitSwitchStates[index].store(pressed, std::memory_order_relaxed);
+        if (pressed) {
+            tripLimitSwitch(index);
+        }
+    }
+}
+
+//Only the first switch that got hit is remembered, until someone clears it. The monitor calls this when a switch
+//gets pressed, and stepMotors calls it when a switch stops a step (which is how it gets set when there's no monitor).
+void tripLimitSwitch(int index) {
+    int noTrip = -1;
+    trippedLimitSwitch.compare_exchange_strong(noTrip, index);
+    limitSwitchTripped.store(true, std::memory_order_release);
+}
+
+//If a limit switch has been hit since the last clearLimitSwitchTrip, this returns true, and says which axis and which
+//end of it (CW is the maximum end, CCW is the minimum end).
+bool getLimitSwitchTrip(AXIS *axis, Direction *direction) {
+    if (!limitSwitchTripped.load(std::memory_order_acquire)) {
+        return false;
+    }
+    int index = trippedLimitSwitch.load();
+    *axis = (index < 2) ? X : Y;
+    *direction = (index % 2 == 1) ? CW : CCW;
+    return true;
+}
+
+void clearLimitSwitchTrip() {
+    trippedLimitSwitch = -1;
+    limitSwitchTripped = false;
+}
+
+//Tells the kernel to notify us on both edges of every limit switch, and opens their value files to poll.
+bool openSysfsLimitEdges() {
+    for (int i = 0; i < NUM_LIMIT_SWITCHES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/edge", LIMIT_SWITCH_GPIOS[i]);
+        int edgeFile = open(path, O_WRONLY);
+        if (edgeFile < 0) {
+            closeSysfsLimitEdges();
+            return false;
+        }
+        bool wroteEdge = write(edgeFile, "both", 4) == 4;
+        close(edgeFile);
+        if (!wroteEdge) {
+            closeSysfsLimitEdges();
+            return false;
+        }
+
+        snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", LIMIT_SWITCH_GPIOS[i]);
+        sysfsLimitSwitchFiles[i] = open(path, O_RDONLY);
+        if (sysfsLimitSwitchFiles[i] < 0) {
+            closeSysfsLimitEdges();
+            return false;
+        }
+        //Read it once, otherwise the first poll returns straight away.
+        char value;
+        if (read(sysfsLimitSwitchFiles[i], &value, 1) < 0) {
+            closeSysfsLimitEdges();
+            return false;
+        }
+    }
+    return true;
+}
+
+//sysfs GPIO value files say they have an edge with POLLPRI. After that you have to seek back to the start and read
+//the value again, which also clears the edge.
+int waitForSysfsLimitEdge(int timeout, int *index, bool *pressed) {
+    struct pollfd files[NUM_LIMIT_SWITCHES];
+    for (int i = 0; i < NUM_LIMIT_SWITCHES; i++) {
+        files[i].fd = sysfsLimitSwitchFiles[i];
+        files[i].events = POLLPRI | POLLERR;
+        files[i].revents = 0;
+    }
+
+    int result = poll(files, NUM_LIMIT_SWITCHES, timeout);
+    if (result <= 0) {
+        return result;
+    }
+
+    for (int i = 0; i < NUM_LIMIT_SWITCHES; i++) {
+        if (files[i].revents & (POLLPRI | POLLERR)) {
+            char value;
+            lseek(files[i].fd, 0, SEEK_SET);
+            if (read(files[i].fd, &value, 1) != 1) {
+                return -1;
+            }
+            *index = i;
+            *pressed = (value == '1');
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void closeSysfsLimitEdges() {
+    for (int i = 0; i < NUM_LIMIT_SWITCHES; i++) {
+        if (sysfsLimitSwitchFiles[i] >= 0) {
+            close(sysfsLimitSwitchFiles[i]);
+            sysfsLimitSwitchFiles[i] = -1;
+        }
+    }
+}
+
+//The simulated edge source is a pipe. simulateLimitSwitchEdge writes an edge into one end, and the monitor thread
+//reads it out of the other, exactly like it would get one from the kernel.
+bool openSimulatedLimitEdges() {
+    return pipe(simulatedLimitEdgePipe) == 0;
+}
+
+int waitForSimulatedLimitEdge(int timeout, int *index, bool *pressed) {
+    struct pollfd file;
+    file.fd = simulatedLimitEdgePipe[0];
+    file.events = POLLIN;
+    file.revents = 0;
+
+    int result = poll(&file, 1, timeout);
+    if (result <= 0) {
+        return result;
+    }
+
+    char edge[2];
+    if (read(simulatedLimitEdgePipe[0], edge, 2) != 2) {
+        return -1;
+    }
+    *index = edge[0];
+    *pressed = (edge[1] != 0);
+    return 1;
+}
+
+void closeSimulatedLimitEdges() {
+    for (int i = 0; i < 2; i++) {
+        if (simulatedLimitEdgePipe[i] >= 0) {
+            close(simulatedLimitEdgePipe[i]);
+            simulatedLimitEdgePipe[i] = -1;
+        }
+    }
+}
+
+//Pretends that the limit switch with this index just got pressed (or let go).
+bool simulateLimitSwitchEdge(int index, bool pressed) {
+    char edge[2] = {(char) index, (char) (pressed ? 1 : 0)};
+    return write(simulatedLimitEdgePipe[1], edge, 2) == 2;
+}
+
+void startPWM(int gpio, int frequency, int dutyCycle) {
+    if (!pwmBackend.set(gpio, frequency, dutyCycle)) {
+        logSystemError("startPWM");
+    }
+}
+
+void stopPWM(int gpio) {
+    pwmBackend.stop(gpio);
+}
+
+//Uses the sysfs PWM channel if it can be opened, since that doesn't have to start a new process every time the pen
+//moves. If it can't, it goes back to fast-gpio.
+void openPWM(int gpio) {
+    if (SYSFS_PWM_BACKEND.open(gpio)) {
+        pwmBackend = SYSFS_PWM_BACKEND;
+        return;
+    }
+    logToConsole(LOG_WARNING) << "Couldn't open the sysfs PWM channel, using fast-gpio instead.";
+    pwmBackend = FAST_GPIO_PWM_BACKEND;
+    pwmBackend.open(gpio);
+}
+
+void closePWM(int gpio) {
+    pwmBackend.close(gpio);
+}
+
+int sysfsPWMChannel(int gpio) {
+    for (int i = 0; i < (int) (sizeof(SYSFS_PWM_GPIOS) / sizeof(SYSFS_PWM_GPIOS[0])); i++) {
+        if (SYSFS_PWM_GPIOS[i] == gpio) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//Exports the pin's PWM channel (if it isn't already), and opens its period, duty_cycle and enable files.
+bool openSysfsPWM(int gpio) {
+    int channel = sysfsPWMChannel(gpio);
+    if (channel < 0) {
+        return false;
+    }
+    char path[96];
+    snprintf(path, sizeof(path), "%s/pwm%d", SYSFS_PWM_CHIP, channel);
+    if (access(path, F_OK) != 0) {
+        snprintf(path, sizeof(path), "%s/export", SYSFS_PWM_CHIP);
+        int exportFile = open(path, O_WRONLY);
+        if (exportFile < 0) {
+            return false;
+        }
+        char channelText[16];
+        int length = snprintf(channelText, sizeof(channelText), "%d", channel);
+        bool exported = write(exportFile, channelText, length) == length;
+        close(exportFile);
+        if (!exported) {
+            return false;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/pwm%d/period", SYSFS_PWM_CHIP, channel);
+    sysfsPWMPeriodFile = open(path, O_WRONLY);
+    snprintf(path, sizeof(path), "%s/pwm%d/duty_cycle", SYSFS_PWM_CHIP, channel);
+    sysfsPWMDutyCycleFile = open(path, O_WRONLY);
+    snprintf(path, sizeof(path), "%s/pwm%d/enable", SYSFS_PWM_CHIP, channel);
+    sysfsPWMEnableFile = open(path, O_WRONLY);
+    sysfsPWMGpio = gpio;
+
+    if (sysfsPWMPeriodFile < 0 || sysfsPWMDutyCycleFile < 0 || sysfsPWMEnableFile < 0) {
+        closeSysfsPWM(gpio);
+        return false;
+    }
+    return true;
+}
+
+//Writes a number to one of the sysfs PWM files.
+bool writeSysfsPWMValue(int file, long value) {
+    char text[32];
+    int length = snprintf(text, sizeof(text), "%ld", value);
+    return pwrite(file, text, length, 0) == length;
+}
+
+//Only writes what actually changed. For the pen, that's just the duty cycle, since the frequency never changes.
+bool setSysfsPWM(int gpio, int frequency, int dutyCycle) {
+    if (gpio != sysfsPWMGpio) {
+        return false;
+    }
+    long period = 1000000000L / frequency;
+    long dutyTime = period * dutyCycle / 100;
+
+    if (period != sysfsPWMPeriod) {
+        //The duty cycle can't ever be longer than the period, so clear it before changing the period. If we don't know
+        //what it is (nothing's been written since it was opened), whatever was left there from before could be too
+        //long, so clear it then too.
+        if (sysfsPWMDutyCycle < 0 || sysfsPWMDutyCycle > period) {
+            if (!writeSysfsPWMValue(sysfsPWMDutyCycleFile, 0)) {
                 return false;
             }
-            //IF X and CCW, then use Limit X MIN.
-            if (stepGPIO == X_AXIS_STEP_GPIO && readGPIO(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO)) {
-                std::cout << "Failed to step motor, Read X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO Limit switch true."
-                          << std::endl;
-                if (readGPIO(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO) == -1) {
-                    perror("X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO NOT DEFINED");
-                    throw std::exception();
+            sysfsPWMDutyCycle = 0;
+        }
+        if (!writeSysfsPWMValue(sysfsPWMPeriodFile, period)) {
+            return false;
+        }
+        sysfsPWMPeriod = period;
+    }
+    if (dutyTime != sysfsPWMDutyCycle) {
+        if (!writeSysfsPWMValue(sysfsPWMDutyCycleFile, dutyTime)) {
+            return false;
+        }
+        sysfsPWMDutyCycle = dutyTime;
+    }
+    if (!sysfsPWMEnabled) {
+        if (!writeSysfsPWMValue(sysfsPWMEnableFile, 1)) {
+            return false;
+        }
+        sysfsPWMEnabled = true;
+    }
+    return true;
+}
+
+void stopSysfsPWM(int gpio) {
+    if (gpio == sysfsPWMGpio && sysfsPWMEnabled && writeSysfsPWMValue(sysfsPWMEnableFile, 0)) {
+        sysfsPWMEnabled = false;
+    }
+}
+
+void closeSysfsPWM(int gpio) {
+    if (gpio != sysfsPWMGpio) {
+        return;
+    }
+    stopSysfsPWM(gpio);
+    int *files[3] = {&sysfsPWMPeriodFile, &sysfsPWMDutyCycleFile, &sysfsPWMEnableFile};
+    for (int i = 0; i < 3; i++) {
+        if (*files[i] >= 0) {
+            close(*files[i]);
+            *files[i] = -1;
+        }
+    }
+    sysfsPWMPeriod = -1;
+    sysfsPWMDutyCycle = -1;
+    sysfsPWMGpio = -1;
+}
+
+//fast-gpio starts a new process for every change, so there's nothing to keep open.
+bool openFastGpioPWM(int) {
+    return true;
+}
+
+bool setFastGpioPWM(int gpio, int frequency, int dutyCycle) {
+    int gpioRequest;
+    if ((gpioRequest = hardware.isRequested(gpio)) < 0) {
+        logSystemError("gpio_is_requested");
+        throw std::exception();
+    }
+
+    std::string command = "fast-gpio pwm ";
+    std::string totalCommand =
+            command + std::to_string(gpio) + " " + std::to_string(frequency) + " " + std::to_string(dutyCycle);
+    return system(totalCommand.c_str()) == 0;
+}
+
+void stopFastGpioPWM(int gpio) {
+    std::string command = "fast-gpio set ";
+    std::string totalCommand = command + std::to_string(gpio) + " 0";
+    system(totalCommand.c_str());
+}
+
+void closeFastGpioPWM(int) {
+}
+
+bool openMockPWM(int gpio) {
+    mockPWMGpio = gpio;
+    mockPWMSetCount = 0;
+    mockPWMStopCount = 0;
+    return true;
+}
+
+bool setMockPWM(int gpio, int frequency, int dutyCycle) {
+    if (gpio != mockPWMGpio) {
+        return false;
+    }
+    mockPWMSetCount++;
+    mockPWMFrequency = frequency;
+    mockPWMDutyCycle = dutyCycle;
+    return true;
+}
+
+void stopMockPWM(int gpio) {
+    if (gpio != mockPWMGpio) {
+        return;
+    }
+    mockPWMStopCount++;
+    mockPWMDutyCycle = 0;
+}
+
+void closeMockPWM(int gpio) {
+    if (gpio == mockPWMGpio) {
+        mockPWMGpio = -1;
+    }
+}
+
+bool liftPen() {
+    logToConsole(LOG_DEBUG) << "Lifted Pen.";
+    if (recordingStepStream) {
+        recordStepStreamPen(false);
+    }
+    long start = latencyNow();
+    startPWM(SERVO_PIN, SERVO_FREQUENCY, SERVO_UP_DUTY_CYCLE);
+    if (measuringLatencies) {
+        recordLatency(penPWMLatency, latencyNow() - start);
+    }
+    hardware.sleep(SERVO_CHANGE_TIME);
+    return true;
+}
+
+bool lowerPen() {
+    logToConsole(LOG_DEBUG) << "Lowered Pen.";
+    if (recordingStepStream) {
+        recordStepStreamPen(true);
+    }
+    long start = latencyNow();
+    startPWM(SERVO_PIN, SERVO_FREQUENCY, SERVO_DOWN_DUTY_CYCLE);
+    if (measuringLatencies) {
+        recordLatency(penPWMLatency, latencyNow() - start);
+    }
+    hardware.sleep(SERVO_CHANGE_TIME);
+    return true;
+}
+
+//Only the logger thread writes to logFile, so it has to be done with it before it gets opened or closed.
+bool openLogFile(const char filename[]) {
+    flushLog();
+    logFile.open(filename);
+    return logFile.is_open();
+}
+
+bool closeLogFile() {
+    flushLog();
+    logFile.close();
+    return true;
+}
+
+LogLine::LogLine(bool toFile, LogLevel level) : toFile(toFile), level(level), text(nullptr) {
+    if (toFile || level >= consoleLogLevel) {
+        text = new std::ostringstream;
+    }
+}
+
+LogLine::LogLine(LogLine &&other) : toFile(other.toFile), level(other.level), text(other.text) {
+    other.text = nullptr;
+}
+
+LogLine::~LogLine() {
+    if (text == nullptr) {
+        return;
+    }
+    std::string line = text->str();
+    delete text;
+    addLogEntry(toFile, level, line);
+}
+
+LogLine logToConsole(LogLevel level) {
+    return LogLine(false, level);
+}
+
+LogLine logToFile() {
+    return LogLine(true, LOG_INFO);
+}
+
+void logSystemError(const char what[]) {
+    int error = errno;
+    logToConsole(LOG_ERROR) << what << ": " << strerror(error);
+}
+
+//If the logger isn't running (before main starts it, or after it's stopped), the line just gets written right away.
+void addLogEntry(bool toFile, LogLevel level, std::string &text) {
+    std::unique_lock<std::mutex> lock(logMutex);
+    if (!loggerRunning) {
+        writeLogEntry(toFile, level, text);
+        if (toFile) {
+            logFile.flush();
+        } else {
+            std::cout.flush();
+        }
+        return;
+    }
+    while (logTail - logHead == (unsigned int) LOG_RING_SIZE) {
+        if (neverWaitToLog) {
+            logLinesDropped++;
+            return;
+        }
+        logReady.notify_one();
+        logWritten.wait(lock);
+    }
+    LogEntry &entry = logRing[logTail % LOG_RING_SIZE];
+    entry.toFile = toFile;
+    entry.level = level;
+    entry.text.swap(text);
+    logTail++;
+    //Don't wake the logger thread up for every line, only once there's a lot of them.
+    if (logTail - logHead == (unsigned int) LOG_RING_SIZE / 2) {
+        logReady.notify_one();
+    }
+}
+
+void writeLogEntry(bool toFile, LogLevel level, const std::string &text) {
+    if (toFile) {
+        logFile << text << '\n';
+    } else if (level >= LOG_ERROR) {
+        std::cerr << text << '\n';
+    } else {
+        std::cout << text << '\n';
+    }
+}
+
+void startLogger() {
+    std::lock_guard<std::mutex> lock(logMutex);
+    if (loggerRunning) {
+        return;
+    }
+    loggerRunning = true;
+    loggerThread = std::thread(loggerLoop);
+}
+
+void stopLogger() {
+    {
+        std::lock_guard<std::mutex> lock(logMutex);
+        if (!loggerRunning) {
+            return;
+        }
+        loggerRunning = false;
+        logReady.notify_one();
+    }
+    loggerThread.join();
+}
+
+void flushLog() {
+    std::unique_lock<std::mutex> lock(logMutex);
+    unsigned int end = logTail;
+    while (loggerRunning && (int) (logHead - end) < 0) {
+        logFlushWanted = true;
+        logReady.notify_one();
+        logWritten.wait(lock);
+    }
+}
+
+//Writes out everything in the ring buffer every LOG_FLUSH_INTERVAL ms (or sooner if it's filling up, or someone's
+//waiting for it), and only flushes the console and the file once per batch.
+void loggerLoop() {
+    std::unique_lock<std::mutex> lock(logMutex);
+    while (true) {
+        if (loggerRunning && !logFlushWanted && logTail - logHead < (unsigned int) LOG_RING_SIZE / 2) {
+            logReady.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL));
+        }
+        bool stopping = !loggerRunning;
+        unsigned int head = logHead;
+        unsigned int tail = logTail;
+        int dropped = logLinesDropped;
+        logLinesDropped = 0;
+        logFlushWanted = false;
+        lock.unlock();
+
+        //The entries between head and tail are ours until logHead moves past them.
+        for (unsigned int i = head; i != tail; i++) {
+            LogEntry &entry = logRing[i % LOG_RING_SIZE];
+            writeLogEntry(entry.toFile, entry.level, entry.text);
+            entry.text.clear();
+        }
+        if (dropped > 0) {
+            std::cerr << "(" << dropped << " log lines dropped because the logger couldn't keep up)" << '\n';
+        }
+        std::cout.flush();
+        std::cerr.flush();
+        logFile.flush();
+
+        lock.lock();
+        logHead = tail;
+        logWritten.notify_all();
+        if (stopping && logHead == logTail) {
+            return;
+        }
+    }
+}
+
+bool planCurve(const char expression[], float xMin, float xMax, float yMin, float yMax, ArrayOfPoints *points,
+               SimplificationReport *simplificationReport) {
+    CompiledExpression function;
+    std::string error;
+    if (!compileExpression(expression, &function, &error)) {
+        logToConsole(LOG_ERROR) << "Error, \"" << expression << "\" is not valid: " << error;
+        return false;
+    }
+
+    if (function.isPolynomial) {
+        for (int i = 0; i <= function.coefficients.degree; i++) {
+            logToConsole(LOG_DEBUG) << "Coefficient of x^" << i << ": " << function.coefficients.coefficients[i];
+        }
+    } else {
+        logToConsole(LOG_DEBUG) << "Compiled to " << function.program.size() << " instructions.";
+    }
+
+    //Only use as many points as it takes to get the curve right to within SAMPLING_TOLERANCE steps.
+    ArrayOfPoints arrayOfPoints = createArrayOfAdaptivePolynomialPoints(function, xMax, yMin, yMax, xMin,
+                                                                        SAMPLING_TOLERANCE);
+    freeCompiledExpression(function);
+    if (arrayOfPoints.points == nullptr) {
+        logToConsole(LOG_ERROR) << "Error, the window is empty.";
+        return false;
+    }
+
+    //Get rid of the points that don't change the line by more than SIMPLIFY_TOLERANCE steps.
+    *points = simplifyPoints(arrayOfPoints, SIMPLIFY_TOLERANCE, simplificationReport);
+    delete[] arrayOfPoints.points;
+    logToConsole(LOG_INFO) << "Simplified: removed " << simplificationReport->pointsRemoved << " points ("
+                           << simplificationReport->pointsBefore << " -> " << simplificationReport->pointsAfter
+                           << "), saving about " << simplificationReport->timeBefore - simplificationReport->timeAfter
+                           << "s.";
+    return true;
+}
+
+void logStatisticalData(StatisticalData statisticalData, SimplificationReport simplificationReport) {
+    logToFile() << "Statistical Data: ";
+    logToFile() << "Length of function: " << (statisticalData.lengthOfFunction* 0.2278) / 10.0 << "cm";
+    logToFile() << "Length of time to draw function: " << statisticalData.lengthOfTime << "s";
+    logToFile() << "Time spent going to zero: " << statisticalData.homingTime << "s";
+    logToFile() << "Line drawing Speed: "
+                << ((statisticalData.lengthOfFunction* 0.2278) / 10.0) / statisticalData.lengthOfTime << "cm/s";
+    logToFile() << "Pen up travel in order: " << (statisticalData.penUpTravelBefore * 0.2278) / 10.0 << "cm";
+    logToFile() << "Pen up travel optimized: " << (statisticalData.penUpTravelAfter * 0.2278) / 10.0 << "cm";
+    logToFile() << "Pen lifts: " << statisticalData.penLifts;
+    logToFile() << "Points removed by simplifying: " << simplificationReport.pointsRemoved;
+    logToFile() << "Time saved by simplifying: " << simplificationReport.timeBefore - simplificationReport.timeAfter
+                << "s";
+}
+
+void setupPlotter() {
+    logToConsole(LOG_INFO) << "Did you remember to set uart1 to gpio?";
+
+    requestGPIOAndSetDirectionOutput(X_AXIS_DIRECTION_GPIO);
+    requestGPIOAndSetDirectionOutput(X_AXIS_STEP_GPIO);
+    requestGPIOAndSetDirectionOutput(Y_AXIS_DIRECTION_GPIO);
+    requestGPIOAndSetDirectionOutput(Y_AXIS_STEP_GPIO);
+
+    requestGPIOAndSetDirectionInput(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+    requestGPIOAndSetDirectionInput(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
+    requestGPIOAndSetDirectionInput(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+    requestGPIOAndSetDirectionInput(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
+
+    openLogFile(LOG_FILE_NAME);
+
+    //The simulated plotter doesn't have any edges to watch or a real time deadline to miss, and its pen is always the
+    //mock one, so it just reads its limit switches every step.
+    if (simulatingHardware) {
+        pwmBackend.open(SERVO_PIN);
+        return;
+    }
+
+    lockMemory();
+
+    //Until this run finishes properly, nobody can trust where it leaves the plotter.
+    if (unlink(HOME_STATE_FILE_NAME) != 0 && errno != ENOENT) {
+        logSystemError("setupPlotter");
+    }
+
+    //If the edges can't be set up, stepping just goes back to reading the limit switches every step.
+    startLimitSwitchMonitor(SYSFS_LIMIT_EDGE_SOURCE);
+    openPWM(SERVO_PIN);
+}
+
+void shutdownPlotter() {
+    if (simulatingHardware) {
+        logToFile() << "Simulated time: " << hardwareSeconds() << "s";
+        logToFile() << "Simulated steps: " << simulatedStepTrace.size();
+        logToFile() << "Simulated limit switch crashes: " << simulatedLimitCrashes;
+        if (writeSimulatedStepTrace(SIMULATED_TRACE_FILE_NAME)) {
+            logToConsole(LOG_INFO) << "Wrote the simulated step trace to " << SIMULATED_TRACE_FILE_NAME;
+        }
+    } else if (positionTrusted) {
+        saveHomeState();
+    }
+    closeLogFile();
+
+    closePWM(SERVO_PIN);
+    stopLimitSwitchMonitor();
+
+    logToConsole(LOG_DEBUG) << "Free GPIOs that are Outputs: ";
+    freeGPIO(X_AXIS_DIRECTION_GPIO);
+    freeGPIO(X_AXIS_STEP_GPIO);
+    freeGPIO(Y_AXIS_DIRECTION_GPIO);
+    freeGPIO(Y_AXIS_STEP_GPIO);
+
+    logToConsole(LOG_DEBUG) << "Free GPIOs that are Inputs: ";
+    freeGPIO(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+    freeGPIO(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
+    freeGPIO(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
+    freeGPIO(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
+}
+
+//The job file has one curve per line: <"f(x)"> <xMin> <xMax> <yMin> <yMax>
+//Blank lines and lines starting with # get skipped.
+//Every curve gets planned before anything moves, so a bad line doesn't leave a half drawn sheet.
+bool loadBatchJob(const char filename[], std::vector<std::string> *expressions, std::vector<ArrayOfPoints> *curves,
+                  std::vector<SimplificationReport> *simplificationReports) {
+    std::ifstream jobFile(filename);
+    if (!jobFile.is_open()) {
+        logSystemError("loadBatchJob");
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(jobFile, line)) {
+        lineNumber++;
+        std::istringstream fields(line);
+        std::string expression;
+        float xMin, xMax, yMin, yMax;
+        if (!(fields >> expression) || expression[0] == '#') {
+            continue;
+        }
+        //The expression can have quotes around it, like it does on the command line, and then it can have spaces.
+        std::string word;
+        while (expression[0] == '"' && (expression.size() == 1 || expression[expression.size() - 1] != '"') &&
+               fields >> word) {
+            expression += " " + word;
+        }
+        if (expression.size() > 1 && expression[0] == '"' && expression[expression.size() - 1] == '"') {
+            expression = expression.substr(1, expression.size() - 2);
+        }
+        bool failed = false;
+        if (!(fields >> xMin >> xMax >> yMin >> yMax)) {
+            logToConsole(LOG_ERROR) << "Error on line " << lineNumber << " of " << filename << ": expected "
+                                    << "<\"f(x)\"> <xMin> <xMax> <yMin> <yMax>";
+            failed = true;
+        }
+
+        ArrayOfPoints points;
+        SimplificationReport simplificationReport;
+        if (!failed && !planCurve(expression.c_str(), xMin, xMax, yMin, yMax, &points, &simplificationReport)) {
+            logToConsole(LOG_ERROR) << "Error on line " << lineNumber << " of " << filename << ".";
+            failed = true;
+        }
+        if (failed) {
+            for (size_t i = 0; i < curves->size(); i++) {
+                delete[] (*curves)[i].points;
+            }
+            curves->clear();
+            return false;
+        }
+        expressions->push_back(expression);
+        curves->push_back(points);
+        simplificationReports->push_back(simplificationReport);
+    }
+    return true;
+}
+
+int runBatchJob(const char filename[]) {
+    std::vector<std::string> expressions;
+    std::vector<ArrayOfPoints> curves;
+    std::vector<SimplificationReport> simplificationReports;
+    if (!loadBatchJob(filename, &expressions, &curves, &simplificationReports)) {
+        return 1;
+    }
+    if (curves.empty()) {
+        return 0;
+    }
+
+    setupPlotter();
+
+    double sessionStart = hardwareSeconds();
+    StatisticalData total;
+    total.lengthOfFunction = 0;
+    total.lengthOfTime = 0;
+    total.penUpTravelBefore = 0;
+    total.penUpTravelAfter = 0;
+    total.penLifts = 0;
+    total.homingTime = 0;
+    SimplificationReport totalSimplification;
+    totalSimplification.pointsBefore = 0;
+    totalSimplification.pointsAfter = 0;
+    totalSimplification.pointsRemoved = 0;
+    totalSimplification.timeBefore = 0;
+    totalSimplification.timeAfter = 0;
+
+    logToFile() << "X-Y Plotter Log File:";
+    logToFile() << "Batch job: " << filename << " (" << curves.size() << " curves)" << "\n";
+    for (size_t i = 0; i < curves.size(); i++) {
+        //Only the first curve needs to go to zero (if that), after that we know where we are.
+        bool homeFirst = i == 0 && !positionTrusted;
+        PlotEstimate estimate = estimatePlot(curves[i], homeFirst);
+        StatisticalData statisticalData = drawPolynomial(curves[i], homeFirst);
+        if (!positionTrusted) {
+            //Without knowing where the plotter is (because going to zero failed, or a limit switch stopped a curve),
+            //none of the rest of the curves can be drawn.
+            for (size_t j = i; j < curves.size(); j++) {
+                delete[] curves[j].points;
+            }
+            shutdownPlotter();
+            return 1;
+        }
+
+        logToFile() << "Curve " << i + 1 << ": " << expressions[i];
+        logStatisticalData(statisticalData, simplificationReports[i]);
+        logPlotEstimateComparison(estimate, statisticalData);
+        logToFile() << "";
+
+        total.lengthOfFunction += statisticalData.lengthOfFunction;
+        total.lengthOfTime += statisticalData.lengthOfTime;
+        total.penUpTravelBefore += statisticalData.penUpTravelBefore;
+        total.penUpTravelAfter += statisticalData.penUpTravelAfter;
+        total.penLifts += statisticalData.penLifts;
+        total.homingTime += statisticalData.homingTime;
+        totalSimplification.pointsBefore += simplificationReports[i].pointsBefore;
+        totalSimplification.pointsAfter += simplificationReports[i].pointsAfter;
+        totalSimplification.pointsRemoved += simplificationReports[i].pointsRemoved;
+        totalSimplification.timeBefore += simplificationReports[i].timeBefore;
+        totalSimplification.timeAfter += simplificationReports[i].timeAfter;
+        delete[] curves[i].points;
+    }
+
+    logToFile() << "Total for all " << curves.size() << " curves:";
+    logStatisticalData(total, totalSimplification);
+    logToFile() << "Length of the whole session: " << hardwareSeconds() - sessionStart << "s";
+    logStepTimingStatistics();
+    logToFile() << "";
+
+    if (recordStepTrace) {
+        logToFile() << "Step trace (tick: stepX, stepY -> (x, y) tickTime): ";
+        writeStepTrace();
+        logToFile() << "";
+    }
+
+    shutdownPlotter();
+    return 0;
+}
+
+int runGcodeJob(const char filename[]) {
+    int file = STDIN_FILENO;
+    if (strcmp(filename, "-") != 0) {
+        file = open(filename, O_RDONLY);
+        if (file < 0) {
+            logSystemError("runGcodeJob");
+            return 1;
+        }
+    }
+
+    setupPlotter();
+    long linesRead = 0;
+    bool succeeded = false;
+    StatisticalData statisticalData = drawGcode(file, &linesRead, &succeeded);
+    SimplificationReport simplificationReport;
+    simplificationReport.pointsBefore = 0;
+    simplificationReport.pointsAfter = 0;
+    simplificationReport.pointsRemoved = 0;
+    simplificationReport.timeBefore = 0;
+    simplificationReport.timeAfter = 0;
+    logToFile() << "X-Y Plotter Log File:";
+    logToFile() << "G-code from " << (file == STDIN_FILENO ? "stdin" : filename) << " (" << linesRead << " lines)";
+    logStatisticalData(statisticalData, simplificationReport);
+    logStepTimingStatistics();
+    logToFile() << "";
+    shutdownPlotter();
+
+    if (file != STDIN_FILENO) {
+        close(file);
+    }
+    return succeeded ? 0 : 1;
+}
+
+StatisticalData drawGcode(int file, long *linesRead, bool *succeeded) {
+    StatisticalData statisticalData;
+    statisticalData.lengthOfFunction = 0;
+    statisticalData.lengthOfTime = 0;
+    statisticalData.penUpTravelBefore = 0;
+    statisticalData.penUpTravelAfter = 0;
+    statisticalData.penLifts = 0;
+    statisticalData.homingTime = 0;
+    *linesRead = 0;
+    *succeeded = false;
+
+    double startTime = hardwareSeconds();
+    liftPen();
+    statisticalData.homingTime = homeIfNeeded();
+    if (!positionTrusted) {
+        statisticalData.lengthOfTime = (float) (hardwareSeconds() - startTime);
+        return statisticalData;
+    }
+
+    StepQueue *queue = new StepQueue;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->stopped = false;
+    queue->homingTime = 0;
+
+    //G-code starts off in millimetres, absolute, G0 and with the pen up.
+    GcodeJob *job = new GcodeJob;
+    job->reader.file = file;
+    job->reader.start = 0;
+    job->reader.end = 0;
+    job->reader.endOfFile = false;
+    job->reader.lineNumber = 0;
+    startMotionPlanner(job->planner, currentX, currentY, pushMoveToStepQueue, queue);
+    startCurveFitter(job->fitter, &job->planner);
+    job->queue = queue;
+    job->motionMode = 0;
+    job->absolute = true;
+    job->absoluteArcCentres = false;
+    job->stepsPerUnit = GCODE_STEPS_PER_MM;
+    job->x = currentX;
+    job->y = currentY;
+    job->z = 1;
+    job->penDown = false;
+    job->ended = false;
+    job->failed = false;
+    job->penLifts = 0;
+    job->penUpTravel = 0;
+
+    float lengthDrawn = 0;
+    std::thread plannerThread(runGcodePlannerThread, job);
+    std::thread stepThread(runStepThread, queue, &lengthDrawn);
+    plannerThread.join();
+    stepThread.join();
+
+    statisticalData.lengthOfFunction = lengthDrawn;
+    statisticalData.penUpTravelBefore = job->penUpTravel;
+    statisticalData.penUpTravelAfter = job->penUpTravel;
+    statisticalData.penLifts = job->penLifts;
+    statisticalData.homingTime += queue->homingTime;
+    statisticalData.lengthOfTime = (float) (hardwareSeconds() - startTime);
+    *linesRead = job->reader.lineNumber;
+    *succeeded = !job->failed && !queue->stopped;
+    if (queue->stopped) {
+        logToConsole(LOG_ERROR) << "Error, the plotter had to stop, so the rest of the G-code didn't get drawn.";
+    }
+    delete job;
+    delete queue;
+    return statisticalData;
+}
+
+void runGcodePlannerThread(GcodeJob *job) {
+    char line[GCODE_MAX_LINE];
+    while (!job->ended && !job->queue->stopped) {
+        waitForGcodeLine(*job);
+        bool tooLong;
+        if (!readGcodeLine(job->reader, line, &tooLong)) {
+            break;
+        }
+        GcodeLine words;
+        std::string error;
+        if (tooLong) {
+            error = "it's too long";
+        }
+        if (tooLong || !parseGcodeLine(line, &words, &error) || !runGcodeLine(*job, words, &error)) {
+            logToConsole(LOG_ERROR) << "Error on line " << job->reader.lineNumber << " of the G-code: " << error
+                                    << ". Nothing after it gets drawn.";
+            job->failed = true;
+            break;
+        }
+    }
+    //Everything before a bad line still gets drawn (and stops properly), it's just the rest that doesn't.
+    finishCurveFitter(job->fitter);
+    finishMotionPlanner(job->planner);
+
+    StepCommand end;
+    end.endOfJob = true;
+    end.goHome = false;
+    pushStepCommand(*job->queue, end);
+}
+
+bool readGcodeLine(GcodeReader &reader, char line[], bool *tooLong) {
+    int length = 0;
+    bool readAnything = false;
+    *tooLong = false;
+    while (true) {
+        if (reader.start == reader.end) {
+            if (reader.endOfFile) {
+                //The last line doesn't have to end with a newline.
+                if (!readAnything) {
+                    return false;
+                }
+                break;
+            }
+            ssize_t bytesRead = read(reader.file, reader.buffer, GCODE_BUFFER_SIZE);
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead <= 0) {
+                if (bytesRead < 0) {
+                    logSystemError("readGcodeLine");
                 }
+                reader.endOfFile = true;
+                continue;
+            }
+            reader.start = 0;
+            reader.end = (int) bytesRead;
+        }
+        char character = reader.buffer[reader.start++];
+        readAnything = true;
+        if (character == '\n') {
+            break;
+        }
+        if (length < GCODE_MAX_LINE - 1) {
+            line[length++] = character;
+        } else {
+            *tooLong = true;
+        }
+    }
+    line[length] = '\0';
+    reader.lineNumber++;
+    return true;
+}
+
+bool gcodeLineReady(GcodeReader &reader) {
+    if (reader.endOfFile || memchr(reader.buffer + reader.start, '\n', reader.end - reader.start) != NULL) {
+        return true;
+    }
+    struct pollfd input;
+    input.fd = reader.file;
+    input.events = POLLIN;
+    return poll(&input, 1, 0) > 0;
+}
+
+//The step thread has run out once the queue is empty, since it's already taken the move it's doing out. Sending
+//everything then still leaves the rest of that move for the planned moves to get into the queue.
+void waitForGcodeLine(GcodeJob &job) {
+    while (!gcodeLineReady(job.reader)) {
+        if (job.queue->head.load(std::memory_order_acquire) == job.queue->tail.load(std::memory_order_relaxed)) {
+            flushGcodePlanner(job);
+            return;
+        }
+        struct pollfd input;
+        input.fd = job.reader.file;
+        input.events = POLLIN;
+        poll(&input, 1, GCODE_POLL_WAIT);
+    }
+}
+
+//Spaces, line numbers (N), % and block deletes (/) get skipped, and (comments), ; comments and *checksums are all
+//ignored. Letters can be either case.
+bool parseGcodeLine(const char line[], GcodeLine *words, std::string *error) {
+    words->numGCodes = 0;
+    words->numMCodes = 0;
+    for (int i = 0; i < 26; i++) {
+        words->has[i] = false;
+    }
+
+    const char *text = line;
+    while (*text != '\0' && *text != ';' && *text != '*') {
+        char character = *text;
+        if (isspace((unsigned char) character) || character == '%' || character == '/') {
+            text++;
+            continue;
+        }
+        if (character == '(') {
+            text = strchr(text, ')');
+            if (text == NULL) {
+                *error = "a comment isn't closed";
+                return false;
+            }
+            text++;
+            continue;
+        }
+        if (!isalpha((unsigned char) character)) {
+            *error = std::string("didn't expect '") + character + "'";
+            return false;
+        }
+
+        char letter = (char) toupper((unsigned char) character);
+        text++;
+        while (*text == ' ' || *text == '\t') {
+            text++;
+        }
+        double value;
+        if (!parseGcodeNumber(&text, &value)) {
+            *error = std::string("expected a number after ") + letter;
+            return false;
+        }
+        if (letter == 'G' || letter == 'M') {
+            int *codes = letter == 'G' ? words->gCodes : words->mCodes;
+            int *numCodes = letter == 'G' ? &words->numGCodes : &words->numMCodes;
+            if (*numCodes == GCODE_MAX_CODES) {
+                *error = std::string("too many ") + letter + " codes";
+                return false;
+            }
+            codes[(*numCodes)++] = (int) lround(value * 10);
+        } else if (letter != 'N') {
+            if (words->has[letter - 'A']) {
+                *error = std::string("there's more than one ") + letter;
                 return false;
             }
+            words->has[letter - 'A'] = true;
+            words->values[letter - 'A'] = value;
+        }
+    }
+    return true;
+}
 
-            //set directionGPIO to GND, because HIGH is CCW.
-            gpio_set_value(dirGPIO, 0);
-            break;
+bool parseGcodeNumber(const char **text, double *value) {
+    const char *character = *text;
+    double sign = 1;
+    if (*character == '+' || *character == '-') {
+        sign = *character == '-' ? -1 : 1;
+        character++;
+    }
+    //All the digits go into one whole number, and then it gets divided down, so 0.1 comes out as close as it can be.
+    double digits = 0;
+    int numDigits = 0;
+    int decimals = 0;
+    bool afterPoint = false;
+    while (isdigit((unsigned char) *character) || (*character == '.' && !afterPoint)) {
+        if (*character == '.') {
+            afterPoint = true;
+        } else {
+            digits = digits * 10 + (*character - '0');
+            numDigits++;
+            decimals += afterPoint;
+        }
+        character++;
     }
-
-    //sleep for a few more milliseconds, because this function will probably
-    //be called consecutively all the time with no breaks.
-    //We also need to allow time for the direction pin to charge up.
-    usleep(stepTime);
-
-    //pulse step on:
-    gpio_set_value(stepGPIO, 1);
-    //sleep for a few milliseconds, because you need to let the coils charge etc.
-    usleep(stepTime);
-    //pull step to GND, because its GND activated:
-    gpio_set_value(stepGPIO, 0);
+    if (numDigits == 0) {
+        return false;
+    }
+    *value = sign * digits / pow(10, decimals);
+    *text = character;
     return true;
 }
 
-StatisticalData drawPolynomial(ArrayOfPoints points) {
-
-    StatisticalData statisticalData;
-    statisticalData.lengthOfFunction = 0;
-
-    time_t t = time(0);   // get time now
-    struct tm *now = localtime(&t);
-
-    //Get the time relative to the hour of the day. That should be good enough.
-    statisticalData.lengthOfTime = (now->tm_hour * 60 * 60) + (now->tm_min * 60) + (now->tm_sec);
-
-    //First of all, lift the pen, and go to zero!
-    liftPen();
-    gotoZero();
-    //Print everything out human readable:
-    for (int i = 0; i < points.numPoints; i++) {
-        std::cout << "Point " << i + 1 << ": (" << points.points[i].x << ", " << points.points[i].y << ")" << std::endl;
+//Everything on the line happens in this order: the modes (units, absolute or relative, and which motion), the pen (M
+//codes and then Z), and then G28 or the move. F, S, T and P don't change anything: moves always go as fast as the
+//planner lets them.
+bool runGcodeLine(GcodeJob &job, const GcodeLine &words, std::string *error) {
+    bool home = false;
+    for (int i = 0; i < words.numGCodes; i++) {
+        int code = words.gCodes[i];
+        if (code == 0 || code == 10 || code == 20 || code == 30) {
+            job.motionMode = code / 10;
+        } else if (code == 200) {
+            job.stepsPerUnit = 25.4 * GCODE_STEPS_PER_MM;
+        } else if (code == 210) {
+            job.stepsPerUnit = GCODE_STEPS_PER_MM;
+        } else if (code == 900) {
+            job.absolute = true;
+        } else if (code == 910) {
+            job.absolute = false;
+        } else if (code == 901) {
+            job.absoluteArcCentres = true;
+        } else if (code == 911) {
+            job.absoluteArcCentres = false;
+        } else if (code == 280) {
+            home = true;
+        } else if (code != 40 && code != 170 && code != 540 && code != 940) {
+            //G4 (dwell) doesn't have to do anything since the pen already waits for the servo, and the others are
+            //modes it's always in anyway (the XY plane, G54, feed per minute).
+            logToConsole(LOG_WARNING) << "Line " << job.reader.lineNumber << " of the G-code: G" << code / 10.0
+                                      << " isn't supported, so it got ignored.";
+        }
     }
 
-    gotoZero();
-    std::cout << std::endl;
-    bool liftedPen = true;
-    bool gotToValidPoint = false;
-    for (int i = 0; i < points.numPoints; i++) {
-        std::cout << "Going to point: (" << (int) points.points[i].x << ", " << (int) points.points[i].y << ")"
-                  << std::endl;
-        if (!std::isnan(points.points[i].y)) {
-            if (liftedPen && gotToValidPoint) {
-                lowerPen();
-                liftedPen = false;
-            }
-            statisticalData.lengthOfFunction += gotoPoint(points.points[i]);
-            gotToValidPoint = true;
+    for (int i = 0; i < words.numMCodes; i++) {
+        int code = words.mCodes[i];
+        if (code == 30 || code == 40) {
+            setGcodePen(job, true);
+        } else if (code == 50) {
+            setGcodePen(job, false);
+        } else if (code == 20 || code == 300) {
+            job.ended = true;
         } else {
-            if (liftedPen) {
-                liftPen();
-            }
-            liftedPen = true;
+            logToConsole(LOG_WARNING) << "Line " << job.reader.lineNumber << " of the G-code: M" << code / 10.0
+                                      << " isn't supported, so it got ignored.";
         }
     }
+    if (words.has['Z' - 'A']) {
+        job.z = (job.absolute ? 0 : job.z) + words.values['Z' - 'A'];
+        setGcodePen(job, job.z <= 0);
+    }
 
-    t = time(0);   // get time now
-    now = localtime(&t);
-
-    statisticalData.lengthOfTime = (((now->tm_hour * 60 * 60) + (now->tm_min * 60) + (now->tm_sec)) -
-                                    statisticalData.lengthOfTime);
+    //G28 with X or Y is meant to go through that point on the way, but the pen's up anyway, so it goes straight there.
+    if (home) {
+        gcodeHome(job);
+        return true;
+    }
+    bool hasX = words.has['X' - 'A'];
+    bool hasY = words.has['Y' - 'A'];
+    if (!hasX && !hasY) {
+        return true;
+    }
+    double x = job.x;
+    double y = job.y;
+    if (hasX) {
+        x = (job.absolute ? 0 : job.x) + words.values['X' - 'A'] * job.stepsPerUnit;
+    }
+    if (hasY) {
+        y = (job.absolute ? 0 : job.y) + words.values['Y' - 'A'] * job.stepsPerUnit;
+    }
+    if (job.motionMode < 2) {
+        return gcodeLineTo(job, x, y, error);
+    }
 
-    return statisticalData;
+    bool clockwise = job.motionMode == 2;
+    double centreX;
+    double centreY;
+    if (words.has['R' - 'A']) {
+        //This is how grbl does it: the centre is on the line halfway between the start and the end, h along it from
+        //the middle, and a negative radius means the long way around.
+        double dx = x - job.x;
+        double dy = y - job.y;
+        double radius = words.values['R' - 'A'] * job.stepsPerUnit;
+        double distance = sqrt(dx * dx + dy * dy);
+        if (distance == 0) {
+            *error = "an arc with R can't be a whole circle";
+            return false;
+        }
+        if (distance > 2 * fabs(radius) + 1) {
+            *error = "the radius is too small to get to the end of the arc";
+            return false;
+        }
+        double h = -sqrt(std::max(4 * radius * radius - distance * distance, 0.0)) / distance;
+        if (!clockwise) {
+            h = -h;
+        }
+        if (radius < 0) {
+            h = -h;
+        }
+        centreX = job.x + 0.5 * (dx - dy * h);
+        centreY = job.y + 0.5 * (dy + dx * h);
+    } else if (words.has['I' - 'A'] || words.has['J' - 'A']) {
+        centreX = (job.absoluteArcCentres ? 0 : job.x) +
+                  (words.has['I' - 'A'] ? words.values['I' - 'A'] * job.stepsPerUnit : 0);
+        centreY = (job.absoluteArcCentres ? 0 : job.y) +
+                  (words.has['J' - 'A'] ? words.values['J' - 'A'] * job.stepsPerUnit : 0);
+    } else {
+        *error = "G2 and G3 need I and J, or R";
+        return false;
+    }
+    return gcodeArcTo(job, x, y, centreX, centreY, clockwise, error);
 }
 
-void requestGPIOAndSetDirectionOutput(int gpio) {
-    int gpioRequest;
-    int gpioDirection;
-
-    // check if gpio is already requested
-    if ((gpioRequest = gpio_is_requested(gpio)) < 0) {
-        perror("gpio_is_requested");
-        throw std::exception();
+//Lowering the pen starts a run of points where the pen is (which doesn't move it), and lifting it ends the run.
+void setGcodePen(GcodeJob &job, bool down) {
+    if (down == job.penDown) {
+        return;
     }
-
-    // request the gpio
-    if (!gpioRequest) {
-        printf("> exporting gpio\n");
-        if ((gpioDirection = gpio_request(gpio, NULL)) < 0) {
-            perror("gpio_request");
-            throw std::exception();
-        }
+    job.penDown = down;
+    Point point;
+    point.x = (float) job.x;
+    point.y = down ? (float) job.y : NAN;
+    addPointToCurveFitter(job.fitter, point);
+    if (down) {
+        job.penLifts++;
     }
+}
 
-    // set to output direction:
-    printf("> setting to output\n");
-    if ((gpioDirection = gpio_direction_output(gpio, 0)) < 0) {
-        perror("gpio_direction_output");
+//A pen up move is a run with just one point in it, so it gets ended again straight away.
+bool gcodeLineTo(GcodeJob &job, double x, double y, std::string *error) {
+    if (!insidePlotter(x, y)) {
+        std::ostringstream message;
+        message << "(" << x << ", " << y << ") is off the plotter (that's in steps)";
+        *error = message.str();
+        return false;
     }
+    Point point;
+    point.x = (float) x;
+    point.y = (float) y;
+    addPointToCurveFitter(job.fitter, point);
+    if (!job.penDown) {
+        job.penUpTravel += (float) sqrt((x - job.x) * (x - job.x) + (y - job.y) * (y - job.y));
+        point.y = NAN;
+        addPointToCurveFitter(job.fitter, point);
+    }
+    job.x = x;
+    job.y = y;
+    return true;
 }
 
-void requestGPIOAndSetDirectionInput(int gpio) {
-    int gpioRequest;
-    int gpioDirection;
+//The arc goes straight to the planner as one or more arc moves, instead of getting chopped into lines and fitted again.
+//With chords it gets drawn as lines, just close enough to the arc to be within SAMPLING_TOLERANCE.
+bool gcodeArcTo(GcodeJob &job, double x, double y, double centreX, double centreY, bool clockwise,
+                std::string *error) {
+    double radius = sqrt((job.x - centreX) * (job.x - centreX) + (job.y - centreY) * (job.y - centreY));
+    double endRadius = sqrt((x - centreX) * (x - centreX) + (y - centreY) * (y - centreY));
+    if (fabs(endRadius - radius) > 0.5 + 0.001 * radius) {
+        *error = "the end of the arc isn't on the circle";
+        return false;
+    }
+    //An arc smaller than a step is just a line (or nothing, if it's a whole circle).
+    if (radius < 1 || !job.penDown) {
+        return gcodeLineTo(job, x, y, error);
+    }
 
-    // check if gpio is already requested
-    if ((gpioRequest = gpio_is_requested(gpio)) < 0) {
-        perror("gpio_is_requested");
-        throw std::exception();
+    //Like grbl, an arc that ends where it starts is a whole circle.
+    double startAngle = atan2(job.y - centreY, job.x - centreX);
+    double sweep = atan2(y - centreY, x - centreX) - startAngle;
+    if (clockwise && sweep >= -1e-6) {
+        sweep -= 2 * M_PI;
+    } else if (!clockwise && sweep <= 1e-6) {
+        sweep += 2 * M_PI;
     }
 
-    // request the gpio
-    if (!gpioRequest) {
-        printf("> exporting gpio\n");
-        if ((gpioDirection = gpio_request(gpio, NULL)) < 0) {
-            perror("gpio_request");
-            throw std::exception();
+    //The furthest the arc goes in any direction is either one of its ends, or where it crosses an axis.
+    bool inside = insidePlotter(x, y);
+    for (int i = 0; i < 4 && inside; i++) {
+        double angle = i * M_PI_2;
+        double along = fmod(clockwise ? startAngle - angle : angle - startAngle, 2 * M_PI);
+        if (along < 0) {
+            along += 2 * M_PI;
         }
+        if (along <= fabs(sweep)) {
+            inside = insidePlotter(centreX + radius * cos(angle), centreY + radius * sin(angle));
+        }
+    }
+    if (!inside) {
+        *error = "the arc goes off the plotter";
+        return false;
     }
 
-    // set to output direction:
-    printf("> setting to input\n");
-    if ((gpioDirection = gpio_direction_input(gpio)) < 0) {
-        perror("gpio_direction_input");
+    //No piece goes more than half way around, since a piece that ends where it started wouldn't be a move.
+    int numPieces = (int) ceil(fabs(sweep) / M_PI);
+    if (!fitCurves) {
+        double maxPieceSweep = 2 * acos(1 - std::min(SAMPLING_TOLERANCE / radius, 1.0));
+        numPieces = std::max(numPieces, (int) ceil(fabs(sweep) / maxPieceSweep));
+    }
+    finishCurveFitter(job.fitter);
+    for (int i = 1; i <= numPieces; i++) {
+        double angle = startAngle + sweep * i / numPieces;
+        Point end;
+        end.x = (float) (i == numPieces ? x : centreX + radius * cos(angle));
+        end.y = (float) (i == numPieces ? y : centreY + radius * sin(angle));
+        if (!fitCurves) {
+            addPointToCurveFitter(job.fitter, end);
+            continue;
+        }
+        CurvePrimitive curve;
+        curve.shape = CURVE_ARC;
+        curve.x[0] = centreX;
+        curve.y[0] = centreY;
+        curve.radius = radius;
+        curve.startAngle = startAngle + sweep * (i - 1) / numPieces;
+        curve.sweep = sweep / numPieces;
+        addCurveToMotionPlanner(job.planner, curve, end);
+    }
+    job.x = x;
+    job.y = y;
+    //The fitter starts a new run of points from the end of the arc.
+    if (fitCurves) {
+        Point end;
+        end.x = (float) x;
+        end.y = (float) y;
+        addPointToCurveFitter(job.fitter, end);
     }
+    return true;
 }
 
-void freeGPIO(int gpio) {
-    if (gpio_free(gpio) < 0) {
-        perror("freeGPIO had an error.\n");
+//The move to (0, 0) gets planned like any other pen up move (so it's at full speed), and has to be finished before the
+//go home command, so the step thread gets there first.
+void gcodeHome(GcodeJob &job) {
+    bool penWasDown = job.penDown;
+    setGcodePen(job, false);
+    std::string error;
+    gcodeLineTo(job, 0, 0, &error);
+    flushGcodePlanner(job);
+    StepCommand command;
+    command.endOfJob = false;
+    command.goHome = true;
+    pushStepCommand(*job.queue, command);
+    setGcodePen(job, penWasDown);
+}
+
+void flushGcodePlanner(GcodeJob &job) {
+    finishCurveFitter(job.fitter);
+    finishMotionPlanner(job.planner);
+    //The fitter needs to know where the pen is to carry on the run from there.
+    if (job.penDown) {
+        Point point;
+        point.x = (float) job.x;
+        point.y = (float) job.y;
+        addPointToCurveFitter(job.fitter, point);
     }
 }
 
-float gotoPoint(int x, int y) {
-    int oldX = currentX; // OldX is the original y-coordinate of the motor
-    int oldY = currentY; // OldY is the original y-coordinate of the motor
-    float masterslope = ((float) y - (float) oldY) / ((float) x -
-                                                      (float) oldX); // This slope is the slope that we're always checking with.  Eqn of slope is (y2-y1)/(x2-x1
-    float currentslope = ((float) y - (float) currentY) /
-                         ((float) x - (float) currentX); // This is the slope that is recalculated with every new step.
-    Direction directionX; // Variable helps specify the direction that the motor will always be going, there could be a better way, but for now I have specified an individual direction for both the x and y
-    Direction directionY;
-    AXIS axis;
-    int changeofX;
-    int changeofY;
+//A point is on the plotter if the step it rounds to is.
+bool insidePlotter(double x, double y) {
+    return lround(x) >= 0 && lround(y) >= 0 && lround(x) <= X_MAX && lround(y) <= Y_MAX;
+}
 
-    if (x > currentX) { // This determines the original X-direction of the motor.
-        directionX = CW;
-        changeofX = 0;
-    } else if (x < currentX) {
-        directionX = CCW;
-        changeofX = 1;
+//Draws the curves on the simulated plotter from (0, 0), like it just went to zero, recording everything into the
+//stream, and then writes the stream to filename.
+int compileStepStream(const char filename[], const std::vector<ArrayOfPoints> &curves) {
+    useSimulatedHardware(0, 0);
+    pwmBackend.open(SERVO_PIN);
+    currentX = 0;
+    currentY = 0;
+
+    stepStreamRecords.clear();
+    stepStreamX = 0;
+    stepStreamY = 0;
+    stepStreamMinX = 0;
+    stepStreamMaxX = 0;
+    stepStreamMinY = 0;
+    stepStreamMaxY = 0;
+    stepStreamTicks = 0;
+    recordingStepStream = true;
+    double startTime = hardwareSeconds();
+    liftPen();
+    for (size_t i = 0; i < curves.size(); i++) {
+        drawPolynomial(curves[i], false);
     }
-
-    if (y > currentY) { // This determines the original Y-direction of the motor.
-        directionY = CW;
-        changeofY = 0;
-    } else if (y < currentY) {
-        directionY = CCW;
-        changeofY = 1;
+    double predictedTime = hardwareSeconds() - startTime;
+    recordingStepStream = false;
+    pwmBackend.close(SERVO_PIN);
+
+    StepStreamHeader header;
+    memcpy(header.magic, STEP_STREAM_MAGIC, sizeof(header.magic));
+    header.version = STEP_STREAM_VERSION;
+    header.numRecords = (uint32_t) stepStreamRecords.size();
+    header.checksum = stepStreamChecksum(stepStreamRecords.data(), header.numRecords);
+    header.minX = stepStreamMinX;
+    header.minY = stepStreamMinY;
+    header.maxX = stepStreamMaxX;
+    header.maxY = stepStreamMaxY;
+    header.endX = stepStreamX;
+    header.endY = stepStreamY;
+    header.numTicks = stepStreamTicks;
+    header.predictedMilliseconds = (uint32_t) (predictedTime * 1000);
+
+    FILE *streamFile = fopen(filename, "wb");
+    if (streamFile == nullptr) {
+        logSystemError("compileStepStream");
+        return 1;
     }
-
-    if (currentX == x && currentY == y) { // For the scenario of the (x,y) being a single point
-        return true;
+    bool wrote = fwrite(&header, sizeof(header), 1, streamFile) == 1 &&
+                 fwrite(stepStreamRecords.data(), sizeof(StepStreamRecord), stepStreamRecords.size(), streamFile) ==
+                 stepStreamRecords.size();
+    if (fclose(streamFile) != 0 || !wrote) {
+        logSystemError("compileStepStream");
+        return 1;
     }
 
-    if (currentX == x) { // For the scenario of the (x,y) resulting in a vertical line
-        while (currentY != y) {
-            axis = Y;
-            stepMotor(axis, directionY);
-            currentY = currentY + (-2 * changeofY + 1);
-        }
-        return true;
-    }
+    logToConsole(LOG_INFO) << "Compiled " << stepStreamTicks << " ticks into " << header.numRecords << " records ("
+                           << sizeof(header) + header.numRecords * sizeof(StepStreamRecord)
+                           << " bytes), which should take " << predictedTime << "s.";
+    stepStreamRecords.clear();
+    return 0;
+}
 
-    if (currentY == y) { // For the scenario of the (x,y) resulting in a horizontal line
-        while (currentX != x) {
-            axis = X;
-            stepMotor(axis, directionX);
-            currentX = currentX + (-2 * changeofX + 1);
+//Ticks that are exactly the same as the last one just make the last record longer.
+void recordStepStreamTick(int stepX, int stepY, int stepTime) {
+    stepStreamX += stepX;
+    stepStreamY += stepY;
+    stepStreamMinX = std::min(stepStreamMinX, stepStreamX);
+    stepStreamMaxX = std::max(stepStreamMaxX, stepStreamX);
+    stepStreamMinY = std::min(stepStreamMinY, stepStreamY);
+    stepStreamMaxY = std::max(stepStreamMaxY, stepStreamY);
+    stepStreamTicks++;
+
+    if (!stepStreamRecords.empty()) {
+        StepStreamRecord &last = stepStreamRecords.back();
+        if (last.type == STEP_STREAM_STEPS && last.stepX == stepX && last.stepY == stepY &&
+            last.stepTime == stepTime && last.count < STEP_STREAM_MAX_COUNT) {
+            last.count++;
+            return;
         }
-        return true;
     }
+    StepStreamRecord record;
+    record.type = STEP_STREAM_STEPS;
+    record.stepX = (int8_t) stepX;
+    record.stepY = (int8_t) stepY;
+    record.unused = 0;
+    record.count = 1;
+    record.stepTime = (uint16_t) stepTime;
+    stepStreamRecords.push_back(record);
+}
 
-    while (x != currentX || y != currentY) {
+void recordStepStreamPen(bool penDown) {
+    StepStreamRecord record;
+    record.type = penDown ? STEP_STREAM_PEN_DOWN : STEP_STREAM_PEN_UP;
+    record.stepX = 0;
+    record.stepY = 0;
+    record.unused = 0;
+    record.count = 0;
+    record.stepTime = 0;
+    stepStreamRecords.push_back(record);
+}
+
+uint32_t stepStreamChecksum(const StepStreamRecord *records, uint32_t numRecords) {
+    const unsigned char *bytes = (const unsigned char *) records;
+    size_t numBytes = (size_t) numRecords * sizeof(StepStreamRecord);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < numBytes; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-        while (currentslope >= (masterslope - SLOPE_PRECISION) && currentslope <= (masterslope + SLOPE_PRECISION) &&
-               x !=
-               currentX) { // I think this is right.  Exits loop when the currentslope decreases past a critical point.  Should specifiy this while loop is for the X increases
-            axis = X;
-            stepMotor(axis, directionX); // This should make one xs - step towards the desired point.
-            currentX = currentX + (-2 * changeofX +
-                                   1); // The new currentX location. The "-2*directionX + 1" is the way I can determine whether it increases or decreases. lol its jokes
-            currentslope = ((float) y - (float) currentY) / ((float) x - (float) currentX);
+//The box, the end and the tick count all get worked out again from the records, the same way recordStepStreamTick
+//did, and have to match the header, since the header is all that gets checked against the plotter's limits.
+const char *checkStepStreamRecords(const StepStreamHeader &header, const StepStreamRecord *records) {
+    int x = 0;
+    int y = 0;
+    int minX = 0;
+    int maxX = 0;
+    int minY = 0;
+    int maxY = 0;
+    uint64_t numTicks = 0;
+    for (uint32_t i = 0; i < header.numRecords; i++) {
+        const StepStreamRecord &record = records[i];
+        if (record.type == STEP_STREAM_PEN_UP || record.type == STEP_STREAM_PEN_DOWN) {
+            continue;
         }
-        while (currentslope < (masterslope - SLOPE_PRECISION) || currentslope > (masterslope +
-                                                                                 SLOPE_PRECISION)) { // I think this is right.  Exits loop when the currentslope decreases past a critical point.  Should specifiy this while loop is for the Y increases
-            axis = Y;
-            stepMotor(axis, directionY); // This should make one Y-step towards the desired point.
-            currentY = currentY + (-2 * changeofY +
-                                   1); // The new currentY location. The "-2*directionY + 1" is the way I can determine whether it increases or decreases. lol its jokes
-            currentslope = ((float) y - (float) currentY) / ((float) x - (float) currentX);
+        if (record.type != STEP_STREAM_STEPS) {
+            return "it has a record that isn't steps or a pen change";
         }
-
+        if (record.stepX < -1 || record.stepX > 1 || record.stepY < -1 || record.stepY > 1) {
+            return "it has a step that isn't -1, 0 or 1";
+        }
+        if (2 * record.stepTime < STEP_PULSE_TIME + MIN_STEP_LOW_TIME) {
+            return "it has ticks too short for a whole step pulse";
+        }
+        //Every tick in a record goes the same way, so the ends of it are as far as it gets.
+        x += record.stepX * record.count;
+        y += record.stepY * record.count;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        numTicks += record.count;
     }
+    if (minX != header.minX || minY != header.minY || maxX != header.maxX || maxY != header.maxY) {
+        return "the records go outside of the box in the header";
+    }
+    if (x != header.endX || y != header.endY) {
+        return "the records don't end where the header says";
+    }
+    if (numTicks != header.numTicks) {
+        return "the records don't have as many ticks as the header says";
+    }
+    return nullptr;
+}
 
-
-    return true;
+PlotEstimate estimatePlot(ArrayOfPoints points, bool homeFirst) {
+    PlotterState *savedState = new PlotterState;
+    savePlotterState(savedState);
+    //Only errors get printed while it's drawing, since none of it is really happening.
+    LogLevel savedLogLevel = consoleLogLevel;
+    consoleLogLevel = LOG_ERROR;
+    bool savedMeasuringLatencies = measuringLatencies;
+    measuringLatencies = false;
+
+    if (homeFirst) {
+        useSimulatedHardware((int) X_MAX, (int) Y_MAX);
+    } else {
+        useSimulatedHardware(currentX, currentY);
+    }
+    recordStepTrace = false;
+    pwmBackend.open(SERVO_PIN);
+
+    PlotEstimate estimate;
+    estimate.homingTime = 0;
+    if (homeFirst) {
+        liftPen();
+        gotoZero();
+        estimate.homingTime = (float) hardwareSeconds();
+    }
+    StatisticalData statisticalData = drawPolynomial(points, false);
+    estimate.time = (float) hardwareSeconds();
+    estimate.lengthOfFunction = statisticalData.lengthOfFunction;
+    estimate.steps = (int) simulatedStepTrace.size();
+    estimate.directionChanges = simulatedDirectionChanges;
+    estimate.penLifts = statisticalData.penLifts;
+    //Every mock PWM set is the pen moving, and each one waits SERVO_CHANGE_TIME.
+    estimate.penTime = mockPWMSetCount * (SERVO_CHANGE_TIME / 1e6f);
+    estimate.endX = currentX;
+    estimate.endY = currentY;
+    pwmBackend.close(SERVO_PIN);
+
+    consoleLogLevel = savedLogLevel;
+    measuringLatencies = savedMeasuringLatencies;
+    restorePlotterState(*savedState);
+    delete savedState;
+    return estimate;
 }
 
-float gotoPoint(Point point) {
-    int oldX = currentX; // OldX is the original y-coordinate of the motor
-    int oldY = currentY; // OldY is the original y-coordinate of the motor
+void savePlotterState(PlotterState *state) {
+    state->hardware = hardware;
+    state->pwmBackend = pwmBackend;
+    state->simulatingHardware = simulatingHardware;
+    state->xAxis = xAxis;
+    state->yAxis = yAxis;
+    state->currentX = currentX;
+    state->currentY = currentY;
+    state->positionTrusted = positionTrusted;
+    state->stepDeadline = stepDeadline;
+    state->stepTimingStatistics = stepTimingStatistics;
+    state->recordStepTrace = recordStepTrace;
+    memcpy(state->simulatedGPIORequested, simulatedGPIORequested, sizeof(simulatedGPIORequested));
+    memcpy(state->simulatedGPIOLevels, simulatedGPIOLevels, sizeof(simulatedGPIOLevels));
+    state->simulatedX = simulatedX;
+    state->simulatedY = simulatedY;
+    state->simulatedLimitCrashes = simulatedLimitCrashes;
+    state->simulatedDirectionChanges = simulatedDirectionChanges;
+    state->simulatedClock = simulatedClock;
+    state->simulatedStepTrace.swap(simulatedStepTrace);
+    state->mockPWMGpio = mockPWMGpio;
+    state->mockPWMSetCount = mockPWMSetCount;
+    state->mockPWMStopCount = mockPWMStopCount;
+    state->mockPWMFrequency = mockPWMFrequency;
+    state->mockPWMDutyCycle = mockPWMDutyCycle;
+}
 
-    float dx = point.x - oldX;
-    float dy = point.y - oldY;
+void restorePlotterState(PlotterState &state) {
+    hardware = state.hardware;
+    pwmBackend = state.pwmBackend;
+    simulatingHardware = state.simulatingHardware;
+    xAxis = state.xAxis;
+    yAxis = state.yAxis;
+    currentX = state.currentX;
+    currentY = state.currentY;
+    positionTrusted = state.positionTrusted;
+    stepDeadline = state.stepDeadline;
+    stepTimingStatistics = state.stepTimingStatistics;
+    recordStepTrace = state.recordStepTrace;
+    memcpy(simulatedGPIORequested, state.simulatedGPIORequested, sizeof(simulatedGPIORequested));
+    memcpy(simulatedGPIOLevels, state.simulatedGPIOLevels, sizeof(simulatedGPIOLevels));
+    simulatedX = state.simulatedX;
+    simulatedY = state.simulatedY;
+    simulatedLimitCrashes = state.simulatedLimitCrashes;
+    simulatedDirectionChanges = state.simulatedDirectionChanges;
+    simulatedClock = state.simulatedClock;
+    simulatedStepTrace.swap(state.simulatedStepTrace);
+    mockPWMGpio = state.mockPWMGpio;
+    mockPWMSetCount = state.mockPWMSetCount;
+    mockPWMStopCount = state.mockPWMStopCount;
+    mockPWMFrequency = state.mockPWMFrequency;
+    mockPWMDutyCycle = state.mockPWMDutyCycle;
+}
 
-    int x = currentX;
+void printPlotEstimate(const PlotEstimate &estimate) {
+    logToConsole(LOG_INFO) << "Estimated time: " << estimate.time << "s (" << estimate.homingTime << "s going to zero, "
+                           << estimate.penTime << "s moving the pen)";
+    logToConsole(LOG_INFO) << "Estimated length: " << (estimate.lengthOfFunction * 0.2278) / 10.0 << "cm";
+    logToConsole(LOG_INFO) << "Steps: " << estimate.steps << ", direction changes: " << estimate.directionChanges
+                           << ", pen lifts: " << estimate.penLifts;
+}
 
-    for (; x < point.x; x++) {
-        float y = (float) oldY + (float) dy * ((float) x - (float) oldX) / (float) dx;
-        gotoPointHelper(x, (int) y);
+void logPlotEstimateComparison(const PlotEstimate &estimate, StatisticalData statisticalData) {
+    float timeError = statisticalData.lengthOfTime - estimate.time;
+    float lengthError = statisticalData.lengthOfFunction - estimate.lengthOfFunction;
+    //A LogLine gets logged when it goes out of scope, so each of these needs its own.
+    {
+        LogLine estimatedTime = logToFile();
+        estimatedTime << "Estimated time: " << estimate.time << "s (";
+        if (estimate.homingTime > 0) {
+            estimatedTime << estimate.homingTime << "s going to zero from the far corner, ";
+        }
+        estimatedTime << estimate.penTime << "s moving the pen)";
     }
-
-    //Calculate distance using pythagorean theorem:
-    return (float) sqrt(pow(dx, 2) + pow(dy, 2));
+    {
+        LogLine measuredTime = logToFile();
+        measuredTime << "Measured time: " << statisticalData.lengthOfTime << "s, off by " << timeError << "s";
+        if (estimate.time > 0) {
+            measuredTime << " (" << 100 * timeError / estimate.time << "%)";
+        }
+    }
+    logToFile() << "Estimated length: " << (estimate.lengthOfFunction * 0.2278) / 10.0 << "cm, off by "
+                << (lengthError * 0.2278) / 10.0 << "cm";
+    logToFile() << "Estimated steps: " << estimate.steps << ", direction changes: " << estimate.directionChanges;
 }
 
-//This is a dumb goto point function that simply goes in the shape of an L to get to a point.
-//It's only going to be used for very small x or y increments.
-//Tested successfully.
-bool gotoPointHelper(const int x, const int y) {
-    Direction directionX; // Variable helps specify the direction that the motor will always be going, there could be a better way, but for now I have specified an individual direction for both the x and y
-    Direction directionY;
-    AXIS axis;
-    int changeofX;
-    int changeofY;
+//The first curve goes to zero first (unless the position is trusted), and the rest start where the one before left
+//off, like a batch job.
+int dryRun(const std::vector<ArrayOfPoints> &curves) {
+    int savedX = currentX;
+    int savedY = currentY;
+    PlotEstimate total;
+    total.time = 0;
+    total.homingTime = 0;
+    total.penTime = 0;
+    total.lengthOfFunction = 0;
+    total.steps = 0;
+    total.directionChanges = 0;
+    total.penLifts = 0;
+    for (size_t i = 0; i < curves.size(); i++) {
+        PlotEstimate estimate = estimatePlot(curves[i], i == 0 && !positionTrusted);
+        logToConsole(LOG_INFO) << "Curve " << i + 1 << ":";
+        printPlotEstimate(estimate);
+        total.time += estimate.time;
+        total.homingTime += estimate.homingTime;
+        total.penTime += estimate.penTime;
+        total.lengthOfFunction += estimate.lengthOfFunction;
+        total.steps += estimate.steps;
+        total.directionChanges += estimate.directionChanges;
+        total.penLifts += estimate.penLifts;
+
+        //The next curve starts where this one ended.
+        currentX = estimate.endX;
+        currentY = estimate.endY;
+    }
+    if (curves.size() > 1) {
+        logToConsole(LOG_INFO) << "Total for all " << curves.size() << " curves:";
+        printPlotEstimate(total);
+    }
+    currentX = savedX;
+    currentY = savedY;
+    return 0;
+}
 
-    if (x > currentX) { // This determines the original X-direction of the motor.
-        directionX = CW;
-        changeofX = 0;
-    } else if (x < currentX) {
-        directionX = CCW;
-        changeofX = 1;
+//Maps the stream file straight into memory (so there's no reading it in first), checks the header and then every
+//record, goes to zero, and then the step thread does every record in order.
+int replayStepStream(const char filename[]) {
+    int streamFile = open(filename, O_RDONLY);
+    if (streamFile < 0) {
+        logSystemError("replayStepStream");
+        return 1;
+    }
+    struct stat status;
+    if (fstat(streamFile, &status) != 0 || status.st_size < (off_t) sizeof(StepStreamHeader)) {
+        logToConsole(LOG_ERROR) << "Error, " << filename << " is too small to be a step stream.";
+        close(streamFile);
+        return 1;
+    }
+    size_t fileSize = (size_t) status.st_size;
+    void *mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, streamFile, 0);
+    close(streamFile);
+    if (mapping == MAP_FAILED) {
+        logSystemError("replayStepStream");
+        return 1;
+    }
+    madvise(mapping, fileSize, MADV_SEQUENTIAL);
+
+    const StepStreamHeader *header = (const StepStreamHeader *) mapping;
+    const StepStreamRecord *records = (const StepStreamRecord *) (header + 1);
+    const char *problem = nullptr;
+    if (memcmp(header->magic, STEP_STREAM_MAGIC, sizeof(header->magic)) != 0) {
+        problem = "it isn't a step stream";
+    } else if (header->version != STEP_STREAM_VERSION) {
+        problem = "it's from a different version";
+    } else if (fileSize != sizeof(StepStreamHeader) + (size_t) header->numRecords * sizeof(StepStreamRecord)) {
+        problem = "it's the wrong size";
+    } else if (stepStreamChecksum(records, header->numRecords) != header->checksum) {
+        problem = "the checksum is wrong";
+    } else if (header->minX < 0 || header->minY < 0 || header->maxX > X_MAX || header->maxY > Y_MAX) {
+        problem = "it goes outside of the plotter";
+    } else {
+        problem = checkStepStreamRecords(*header, records);
     }
+    if (problem != nullptr) {
+        logToConsole(LOG_ERROR) << "Error, can't replay " << filename << ": " << problem << ".";
+        munmap(mapping, fileSize);
+        return 1;
+    }
+
+    logToConsole(LOG_INFO) << "Replaying " << header->numTicks << " ticks, which should take "
+                           << header->predictedMilliseconds / 1000.0 << "s.";
+    setupPlotter();
+    liftPen();
 
-    if (y > currentY) { // This determines the original Y-direction of the motor.
-        directionY = CW;
-        changeofY = 0;
-    } else if (y < currentY) {
-        directionY = CCW;
-        changeofY = 1;
+    StatisticalData statisticalData;
+    statisticalData.lengthOfFunction = 0;
+    statisticalData.penUpTravelBefore = 0;
+    statisticalData.penUpTravelAfter = 0;
+    statisticalData.penLifts = 0;
+    //The stream starts at (0, 0), so if it didn't have to go to zero it still has to get back there.
+    double homingStart = hardwareSeconds();
+    homeIfNeeded();
+    if (!positionTrusted) {
+        munmap(mapping, fileSize);
+        shutdownPlotter();
+        return 1;
+    }
+    gotoPoint(0, 0);
+    statisticalData.homingTime = (float) (hardwareSeconds() - homingStart);
+    for (uint32_t i = 0; i < header->numRecords; i++) {
+        if (records[i].type == STEP_STREAM_PEN_DOWN) {
+            statisticalData.penLifts++;
+        }
     }
+    double startTime = hardwareSeconds();
+    float lengthDrawn = 0;
+    std::thread stepThread(runStepStreamThread, records, header->numRecords, &lengthDrawn);
+    stepThread.join();
+    statisticalData.lengthOfTime = (float) (hardwareSeconds() - startTime);
+    statisticalData.lengthOfFunction = lengthDrawn;
+
+    SimplificationReport simplificationReport;
+    simplificationReport.pointsBefore = 0;
+    simplificationReport.pointsAfter = 0;
+    simplificationReport.pointsRemoved = 0;
+    simplificationReport.timeBefore = 0;
+    simplificationReport.timeAfter = 0;
+    logToFile() << "X-Y Plotter Log File:";
+    logToFile() << "Replay of " << filename << " (" << header->numRecords << " records)";
+    logStatisticalData(statisticalData, simplificationReport);
+    logToFile() << "Predicted time: " << header->predictedMilliseconds / 1000.0 << "s";
+    logStepTimingStatistics();
+    logToFile() << "";
+
+    munmap(mapping, fileSize);
+    shutdownPlotter();
+    return 0;
+}
 
-    if (currentX == x && currentY == y) { // For the scenario of the (x,y) being a single point
-        return true;
+//If a limit switch stops a tick, the rest of the stream would be in the wrong place, so it stops the whole replay.
+void runStepStreamThread(const StepStreamRecord *records, uint32_t numRecords, float *lengthDrawn) {
+    neverWaitToLog = true;
+    if (!simulatingHardware) {
+        makeThisThreadRealTime();
     }
+    bool penIsDown = false;
+    *lengthDrawn = 0;
+    resetStepClock();
+    for (uint32_t i = 0; i < numRecords; i++) {
+        const StepStreamRecord &record = records[i];
+        if (record.type == STEP_STREAM_PEN_DOWN || record.type == STEP_STREAM_PEN_UP) {
+            penIsDown = record.type == STEP_STREAM_PEN_DOWN;
+            if (penIsDown) {
+                lowerPen();
+            } else {
+                liftPen();
+            }
+            //The pen takes a while, and that isn't part of the step timing.
+            resetStepClock();
+            continue;
+        }
 
-    if (currentX == x) { // For the scenario of the (x,y) resulting in a vertical line
-        while (currentY != y) {
-            axis = Y;
-            stepMotor(axis, directionY);
-            currentY = currentY + (-2 * changeofY + 1);
+        float tickLength = (record.stepX != 0 && record.stepY != 0) ? (float) M_SQRT2 : 1.0f;
+        for (int tick = 0; tick < record.count; tick++) {
+            if (!stepMotors(record.stepX, record.stepY, record.stepTime)) {
+                logToConsole(LOG_ERROR) << "A limit switch stopped the replay at (" << currentX << ", " << currentY
+                                        << ").";
+                if (penIsDown) {
+                    liftPen();
+                }
+                return;
+            }
+            currentX += record.stepX;
+            currentY += record.stepY;
+            if (penIsDown) {
+                *lengthDrawn += tickLength;
+            }
         }
-        return true;
     }
+    if (penIsDown) {
+        liftPen();
+    }
+}
 
-    if (currentY == y) { // For the scenario of the (x,y) resulting in a horizontal line
-        while (currentX != x) {
-            axis = X;
-            stepMotor(axis, directionX);
-            currentX = currentX + (-2 * changeofX + 1);
+//Every case starts from (0, 0) with the pen up, like it just went to zero, so homing isn't part of what gets measured.
+//Only errors get printed while a case runs, since printing isn't what's being benchmarked.
+int benchmarkPlotting(const char filename[]) {
+    std::ofstream output(filename);
+    if (!output.is_open()) {
+        logSystemError("benchmarkPlotting");
+        return 1;
+    }
+    LogLevel savedLogLevel = consoleLogLevel;
+
+    logToConsole(LOG_INFO) << "case, expression, cpu (s), steps, pen lifts, pen up travel (steps), predicted time (s)";
+    output << "{\n";
+    output << "  \"cases\": [\n";
+    double totalCpuTime = 0;
+    double totalPredictedTime = 0;
+    for (int i = 0; i < NUM_PLOT_BENCHMARK_CASES; i++) {
+        const PlotBenchmarkCase &benchmarkCase = PLOT_BENCHMARK_CORPUS[i];
+
+        useSimulatedHardware(0, 0);
+        pwmBackend.open(SERVO_PIN);
+        currentX = 0;
+        currentY = 0;
+
+        consoleLogLevel = LOG_ERROR;
+        double startCpuTime = cpuSeconds();
+        ArrayOfPoints points;
+        SimplificationReport simplificationReport;
+        bool planned = planCurve(benchmarkCase.expression, benchmarkCase.xMin, benchmarkCase.xMax, benchmarkCase.yMin,
+                                 benchmarkCase.yMax, &points, &simplificationReport);
+        double planCpuTime = cpuSeconds() - startCpuTime;
+        StatisticalData statisticalData;
+        statisticalData.lengthOfFunction = 0;
+        statisticalData.lengthOfTime = 0;
+        statisticalData.penUpTravelAfter = 0;
+        statisticalData.penLifts = 0;
+        statisticalData.homingTime = 0;
+        int numPoints = 0;
+        if (planned) {
+            numPoints = points.numPoints;
+            statisticalData = drawPolynomial(points, false);
         }
-        return true;
+        double cpuTime = cpuSeconds() - startCpuTime;
+        //The moves get counted by planning the points again from (0, 0), which isn't part of the timing. It's in the
+        //order they were planned in, not the order drawPolynomial drew them, but that hardly changes the count.
+        int numMoves = 0;
+        int numCurveMoves = 0;
+        if (planned) {
+            currentX = 0;
+            currentY = 0;
+            MotionPlan plan = planMotion(points);
+            numMoves = plan.numMoves;
+            for (int j = 0; j < plan.numMoves; j++) {
+                if (plan.moves[j].curve.shape != CURVE_LINE) {
+                    numCurveMoves++;
+                }
+            }
+            delete[] plan.moves;
+            delete[] points.points;
+        }
+        consoleLogLevel = savedLogLevel;
+        pwmBackend.close(SERVO_PIN);
+
+        totalCpuTime += cpuTime;
+        totalPredictedTime += statisticalData.lengthOfTime;
+        logToConsole(LOG_INFO) << i << ", " << benchmarkCase.expression << ", " << cpuTime << ", "
+                               << simulatedStepTrace.size() << ", " << statisticalData.penLifts << ", "
+                               << statisticalData.penUpTravelAfter << ", " << statisticalData.lengthOfTime;
+
+        output << "    {\n";
+        output << "      \"expression\": \"" << benchmarkCase.expression << "\",\n";
+        output << "      \"window\": [" << benchmarkCase.xMin << ", " << benchmarkCase.xMax << ", " << benchmarkCase.yMin
+               << ", " << benchmarkCase.yMax << "],\n";
+        output << "      \"ok\": " << (planned ? "true" : "false") << ",\n";
+        output << "      \"points\": " << numPoints << ",\n";
+        output << "      \"moves\": " << numMoves << ",\n";
+        output << "      \"curve_moves\": " << numCurveMoves << ",\n";
+        output << "      \"plan_cpu_seconds\": " << planCpuTime << ",\n";
+        output << "      \"cpu_seconds\": " << cpuTime << ",\n";
+        output << "      \"steps\": " << simulatedStepTrace.size() << ",\n";
+        output << "      \"pen_lifts\": " << statisticalData.penLifts << ",\n";
+        output << "      \"pen_up_travel_steps\": " << statisticalData.penUpTravelAfter << ",\n";
+        output << "      \"length_drawn_steps\": " << statisticalData.lengthOfFunction << ",\n";
+        output << "      \"predicted_seconds\": " << statisticalData.lengthOfTime << ",\n";
+        output << "      \"limit_switch_crashes\": " << simulatedLimitCrashes << "\n";
+        output << "    }" << (i + 1 < NUM_PLOT_BENCHMARK_CASES ? "," : "") << "\n";
     }
+    output << "  ],\n";
+    output << "  \"total_cpu_seconds\": " << totalCpuTime << ",\n";
+    output << "  \"total_predicted_seconds\": " << totalPredictedTime << "\n";
+    output << "}\n";
+
+    logToConsole(LOG_INFO) << "Wrote " << filename;
+    return 0;
+}
 
-    while (currentX != x) {
-        axis = X;
-        stepMotor(axis, directionX);
-        currentX = currentX + (-2 * changeofX + 1);
+int benchmarkPenCommands(int pairs) {
+    if (pairs <= 0) {
+        logToConsole(LOG_ERROR) << "Error, the number of pairs has to be more than 0.";
+        return 1;
     }
-    while (currentY != y) {
-        axis = Y;
-        stepMotor(axis, directionY);
-        currentY = currentY + (-2 * changeofY + 1);
+    useSimulatedHardware(0, 0);
+    pwmBackend.open(SERVO_PIN);
+    LogLevel savedLogLevel = consoleLogLevel;
+    consoleLogLevel = LOG_ERROR;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < pairs; i++) {
+        liftPen();
+        lowerPen();
     }
-    return true;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    consoleLogLevel = savedLogLevel;
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int setCount = mockPWMSetCount;
+    pwmBackend.close(SERVO_PIN);
+
+    if (setCount != 2 * pairs) {
+        logToConsole(LOG_ERROR) << "Error, only " << setCount << " of the " << 2 * pairs
+                                << " pen commands got to the PWM backend.";
+        return 1;
+    }
+    logToConsole(LOG_INFO) << "pairs, time (s), per command (ns), PWM set p50 (ns), PWM set p99 (ns), simulated "
+                              "servo time (s)";
+    logToConsole(LOG_INFO) << pairs << ", " << seconds << ", " << seconds * 1e9 / (2.0 * pairs) << ", "
+                           << latencyPercentile(penPWMLatency, 50) << ", " << latencyPercentile(penPWMLatency, 99)
+                           << ", " << hardwareSeconds();
+    return 0;
 }
 
-//Tested successfully.
-bool gotoZero() {
-    while (stepMotor(X, CCW, 1 * 1000) || stepMotor(Y, CCW, 1 * 1000));
-    return true;
+double cpuSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-bool readGPIO(int gpio) {
-    //First check the direction of the GPIO:
-    return (bool) gpio_get_value(gpio);
+int runSelfTests() {
+    const char *names[] = {"line steps", "limit switch stops job", "limit switch edges", "tick times",
+                           "step stream checks"};
+    bool (*tests[])() = {testLineSteps, testLimitSwitchStopsJob, testLimitSwitchEdges, testTickTimes,
+                         testStepStreamChecks};
+    int numTests = sizeof(tests) / sizeof(tests[0]);
+    int numFailed = 0;
+    for (int i = 0; i < numTests; i++) {
+        bool passed = tests[i]();
+        logToConsole(passed ? LOG_INFO : LOG_ERROR) << (passed ? "PASS " : "FAIL ") << names[i];
+        if (!passed) {
+            numFailed++;
+        }
+    }
+    recordStepTrace = false;
+    stepTrace.clear();
+    logToConsole(LOG_INFO) << numTests - numFailed << " of " << numTests << " tests passed.";
+    return numFailed == 0 ? 0 : 1;
 }
 
-void startPWM(int gpio, int frequency, int dutyCycle) {
-    int gpioRequest;
-    if ((gpioRequest = gpio_is_requested(gpio)) < 0) {
-        perror("gpio_is_requested");
-        throw std::exception();
+bool selfTestCheck(bool condition, const std::string &what) {
+    if (!condition) {
+        logToConsole(LOG_ERROR) << "Check failed: " << what;
     }
+    return condition;
+}
 
-    std::string command = "fast-gpio pwm ";
-    std::string totalCommand =
-            command + std::to_string(gpio) + " " + std::to_string(frequency) + " " + std::to_string(dutyCycle);
-    system(totalCommand.c_str());
+void startSelfTestPlotter(int x, int y) {
+    useSimulatedHardware(x, y);
+    pwmBackend.open(SERVO_PIN);
+    currentX = x;
+    currentY = y;
+    positionTrusted = true;
+    recordStepTrace = true;
+    stepTrace.clear();
 }
 
-void stopPWM(int gpio) {
-    std::string command = "fast-gpio set ";
-    std::string totalCommand = command + std::to_string(gpio) + " 0";
-    system(totalCommand.c_str());
+bool testLineSteps() {
+    const int SEGMENTS[][2] = {{37, 11}, {11, 37}, {-11, 37}, {-37, 11}, {-37, -11}, {-11, -37}, {11, -37},
+                               {37, -11}, {25, 25}, {-25, 25}, {-25, -25}, {25, -25}, {19, 0}, {0, 19},
+                               {-19, 0}, {0, -19}, {1, 0}, {0, 0}};
+    const int START_X = (int) X_MAX / 2;
+    const int START_Y = (int) Y_MAX / 2;
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(SEGMENTS) / sizeof(SEGMENTS[0]); i++) {
+        int dx = SEGMENTS[i][0];
+        int dy = SEGMENTS[i][1];
+        startSelfTestPlotter(START_X, START_Y);
+        gotoPoint(START_X + dx, START_Y + dy);
+        passed = checkLineTrace(START_X, START_Y, dx, dy) && passed;
+    }
+    return passed;
 }
 
-bool liftPen() {
-    std::cout << "Lifted Pen." << std::endl;
-    startPWM(SERVO_PIN, SERVO_FREQUENCY, SERVO_UP_DUTY_CYCLE);
-    usleep(SERVO_CHANGE_TIME);
-    return true;
+bool testLimitSwitchStopsJob() {
+    startSelfTestPlotter(100, 100);
+    simulatedX = 20;
+    bool savedFitCurves = fitCurves;
+    fitCurves = false;
+    Point points[] = {{100, 100}, {40, 100}, {40, 160}, {100, 160}, {0, NAN}, {200, 200}, {300, 300}};
+    ArrayPointCursor cursor;
+    cursor.points.points = points;
+    cursor.points.numPoints = sizeof(points) / sizeof(points[0]);
+    cursor.next = 0;
+    PointSource source;
+    source.next = nextArrayPoint;
+    source.context = &cursor;
+    drawPointSource(source);
+    fitCurves = savedFitCurves;
+
+    bool passed = selfTestCheck(stepTrace.size() == 20 && simulatedStepTrace.size() == 20,
+                                std::to_string(stepTrace.size()) + " ticks after a limit switch stopped it, instead "
+                                                                   "of the 20 it took to get to the switch");
+    passed = selfTestCheck(simulatedX == 0 && simulatedY == 100 && simulatedLimitCrashes == 0,
+                           "the carriage didn't stop at the limit switch") && passed;
+    passed = selfTestCheck(mockPWMDutyCycle == SERVO_UP_DUTY_CYCLE, "the pen didn't get lifted") && passed;
+    passed = selfTestCheck(!positionTrusted, "the position is still trusted") && passed;
+    AXIS axis;
+    Direction direction;
+    passed = selfTestCheck(getLimitSwitchTrip(&axis, &direction) && axis == X && direction == CCW,
+                           "the trip didn't say it was the X axis minimum limit switch") && passed;
+    return passed;
 }
 
-bool lowerPen() {
-    std::cout << "Lowered Pen." << std::endl;
-    startPWM(SERVO_PIN, SERVO_FREQUENCY, SERVO_DOWN_DUTY_CYCLE);
-    usleep(SERVO_CHANGE_TIME);
-    return true;
+bool testLimitSwitchEdges() {
+    startSelfTestPlotter(100, 100);
+    if (!selfTestCheck(startLimitSwitchMonitor(SIMULATED_LIMIT_EDGE_SOURCE), "the limit switch monitor didn't start")) {
+        return false;
+    }
+    AXIS axis;
+    Direction direction;
+    bool passed = selfTestCheck(!getLimitSwitchTrip(&axis, &direction), "a switch was tripped before any edges");
+
+    simulateLimitSwitchEdge(limitSwitchIndex(X, CW), true);
+    passed = selfTestCheck(waitForLimitSwitch(X, CW, true), "the monitor never saw the X maximum switch get pressed")
+             && passed;
+    passed = selfTestCheck(getLimitSwitchTrip(&axis, &direction) && axis == X && direction == CW,
+                           "the trip didn't say it was the X axis maximum limit switch") && passed;
+    passed = selfTestCheck(!stepMotors(1, 1) && stepMotors(-1, 1),
+                           "stepping into the pressed switch wasn't refused, or stepping away from it was") && passed;
+
+    //The first switch that got hit is the one that gets reported.
+    simulateLimitSwitchEdge(limitSwitchIndex(Y, CCW), true);
+    passed = selfTestCheck(waitForLimitSwitch(Y, CCW, true), "the monitor never saw the Y minimum switch get pressed")
+             && passed;
+    passed = selfTestCheck(getLimitSwitchTrip(&axis, &direction) && axis == X && direction == CW,
+                           "the second switch replaced the first trip") && passed;
+
+    simulateLimitSwitchEdge(limitSwitchIndex(X, CW), false);
+    simulateLimitSwitchEdge(limitSwitchIndex(Y, CCW), false);
+    passed = selfTestCheck(waitForLimitSwitch(X, CW, false) && waitForLimitSwitch(Y, CCW, false),
+                           "the monitor never saw the switches get let go") && passed;
+    passed = selfTestCheck(stepMotors(1, -1), "stepping didn't work again after the switches got let go") && passed;
+    clearLimitSwitchTrip();
+    passed = selfTestCheck(!getLimitSwitchTrip(&axis, &direction), "the trip didn't get cleared") && passed;
+
+    //A job that heads into a pressed switch can't take a single step, and the trip says why.
+    simulateLimitSwitchEdge(limitSwitchIndex(Y, CW), true);
+    passed = selfTestCheck(waitForLimitSwitch(Y, CW, true), "the monitor never saw the Y maximum switch get pressed")
+             && passed;
+    stepTrace.clear();
+    Point points[] = {{100, 100}, {100, 140}};
+    ArrayPointCursor cursor;
+    cursor.points.points = points;
+    cursor.points.numPoints = sizeof(points) / sizeof(points[0]);
+    cursor.next = 0;
+    PointSource source;
+    source.next = nextArrayPoint;
+    source.context = &cursor;
+    drawPointSource(source);
+    passed = selfTestCheck(stepTrace.empty(), std::to_string(stepTrace.size()) + " ticks into a pressed switch")
+             && passed;
+    passed = selfTestCheck(getLimitSwitchTrip(&axis, &direction) && axis == Y && direction == CW,
+                           "the trip didn't say it was the Y axis maximum limit switch") && passed;
+
+    stopLimitSwitchMonitor();
+    return passed;
 }
 
-bool openLogFile(const char filename[]) {
-    logFile.open(filename);
+bool testTickTimes() {
+    startSelfTestPlotter(100, 100);
+    Point points[] = {{100, 100}, {1100, 100}, {1100, 900}, {300, 1500}};
+    ArrayPointCursor cursor;
+    cursor.points.points = points;
+    cursor.points.numPoints = sizeof(points) / sizeof(points[0]);
+    cursor.next = 0;
+    PointSource source;
+    source.next = nextArrayPoint;
+    source.context = &cursor;
+    drawPointSource(source);
+
+    int shortest = stepTrace.empty() ? 0 : stepTrace[0].tickTime;
+    for (size_t i = 0; i < stepTrace.size(); i++) {
+        shortest = std::min(shortest, stepTrace[i].tickTime);
+    }
+    bool passed = selfTestCheck(shortest >= STEP_PULSE_TIME + MIN_STEP_LOW_TIME,
+                                "a tick only took " + std::to_string(shortest) + "us, which is shorter than a " +
+                                std::to_string(STEP_PULSE_TIME) + "us pulse and " +
+                                std::to_string(MIN_STEP_LOW_TIME) + "us off");
+    passed = selfTestCheck(shortest == (int) (1000000.0f / CRUISE_SPEED),
+                           "it never got up to CRUISE_SPEED (the shortest tick was " + std::to_string(shortest) +
+                           "us)") && passed;
+    return passed;
 }
 
-bool closeLogFile() {
-    logFile.close();
+bool testStepStreamChecks() {
+    stepStreamRecords.clear();
+    stepStreamX = 0;
+    stepStreamY = 0;
+    stepStreamMinX = 0;
+    stepStreamMaxX = 0;
+    stepStreamMinY = 0;
+    stepStreamMaxY = 0;
+    stepStreamTicks = 0;
+    //That's pen down, 10 ticks right, 5 diagonal, 3 down and pen up, so 5 records.
+    recordStepStreamPen(true);
+    for (int i = 0; i < 10; i++) {
+        recordStepStreamTick(1, 0, 500);
+    }
+    for (int i = 0; i < 5; i++) {
+        recordStepStreamTick(1, 1, 500);
+    }
+    for (int i = 0; i < 3; i++) {
+        recordStepStreamTick(0, -1, 400);
+    }
+    recordStepStreamPen(false);
+
+    StepStreamHeader header;
+    memcpy(header.magic, STEP_STREAM_MAGIC, sizeof(header.magic));
+    header.version = STEP_STREAM_VERSION;
+    header.numRecords = (uint32_t) stepStreamRecords.size();
+    header.checksum = 0;
+    header.minX = stepStreamMinX;
+    header.minY = stepStreamMinY;
+    header.maxX = stepStreamMaxX;
+    header.maxY = stepStreamMaxY;
+    header.endX = stepStreamX;
+    header.endY = stepStreamY;
+    header.numTicks = stepStreamTicks;
+    header.predictedMilliseconds = 0;
+    const char *problem = checkStepStreamRecords(header, stepStreamRecords.data());
+    bool passed = selfTestCheck(header.numRecords == 5 && problem == nullptr,
+                                std::string("the recorded stream didn't pass: ") + (problem ? problem : "") + " (" +
+                                std::to_string(header.numRecords) + " records)");
+
+    const char *breakages[] = {"a record that isn't steps or a pen change", "a step of 2", "a 0us tick",
+                               "a header with an extra tick", "a header with a bigger box",
+                               "a header with the wrong end"};
+    int numBreakages = sizeof(breakages) / sizeof(breakages[0]);
+    for (int i = 0; i < numBreakages && passed; i++) {
+        std::vector<StepStreamRecord> records = stepStreamRecords;
+        StepStreamHeader broken = header;
+        switch (i) {
+            case 0:
+                records[1].type = 3;
+                break;
+            case 1:
+                records[2].stepX = 2;
+                break;
+            case 2:
+                records[3].stepTime = 0;
+                break;
+            case 3:
+                broken.numTicks++;
+                break;
+            case 4:
+                broken.maxX++;
+                break;
+            default:
+                broken.endY--;
+                break;
+        }
+        passed = selfTestCheck(checkStepStreamRecords(broken, records.data()) != nullptr,
+                               std::string("it didn't notice ") + breakages[i]) && passed;
+    }
+    stepStreamRecords.clear();
+    return passed;
+}
+
+bool waitForLimitSwitch(AXIS axis, Direction direction, bool pressed) {
+    for (int i = 0; i < 1000; i++) {
+        if (limitSwitchPressed(axis, direction) == pressed) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+bool checkLineTrace(int startX, int startY, int dx, int dy) {
+    std::ostringstream segment;
+    segment << "(" << dx << ", " << dy << "): ";
+    int stepsX = 0;
+    int stepsY = 0;
+    int diagonalTicks = 0;
+    int firstTickX = -1;
+    int firstTickY = -1;
+    bool rightWay = true;
+    bool tickTimesRight = true;
+    for (size_t i = 0; i < stepTrace.size(); i++) {
+        const StepTick &tick = stepTrace[i];
+        stepsX += abs(tick.stepX);
+        stepsY += abs(tick.stepY);
+        //A step the wrong way would have to be taken back, so there'd be more than |dx| + |dy| steps.
+        rightWay = rightWay && tick.stepX * dx >= 0 && tick.stepY * dy >= 0;
+        tickTimesRight = tickTimesRight && tick.tickTime == 2 * STEP_TIME;
+        if (tick.stepX != 0 && tick.stepY != 0) {
+            diagonalTicks++;
+        }
+        if (tick.stepX != 0 && firstTickX < 0) {
+            firstTickX = (int) i;
+        }
+        if (tick.stepY != 0 && firstTickY < 0) {
+            firstTickY = (int) i;
+        }
+    }
+    int ticks = (int) stepTrace.size();
+    int lowerBound = std::max(abs(dx), abs(dy));
+    bool passed = selfTestCheck(ticks == lowerBound, segment.str() + "took " + std::to_string(ticks) +
+                                                     " ticks instead of " + std::to_string(lowerBound));
+    passed = selfTestCheck(stepsX == abs(dx) && stepsY == abs(dy) && rightWay,
+                           segment.str() + "took " + std::to_string(stepsX) + " x steps and " +
+                           std::to_string(stepsY) + " y steps") && passed;
+    passed = selfTestCheck(currentX == startX + dx && currentY == startY + dy && simulatedX == currentX &&
+                           simulatedY == currentY, segment.str() + "ended up in the wrong place") && passed;
+    passed = selfTestCheck(diagonalTicks == std::min(abs(dx), abs(dy)),
+                           segment.str() + "only stepped both motors together " + std::to_string(diagonalTicks) +
+                           " times") && passed;
+
+    //A line never changes direction, so the only extra time is each direction pin settling before its motor's first
+    //step (just once, if they both start in the same tick).
+    int settles = (firstTickX >= 0) + (firstTickY >= 0 && firstTickY != firstTickX);
+    long expected = ticks * 2L * STEP_TIME + settles * std::max(xAxis.settleTime, yAxis.settleTime);
+    long elapsed = (long) (simulatedClock.tv_sec * 1000000L + simulatedClock.tv_nsec / 1000);
+    passed = selfTestCheck(tickTimesRight && elapsed == expected,
+                           segment.str() + "took " + std::to_string(elapsed) + "us instead of " +
+                           std::to_string(expected) + "us") && passed;
+    return passed;
 }
 
-int main(const int argc, const char *const argv[]) {
+int main(int argc, const char *const argv[]) {
+    startLogger();
+    int result = runCommand(argc, argv);
+    stopLogger();
+    return result;
+}
 
-    std::cout << "Did you remember to set uart1 to gpio?" << std::endl;
+int runCommand(int argc, const char *const argv[]) {
+
+    //These can go in front of anything else, in any order:
+    //verbose prints everything, including every point and every move.
+    //simulate does the same thing, but on the simulated plotter, so it runs in milliseconds without an Omega, and
+    //writes down every step it took in SIMULATED_TRACE_FILE_NAME.
+    //rehome ignores HOME_STATE_FILE_NAME, so it goes to zero even if the last run left it homed.
+    //chords draws everything as lines (G-code arcs too), instead of fitting arcs and Béziers through the points.
+    bool rehome = false;
+    while (argc > 1) {
+        if (strcmp(argv[1], "verbose") == 0) {
+            consoleLogLevel = LOG_DEBUG;
+        } else if (strcmp(argv[1], "simulate") == 0) {
+            useSimulatedHardware(SIMULATED_START_X, SIMULATED_START_Y);
+        } else if (strcmp(argv[1], "rehome") == 0) {
+            rehome = true;
+        } else if (strcmp(argv[1], "chords") == 0) {
+            fitCurves = false;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+    //If the last run left the plotter homed, start from where it left it instead of going to zero again.
+    if (!simulatingHardware && !rehome) {
+        loadHomeState();
+    }
 
-    requestGPIOAndSetDirectionOutput(X_AXIS_DIRECTION_GPIO);
-    requestGPIOAndSetDirectionOutput(X_AXIS_STEP_GPIO);
-    requestGPIOAndSetDirectionOutput(Y_AXIS_DIRECTION_GPIO);
-    requestGPIOAndSetDirectionOutput(Y_AXIS_STEP_GPIO);
+    //self-test runs the checks on the simulated plotter.
+    if (argc > 1 && strcmp(argv[1], "self-test") == 0) {
+        return runSelfTests();
+    }
 
-    requestGPIOAndSetDirectionInput(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
-    requestGPIOAndSetDirectionInput(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
-    requestGPIOAndSetDirectionInput(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
-    requestGPIOAndSetDirectionInput(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
+    //benchmark-eval <"f(x)"> times how fast the expression can be worked out. It doesn't need the plotter.
+    if (argc > 2 && strcmp(argv[1], "benchmark-eval") == 0) {
+        return benchmarkPolynomialEvaluation(argv[2]);
+    }
 
-    openLogFile(LOG_FILE_NAME);
+    //benchmark-parse [<"f(x)"> ...] times how fast expressions compile (the parse benchmark corpus if there aren't any).
+    if (argc > 1 && strcmp(argv[1], "benchmark-parse") == 0) {
+        return benchmarkExpressionParsing(argc - 2, argv + 2);
+    }
 
-    if (argc < 5) {
-        std::cout << "Usage: <\"ax^b+cx^d+...\">, <xMin>, <xMax>, <yMin>, <yMax>," << std::endl;
-        return 0;
+    //benchmark-pen [pairs] times lifting and lowering the pen against the mock PWM backend.
+    if (argc > 1 && strcmp(argv[1], "benchmark-pen") == 0) {
+        return benchmarkPenCommands(argc > 2 ? atoi(argv[2]) : PEN_BENCHMARK_PAIRS);
+    }
+
+    //benchmark-plot [output file] plots every case in the benchmark corpus on the simulated plotter.
+    if (argc > 1 && strcmp(argv[1], "benchmark-plot") == 0) {
+        return benchmarkPlotting(argc > 2 ? argv[2] : PLOT_BENCHMARK_FILE_NAME);
+    }
+
+    //compile <stream file> <"f(x)"> <xMin> <xMax> <yMin> <yMax> (or compile <stream file> batch <job file>)
+    //plans everything and writes every tick into the stream file. replay <stream file> draws it.
+    if (argc > 3 && strcmp(argv[1], "compile") == 0) {
+        std::vector<std::string> expressions;
+        std::vector<ArrayOfPoints> curves;
+        std::vector<SimplificationReport> simplificationReports;
+        if (strcmp(argv[3], "batch") == 0) {
+            if (argc < 5 || !loadBatchJob(argv[4], &expressions, &curves, &simplificationReports)) {
+                return 1;
+            }
+        } else {
+            ArrayOfPoints points;
+            SimplificationReport simplificationReport;
+            if (argc < 8 || !planCurve(argv[3], atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), atoi(argv[7]), &points,
+                                       &simplificationReport)) {
+                logToConsole(LOG_INFO) << "Usage: compile <stream file> <\"f(x)\">, <xMin>, <xMax>, <yMin>, "
+                                       << "<yMax>";
+                return 1;
+            }
+            curves.push_back(points);
+        }
+        int result = compileStepStream(argv[2], curves);
+        for (size_t i = 0; i < curves.size(); i++) {
+            delete[] curves[i].points;
+        }
+        return result;
+    }
+    if (argc > 2 && strcmp(argv[1], "replay") == 0) {
+        return replayStepStream(argv[2]);
     }
 
+    //dry-run <"f(x)"> <xMin> <xMax> <yMin> <yMax> (or dry-run batch <job file>) says how long it would take.
+    if (argc > 2 && strcmp(argv[1], "dry-run") == 0) {
+        std::vector<std::string> expressions;
+        std::vector<ArrayOfPoints> curves;
+        std::vector<SimplificationReport> simplificationReports;
+        if (strcmp(argv[2], "batch") == 0) {
+            if (argc < 4 || !loadBatchJob(argv[3], &expressions, &curves, &simplificationReports)) {
+                return 1;
+            }
+        } else {
+            ArrayOfPoints points;
+            SimplificationReport simplificationReport;
+            if (argc < 7 || !planCurve(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), &points,
+                                       &simplificationReport)) {
+                logToConsole(LOG_INFO) << "Usage: dry-run <\"f(x)\">, <xMin>, <xMax>, <yMin>, <yMax>";
+                return 1;
+            }
+            curves.push_back(points);
+        }
+        int result = dryRun(curves);
+        for (size_t i = 0; i < curves.size(); i++) {
+            delete[] curves[i].points;
+        }
+        return result;
+    }
+
+    //stream <"f(x)"> <points> <xMin> <xMax> <yMin> <yMax> draws that many evenly spaced points, straight from the
+    //expression into the planner without ever keeping them, so it can be millions of points.
+    if (argc > 1 && strcmp(argv[1], "stream") == 0) {
+        CompiledExpression expression;
+        std::string error;
+        if (argc < 8) {
+            logToConsole(LOG_INFO) << "Usage: stream <\"f(x)\">, <points>, <xMin>, <xMax>, <yMin>, <yMax>";
+            return 1;
+        }
+        if (!compileExpression(argv[2], &expression, &error)) {
+            logToConsole(LOG_ERROR) << "Error, \"" << argv[2] << "\" is not valid: " << error;
+            return 1;
+        }
+        long numPoints = atol(argv[3]);
+        float xMin = atoi(argv[4]);
+        float xMax = atoi(argv[5]);
+        float yMin = atoi(argv[6]);
+        float yMax = atoi(argv[7]);
+        if (xMax <= xMin || yMax <= yMin || numPoints < 2) {
+            logToConsole(LOG_ERROR) << "Error, the window is empty or there aren't at least 2 points.";
+            freeCompiledExpression(expression);
+            return 1;
+        }
+
+        setupPlotter();
+        StatisticalData statisticalData = drawUniformPolynomial(expression, xMin, xMax, yMin, yMax, numPoints, true);
+        SimplificationReport simplificationReport;
+        simplificationReport.pointsBefore = numPoints;
+        simplificationReport.pointsAfter = numPoints;
+        simplificationReport.pointsRemoved = 0;
+        simplificationReport.timeBefore = 0;
+        simplificationReport.timeAfter = 0;
+        logToFile() << "X-Y Plotter Log File:";
+        logToFile() << "Streamed " << numPoints << " points of " << argv[2];
+        logStatisticalData(statisticalData, simplificationReport);
+        logStepTimingStatistics();
+        logToFile() << "";
+        shutdownPlotter();
+        freeCompiledExpression(expression);
+        return 0;
+    }
 
-    PolynomialFunction function = stringToPolynomialFunction(argv[1]);
+    //gcode [file] draws G-code from the file, or from stdin if there isn't one (or it's "-").
+    if (argc > 1 && strcmp(argv[1], "gcode") == 0) {
+        return runGcodeJob(argc > 2 ? argv[2] : "-");
+    }
 
-    if(function.components == nullptr) {
-        std::cout << "Error, please input valid characters: \"" << argv[1] << "\" is not valid." << std::endl;
+    //batch <job file> [trace] draws every curve in the job file in one go.
+    if (argc > 2 && strcmp(argv[1], "batch") == 0) {
+        if (argc > 3 && strcmp(argv[3], "trace") == 0) {
+            recordStepTrace = true;
+        }
+        return runBatchJob(argv[2]);
+    }
 
+    if (argc < 6) {
+        logToConsole(LOG_INFO) << "Usage: <\"f(x)\">, <xMin>, <xMax>, <yMin>, <yMax>, [trace]";
+        logToConsole(LOG_INFO) << "       batch <job file>, [trace]";
+        logToConsole(LOG_INFO) << "       stream <\"f(x)\">, <points>, <xMin>, <xMax>, <yMin>, <yMax>";
+        logToConsole(LOG_INFO) << "       gcode, [file]";
+        logToConsole(LOG_INFO) << "       compile <stream file>, <\"f(x)\">, <xMin>, <xMax>, <yMin>, <yMax>";
+        logToConsole(LOG_INFO) << "       compile <stream file>, batch <job file>";
+        logToConsole(LOG_INFO) << "       replay <stream file>";
+        logToConsole(LOG_INFO) << "       dry-run <\"f(x)\">, <xMin>, <xMax>, <yMin>, <yMax>";
+        logToConsole(LOG_INFO) << "       dry-run batch <job file>";
+        logToConsole(LOG_INFO) << "       simulate <any of the above>";
+        logToConsole(LOG_INFO) << "       verbose <any of the above>";
+        logToConsole(LOG_INFO) << "       rehome <any of the above>";
+        logToConsole(LOG_INFO) << "       chords <any of the above>";
+        logToConsole(LOG_INFO) << "       benchmark-plot, [output file]";
+        logToConsole(LOG_INFO) << "       benchmark-pen, [pairs]";
+        logToConsole(LOG_INFO) << "       benchmark-eval <\"f(x)\">";
+        logToConsole(LOG_INFO) << "       benchmark-parse, [<\"f(x)\"> ...]";
+        logToConsole(LOG_INFO) << "       self-test";
+        logToConsole(LOG_INFO) << "f(x) can have + - * / ^, parentheses, x, pi, sin, cos, exp and sqrt, like "
+                               << "\"3/4x^2 - 2(x + 1)\" or \"exp(-x^2)\".";
+        logToConsole(LOG_INFO) << "G-code can have G0 to G3, G20/G21, G90/G91, G90.1/G91.1, G28, M3/M4/M5 or Z for the "
+                               << "pen, and M2/M30. F and S don't do anything.";
+        logToConsole(LOG_INFO) << "It remembers where it left the plotter until the Omega restarts, so use rehome "
+                               << "after moving the carriage by hand.";
+        return 0;
     }
 
-    for (int i = 0; i < function.numComponents; i++) {
-        std::cout << "Polynomial Component " << function.components[i].constant << std::endl;
-        std::cout << "Polynomial Exponoent " << function.components[i].exponent << std::endl;
+    //"trace" at the end saves every step tick into the log file.
+    if (argc > 6 && strcmp(argv[6], "trace") == 0) {
+        recordStepTrace = true;
     }
 
     float xMin = atoi(argv[2]);
@@ -964,53 +7566,54 @@ int main(const int argc, const char *const argv[]) {
     float yMin = atoi(argv[4]);
     float yMax = atoi(argv[5]);
 
-    int numPoints = 100;
+    ArrayOfPoints arrayOfPoints;
+    SimplificationReport simplificationReport;
+    if (!planCurve(argv[1], xMin, xMax, yMin, yMax, &arrayOfPoints, &simplificationReport)) {
+        return 1;
+    }
 
-    ArrayOfPoints arrayOfPoints = createArrayOfPolynomialPoints(function, function.numComponents, xMax, yMin, yMax,
-                                                                xMin, numPoints);
+    int numPoints = arrayOfPoints.numPoints;
     //Print everything out human readable:
     for (int i = 0; i < numPoints; i++) {
-        std::cout << "Point " << i + 1 << ": (" << arrayOfPoints.points[i].x << ", " << arrayOfPoints.points[i].y << ")"
-                  << std::endl;
+        logToConsole(LOG_DEBUG) << "Point " << i + 1 << ": (" << arrayOfPoints.points[i].x << ", "
+                                << arrayOfPoints.points[i].y << ")";
     }
 
     //Print everything out machine readable:
     for (int i = 0; i < numPoints; i++) {
-        std::cout << arrayOfPoints.points[i].x << ", " << arrayOfPoints.points[i].y << std::endl;
+        logToConsole(LOG_DEBUG) << arrayOfPoints.points[i].x << ", " << arrayOfPoints.points[i].y;
     }
 
-    StatisticalData statisticalData = drawPolynomial(arrayOfPoints);
+    PlotEstimate estimate = estimatePlot(arrayOfPoints, !positionTrusted);
+    printPlotEstimate(estimate);
+
+    setupPlotter();
+
+    StatisticalData statisticalData = drawPolynomial(arrayOfPoints, true);
 
-    logFile << "X-Y Plotter Log File:\n";
-    logFile << "Statistical Data: \n";
-    logFile << "Length of function: " << (statisticalData.lengthOfFunction* 0.2278) / 10.0 << "cm" << "\n";
-    logFile << "Length of time to draw function: " << statisticalData.lengthOfTime << "s" << "\n";
-    logFile << "Line drawing Speed: " << ((statisticalData.lengthOfFunction* 0.2278) / 10.0) / statisticalData.lengthOfTime << "cm/s" << std::endl;
-    logFile << "\n\n";
-    logFile << "Points that the plotter draws: \n";
+    logToFile() << "X-Y Plotter Log File:";
+    logStatisticalData(statisticalData, simplificationReport);
+    logPlotEstimateComparison(estimate, statisticalData);
+    logStepTimingStatistics();
+    logToFile() << "";
+    logToFile() << "Points that the plotter draws: ";
     //Print everything out human readable:
     for (int i = 0; i < numPoints; i++) {
-        logFile << "Point " << i + 1 << ": (" << arrayOfPoints.points[i].x << ", " << arrayOfPoints.points[i].y << ")"
-                  << std::endl;
+        logToFile() << "Point " << i + 1 << ": (" << arrayOfPoints.points[i].x << ", " << arrayOfPoints.points[i].y
+                    << ")";
     }
-    logFile << "\n";
-    logFile << "\n";
-
-    closeLogFile();
-
-    std::cout << "Free GPIOs that are Outputs: " << std::endl;
-    freeGPIO(X_AXIS_DIRECTION_GPIO);
-    freeGPIO(X_AXIS_STEP_GPIO);
-    freeGPIO(Y_AXIS_DIRECTION_GPIO);
-    freeGPIO(Y_AXIS_STEP_GPIO);
+    logToFile() << "";
+    logToFile() << "";
 
-    std::cout << "Free GPIOs that are Inputs: " << std::endl;
-    freeGPIO(X_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
-    freeGPIO(X_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
-    freeGPIO(Y_AXIS_MAXIMUM_LIMIT_SWITCH_GPIO);
-    freeGPIO(Y_AXIS_MINIMUM_LIMIT_SWITCH_GPIO);
+    if (recordStepTrace) {
+        logToFile() << "Step trace (tick: stepX, stepY -> (x, y) tickTime): ";
+        writeStepTrace();
+        logToFile() << "";
+    }
 
+    shutdownPlotter();
 
+    delete[] arrayOfPoints.points;
     return 0;
 }
 